@@ -14,17 +14,131 @@
 #include "smk_malloc.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+
+#ifdef HAVE_PTHREAD_H
+	#include <pthread.h>
+#endif
+
+#ifdef HAVE_PREAD
+	#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+
+	#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+		#define MAP_ANONYMOUS MAP_ANON
+	#endif
+#endif
+
+/* ************************************************************************* */
+/* LOG Functions */
+/* ************************************************************************* */
+/* Diagnostics go to the callback set by smk_set_log_callback()
+	(stderr by default), and the last error code is kept per thread.
+	Building with SMK_QUIET drops all message formatting: errors only
+	record their code, and warnings vanish. */
+#if defined(_MSC_VER)
+	#define SMK_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+	#define SMK_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+	#define SMK_THREAD_LOCAL __thread
+#else
+	/* no thread-local storage known: one code for the whole process
+		(smacker.h says so) */
+	#define SMK_THREAD_LOCAL
+#endif
+
+/* code of the last error on this thread */
+static SMK_THREAD_LOCAL int smk_error_code = SMK_ERR_NONE;
+
+#ifdef SMK_QUIET
+	#define smk_error(code, ...) (smk_error_code = (code))
+	#define smk_warn(code, ...) ((void)0)
+#else
+	#define smk_error(code, ...) smk_log(SMK_LOG_ERROR, code, __VA_ARGS__)
+	#define smk_warn(code, ...) smk_log(SMK_LOG_WARNING, code, __VA_ARGS__)
+
+/* Default log callback: one line per message on stderr */
+static void smk_log_stderr(void * userdata, const int level, const int code, const char * message)
+{
+	(void)userdata;
+	(void)level;
+	(void)code;
+	fputs(message, stderr);
+	fputc('\n', stderr);
+}
+
+static smk_log_callback smk_log_fn = smk_log_stderr;
+static void * smk_log_userdata = NULL;
+
+/* Formats a message for the log callback, and records error codes.
+	Kept out of line, so error paths stay small in the decode loops. */
+#ifdef __GNUC__
+__attribute__((cold, noinline, format(printf, 3, 4)))
+#endif
+static void smk_log(const int level, const int code, const char * const format, ...)
+{
+	char message[512];
+	va_list ap;
+
+	if (level == SMK_LOG_ERROR)
+		smk_error_code = code;
+
+	if (!smk_log_fn)
+		return;
+
+	va_start(ap, format);
+	vsnprintf(message, sizeof(message), format, ap);
+	va_end(ap);
+	smk_log_fn(smk_log_userdata, level, code, message);
+}
+#endif
+
+void smk_set_log_callback(const smk_log_callback callback, void * userdata)
+{
+#ifndef SMK_QUIET
+	smk_log_fn = callback;
+	smk_log_userdata = userdata;
+#else
+	(void)callback;
+	(void)userdata;
+#endif
+}
+
+int smk_last_error(void)
+{
+	return smk_error_code;
+}
+
 /* ************************************************************************* */
 /* BITSTREAM Structure */
 /* ************************************************************************* */
-/* Wraps a block of memory and adds functions to read 1 or 8 bits at a time */
+/* Wraps a block of memory and reads bits from it through a 64-bit buffer.
+	The block must be followed by at least SMK_BS_PAD readable bytes:
+	refills load whole words without checking for the end of the block,
+	and overruns are only caught once per refill. */
+#define SMK_BS_PAD 8
+
 struct smk_bit_t {
+	/* next byte to load into the bit buffer, and end of the stream */
 	const unsigned char * buffer, * end;
-	unsigned int bit_num;
+	/* bit buffer: the next bit of the stream is the LSB */
+	uint64_t bits;
+	/* number of valid bits in the bit buffer */
+	unsigned int count;
+	/* bits left in the stream (negative once it has been overrun) */
+	int64_t left;
 };
 
 /* ************************************************************************* */
@@ -36,10 +150,72 @@ static void smk_bs_init(struct smk_bit_t * const bs, const unsigned char * const
 	/* null check */
 	assert(bs);
 	assert(b);
-	/* set up the pointer to bitstream start and end, and set the bit pointer to 0 */
+	/* set up the pointer to bitstream start and end, and empty the bit buffer */
 	bs->buffer = b;
 	bs->end = b + size;
-	bs->bit_num = 0;
+	bs->bits = 0;
+	bs->count = 0;
+	bs->left = (int64_t)size * 8;
+}
+
+/* Loads 8 bytes as a little-endian word
+	(compilers turn this into a single load where they can) */
+static uint64_t smk_bs_load(const unsigned char * const p)
+{
+	return (uint64_t)p[0] |
+		((uint64_t)p[1] << 8) |
+		((uint64_t)p[2] << 16) |
+		((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) |
+		((uint64_t)p[5] << 40) |
+		((uint64_t)p[6] << 48) |
+		((uint64_t)p[7] << 56);
+}
+
+/* Tops up the bit buffer to at least 56 bits.
+	Returns -1 if the stream has already been overrun. */
+static int smk_bs_refill(struct smk_bit_t * const bs)
+{
+	/* null check */
+	assert(bs);
+
+	/* don't die when running out of bits, but signal */
+	if (bs->left < 0) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_bs_refill(): ERROR: bitstream exhausted.");
+		return -1;
+	}
+
+	if (bs->buffer < bs->end) {
+		/* Load a whole word: bits above the ones accounted for are
+			loaded again (identically) by the next refill */
+		bs->bits |= smk_bs_load(bs->buffer) << bs->count;
+		bs->buffer += (63 - bs->count) >> 3;
+		bs->count |= 56;
+	} else {
+		/* Past the end: anything left in the buffer is padding */
+		bs->count = 64;
+	}
+
+	return 0;
+}
+
+/* Returns the next n bits (n <= 32) without consuming them.
+	The bit buffer must hold at least n bits. */
+static unsigned int smk_bs_peek(const struct smk_bit_t * const bs, const unsigned int n)
+{
+	assert(bs);
+	assert(n <= 32 && n <= bs->count);
+	return (unsigned int)(bs->bits & ((1ULL << n) - 1));
+}
+
+/* Consumes n bits from the bit buffer. */
+static void smk_bs_consume(struct smk_bit_t * const bs, const unsigned int n)
+{
+	assert(bs);
+	assert(n <= bs->count);
+	bs->bits >>= n;
+	bs->count -= n;
+	bs->left -= n;
 }
 
 /* Reads a bit
@@ -51,22 +227,17 @@ static int smk_bs_read_1(struct smk_bit_t * const bs)
 	assert(bs);
 
 	/* don't die when running out of bits, but signal */
-	if (bs->buffer >= bs->end) {
-		fputs("libsmacker::smk_bs_read_1(): ERROR: bitstream exhausted.\n", stderr);
+	if (bs->left < 1) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_bs_read_1(): ERROR: bitstream exhausted.");
 		return -1;
 	}
 
-	/* get next bit and store for return */
-	ret = (*bs->buffer >> bs->bit_num) & 1;
-
-	/* advance to next bit */
-	if (bs->bit_num >= 7) {
-		/* Out of bits in this byte: next! */
-		bs->buffer ++;
-		bs->bit_num = 0;
-	} else
-		bs->bit_num ++;
+	if (! bs->count)
+		smk_bs_refill(bs);
 
+	/* get next bit and store for return */
+	ret = bs->bits & 1;
+	smk_bs_consume(bs, 1);
 	return ret;
 }
 
@@ -74,106 +245,313 @@ static int smk_bs_read_1(struct smk_bit_t * const bs)
 	Returns -1 if error. */
 static int smk_bs_read_8(struct smk_bit_t * const bs)
 {
+	int ret;
 	/* null check */
 	assert(bs);
 
 	/* don't die when running out of bits, but signal */
-	if (bs->buffer + (bs->bit_num > 0) >= bs->end) {
-		fputs("libsmacker::smk_bs_read_8(): ERROR: bitstream exhausted.\n", stderr);
+	if (bs->left < 8) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_bs_read_8(): ERROR: bitstream exhausted.");
+		return -1;
+	}
+
+	if (bs->count < 8)
+		smk_bs_refill(bs);
+
+	ret = bs->bits & 0xFF;
+	smk_bs_consume(bs, 8);
+	return ret;
+}
+
+/* ************************************************************************* */
+/* LOOKUP TABLE Structure */
+/* ************************************************************************* */
+/* Huffman trees are first read into an array of nodes:
+	a branch holds the index of its right child (the left child follows it),
+	a leaf holds its value. */
+#define SMK_NODE_BRANCH    0x80000000
+#define SMK_NODE_CACHE     0x40000000
+#define SMK_NODE_LEAF_MASK 0x3FFFFFFF
+
+/* The array is then flattened into a multi-level lookup table.
+	A table is indexed by the next N bits of the stream, and each entry
+	is either a leaf (value, or cache escape, plus the code length)
+	or a link to a sub-table that decodes the bits past this table. */
+#define SMK_LUT_MAX_BITS 10
+
+#define SMK_LUT_SUB        0x80000000
+#define SMK_LUT_CACHE      0x40000000
+#define SMK_LUT_VALUE_MASK 0x0000FFFF
+#define SMK_LUT_LEN(e)        (((e) >> 16) & 0x1F)
+#define SMK_LUT_SUB_BITS(e)   (((e) >> 26) & 0x0F)
+#define SMK_LUT_SUB_OFFSET(e) ((e) & 0x03FFFFFF)
+/* offsets must fit in the entry */
+#define SMK_LUT_MAX_SIZE      0x04000000
+
+/* Size bound of a table with root width max_bits for a tree of n nodes:
+	the root table, plus at most 2 entries per node in sub-tables */
+#define SMK_LUT_SIZE(max_bits, n) ((1U << (max_bits)) + 2 * (n))
+
+/* ************************************************************************* */
+/* LOOKUP TABLE Functions */
+/* ************************************************************************* */
+/* Picks the index width of the lookup table for the sub-tree at node.
+	The root table is as wide as the tree allows, up to max_bits.
+	Sub-tables only widen while at least half their entries are distinct
+	codes: this keeps sparse (deep) trees from blowing up the table size. */
+static unsigned int smk_lut_width(const unsigned int * const tree, const size_t node, const unsigned int max_bits, const int root)
+{
+	/* branch nodes at the current and next depth */
+	size_t level[2][1 << (SMK_LUT_MAX_BITS - 1)];
+	size_t child[2];
+	unsigned int depth, width = 0, count = 1, next, leaves = 0, i, j;
+	assert(tree);
+	assert(max_bits <= SMK_LUT_MAX_BITS);
+
+	/* a leaf at the top needs no bits at all */
+	if (! (tree[node] & SMK_NODE_BRANCH))
+		return 0;
+
+	level[0][0] = node;
+
+	for (depth = 1; depth <= max_bits && count; depth ++) {
+		const size_t * const cur = level[(depth - 1) & 1];
+		size_t * const nxt = level[depth & 1];
+		next = 0;
+
+		for (i = 0; i < count; i ++) {
+			/* left child follows its parent, right child is at the jump address */
+			child[0] = cur[i] + 1;
+			child[1] = tree[cur[i]] & SMK_NODE_LEAF_MASK;
+
+			for (j = 0; j < 2; j ++) {
+				if (tree[child[j]] & SMK_NODE_BRANCH) {
+					if (depth < max_bits)
+						nxt[next] = child[j];
+
+					next ++;
+				} else
+					leaves ++;
+			}
+		}
+
+		/* leaves so far, plus branches at this depth, are the distinct entries */
+		if (root || (1U << depth) <= 2 * (leaves + next))
+			width = depth;
+
+		count = next;
+	}
+
+	return width;
+}
+
+/* Fills the 2^width entries at lut[offset] for the sub-tree at node.
+	Branches that reach past the table are marked as unresolved links,
+	holding their tree node until a sub-table is built for them. */
+static void smk_lut_fill(unsigned int * const lut, const size_t offset, const unsigned int width, const unsigned int * const tree, const size_t node)
+{
+	/* explicit DFS stack: node, depth, code so far */
+	size_t stack_node[2 * SMK_LUT_MAX_BITS + 2], n;
+	unsigned int stack_depth[2 * SMK_LUT_MAX_BITS + 2], stack_code[2 * SMK_LUT_MAX_BITS + 2];
+	unsigned int sp = 1, depth, code, entry, i;
+	assert(lut);
+	assert(tree);
+
+	stack_node[0] = node;
+	stack_depth[0] = 0;
+	stack_code[0] = 0;
+
+	while (sp) {
+		sp --;
+		n = stack_node[sp];
+		depth = stack_depth[sp];
+		code = stack_code[sp];
+
+		if (! (tree[n] & SMK_NODE_BRANCH)) {
+			/* leaf: every index starting with this code decodes to it */
+			if (tree[n] & SMK_NODE_CACHE)
+				entry = SMK_LUT_CACHE | (tree[n] & SMK_NODE_LEAF_MASK);
+			else
+				entry = tree[n] & SMK_LUT_VALUE_MASK;
+
+			entry |= (depth << 16);
+
+			for (i = code; i < (1U << width); i += (1U << depth))
+				lut[offset + i] = entry;
+		} else if (depth == width) {
+			/* code continues past this table */
+			lut[offset + code] = SMK_LUT_SUB | n;
+		} else {
+			/* bits are read LSB-first, so bit (depth) of the index picks the branch */
+			stack_node[sp] = tree[n] & SMK_NODE_LEAF_MASK;
+			stack_depth[sp] = depth + 1;
+			stack_code[sp] = code | (1U << depth);
+			sp ++;
+			stack_node[sp] = n + 1;
+			stack_depth[sp] = depth + 1;
+			stack_code[sp] = code;
+			sp ++;
+		}
+	}
+}
+
+/* Converts a tree array into a lookup table of at most capacity entries,
+	with a root table up to max_bits wide (its width is stored to bits).
+	Returns the number of entries used, or 0 on error. */
+static size_t smk_lut_build(unsigned int * const lut, const size_t capacity, unsigned int * const bits, const unsigned int max_bits, const unsigned int * const tree)
+{
+	size_t used, i, node;
+	unsigned int width;
+	/* null check */
+	assert(lut);
+	assert(bits);
+	assert(tree);
+
+	*bits = smk_lut_width(tree, 0, max_bits, 1);
+	smk_lut_fill(lut, 0, *bits, tree, 0);
+	used = (1U << *bits);
+
+	/* Resolve links in table order: new sub-tables are appended,
+		so they are visited (and their own links resolved) later on. */
+	for (i = 0; i < used; i ++) {
+		if ((lut[i] & SMK_LUT_SUB) && SMK_LUT_SUB_BITS(lut[i]) == 0) {
+			node = SMK_LUT_SUB_OFFSET(lut[i]);
+			width = smk_lut_width(tree, node, max_bits, 0);
+
+			if (used + (1U << width) > capacity) {
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_lut_build() - ERROR: lookup table overflow");
+				return 0;
+			}
+
+			lut[i] = SMK_LUT_SUB | (width << 26) | used;
+			smk_lut_fill(lut, used, width, tree, node);
+			used += (1U << width);
+		}
+	}
+
+	return used;
+}
+
+/* Decodes one symbol through a lookup table with a root table bits wide.
+	Returns the leaf (value, and cache flag), or -1 on error. */
+static int smk_lut_lookup(const unsigned int * const lut, unsigned int bits, struct smk_bit_t * const bs)
+{
+	unsigned int entry;
+	/* null check */
+	assert(lut);
+	assert(bs);
+
+	/* peek at the root table, then follow links for longer codes */
+	if (bs->count < SMK_LUT_MAX_BITS && smk_bs_refill(bs) < 0) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_lut_lookup() - ERROR: bitstream exhausted");
 		return -1;
 	}
 
-	if (bs->bit_num) {
-		/* unaligned read */
-		int ret = *bs->buffer >> bs->bit_num;
-		bs->buffer ++;
-		return ret | (*bs->buffer << (8 - bs->bit_num) & 0xFF);
+	entry = lut[smk_bs_peek(bs, bits)];
+
+	while (entry & SMK_LUT_SUB) {
+		smk_bs_consume(bs, bits);
+
+		if (bs->count < SMK_LUT_MAX_BITS && smk_bs_refill(bs) < 0) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_lut_lookup() - ERROR: bitstream exhausted");
+			return -1;
+		}
+
+		bits = SMK_LUT_SUB_BITS(entry);
+		entry = lut[SMK_LUT_SUB_OFFSET(entry) + smk_bs_peek(bs, bits)];
 	}
 
-	/* aligned read */
-	return *bs->buffer++;
+	smk_bs_consume(bs, SMK_LUT_LEN(entry));
+	return entry & (SMK_LUT_CACHE | SMK_LUT_VALUE_MASK);
 }
 
 /* ************************************************************************* */
 /* HUFF8 Structure */
 /* ************************************************************************* */
-#define SMK_HUFF8_BRANCH 0x8000
-#define SMK_HUFF8_LEAF_MASK 0x7FFF
+/* Unfortunately, smk files do not store the alloc size of a small tree.
+	511 entries is the pessimistic case (N codes and N-1 branches,
+	with N=256 for 8 bits) */
+#define SMK_HUFF8_MAX_NODES 511
+#define SMK_HUFF8_LUT_BITS 8
+
+/* 16-bit audio decodes the low and high byte of a sample through one
+	joint table, where both codes fit in its index */
+#define SMK_HUFF8_JOINT_BITS 11
 
 struct smk_huff8_t {
-	/* Unfortunately, smk files do not store the alloc size of a small tree.
-		511 entries is the pessimistic case (N codes and N-1 branches,
-		with N=256 for 8 bits) */
-	size_t size;
-	unsigned short tree[511];
+	/* lookup table: root table first, then sub-tables */
+	unsigned int bits;
+	unsigned int lut[SMK_LUT_SIZE(SMK_HUFF8_LUT_BITS, SMK_HUFF8_MAX_NODES)];
 };
 
 /* ************************************************************************* */
 /* HUFF8 Functions */
 /* ************************************************************************* */
-/* Recursive sub-func for building a tree into an array. */
-static int _smk_huff8_build_rec(struct smk_huff8_t * const t, struct smk_bit_t * const bs)
+/* Reads a tree into an array, without recursion.
+	Branches whose left side is still being read are kept on a stack,
+	linked through their own jump entries (which are not known yet). */
+static int smk_huff8_build_tree(unsigned int * const tree, size_t * const size, struct smk_bit_t * const bs)
 {
+	/* stack of open branches: top index, and how many */
+	size_t top = 0, depth = 0, next;
 	int bit, value;
-	assert(t);
+	assert(tree);
+	assert(size);
 	assert(bs);
 
-	/* Make sure we aren't running out of bounds */
-	if (t->size >= 511) {
-		fputs("libsmacker::_smk_huff8_build_rec() - ERROR: size exceeded\n", stderr);
-		return 0;
-	}
-
-	/* Read the next bit */
-	if ((bit = smk_bs_read_1(bs)) < 0) {
-		fputs("libsmacker::_smk_huff8_build_rec() - ERROR: get_bit returned -1\n", stderr);
-		return 0;
-	}
-
-	if (bit) {
-		/* Bit set: this forms a Branch node.
-			what we have to do is build the left-hand branch,
-			assign the "jump" address,
-			then build the right hand branch from there.
-		*/
-		/* track the current index */
-		value = t->size ++;
-
-		/* go build the left branch */
-		if (! _smk_huff8_build_rec(t, bs)) {
-			fputs("libsmacker::_smk_huff8_build_rec() - ERROR: failed to build left sub-tree\n", stderr);
+	for (;;) {
+		/* Make sure we aren't running out of bounds */
+		if (*size >= SMK_HUFF8_MAX_NODES) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff8_build_tree() - ERROR: size exceeded");
 			return 0;
 		}
 
-		/* now go back to our current location, and
-			mark our location as a "jump" */
-		t->tree[value] = SMK_HUFF8_BRANCH | t->size;
-
-		/* continue building the right side */
-		if (! _smk_huff8_build_rec(t, bs)) {
-			fputs("libsmacker::_smk_huff8_build_rec() - ERROR: failed to build right sub-tree\n", stderr);
-			return 0;
-		}
-	} else {
-		/* Bit unset signifies a Leaf node. */
-		/* Attempt to read value */
-		if ((value = smk_bs_read_8(bs)) < 0) {
-			fputs("libsmacker::_smk_huff8_build_rec() - ERROR: get_byte returned -1\n", stderr);
+		/* Read the next bit */
+		if ((bit = smk_bs_read_1(bs)) < 0) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff8_build_tree() - ERROR: get_bit returned -1");
 			return 0;
 		}
 
-		/* store to tree */
-		t->tree[t->size ++] = value;
-	}
+		if (bit) {
+			/* Bit set: this forms a Branch node.
+				Push it, and go build the left-hand branch first:
+				the "jump" address is known once that is done. */
+			tree[*size] = top;
+			top = (*size) ++;
+			depth ++;
+		} else {
+			/* Bit unset signifies a Leaf node. */
+			/* Attempt to read value */
+			if ((value = smk_bs_read_8(bs)) < 0) {
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_huff8_build_tree() - ERROR: get_byte returned -1");
+				return 0;
+			}
 
-	return 1;
+			/* store to tree */
+			tree[(*size) ++] = value;
+
+			/* no open branches left: the tree is complete */
+			if (! depth)
+				return 1;
+
+			/* The leaf completes the left side of the innermost open branch:
+				mark it as a "jump" to here, where its right side starts. */
+			next = tree[top];
+			tree[top] = SMK_NODE_BRANCH | *size;
+			top = next;
+			depth --;
+		}
+	}
 }
 
 /**
-	Build an 8-bit Hufftree out of a Bitstream.
+	Build an 8-bit Hufftree out of a Bitstream,
+	straight into its lookup table.
 */
 static int smk_huff8_build(struct smk_huff8_t * const t, struct smk_bit_t * const bs)
 {
+	unsigned int tree[SMK_HUFF8_MAX_NODES];
+	size_t size = 0;
 	int bit;
 	/* null check */
 	assert(t);
@@ -181,32 +559,34 @@ static int smk_huff8_build(struct smk_huff8_t * const t, struct smk_bit_t * cons
 
 	/* Smacker huff trees begin with a set-bit. */
 	if ((bit = smk_bs_read_1(bs)) < 0) {
-		fputs("libsmacker::smk_huff8_build() - ERROR: initial get_bit returned -1\n", stderr);
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_huff8_build() - ERROR: initial get_bit returned -1");
 		return 0;
 	}
 
-	/* OK to fill out the struct now */
-	t->size = 0;
-
 	/* First bit indicates whether a tree is present or not. */
 	/*  Very small or audio-only files may have no tree. */
 	if (bit) {
-		if (! _smk_huff8_build_rec(t, bs)) {
-			fputs("libsmacker::smk_huff8_build() - ERROR: tree build failed\n", stderr);
+		if (! smk_huff8_build_tree(tree, &size, bs)) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff8_build() - ERROR: tree build failed");
 			return 0;
 		}
 	} else
-		t->tree[0] = 0;
+		tree[0] = 0;
 
 	/* huff trees end with an unset-bit */
 	if ((bit = smk_bs_read_1(bs)) < 0) {
-		fputs("libsmacker::smk_huff8_build() - ERROR: final get_bit returned -1\n", stderr);
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_huff8_build() - ERROR: final get_bit returned -1");
 		return 0;
 	}
 
 	/* a 0 is expected here, a 1 generally indicates a problem! */
 	if (bit) {
-		fputs("libsmacker::smk_huff8_build() - ERROR: final get_bit returned 1\n", stderr);
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_huff8_build() - ERROR: final get_bit returned 1");
+		return 0;
+	}
+
+	if (! smk_lut_build(t->lut, sizeof(t->lut) / sizeof(t->lut[0]), &t->bits, SMK_HUFF8_LUT_BITS, tree)) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_huff8_build() - ERROR: failed to build lookup table");
 		return 0;
 	}
 
@@ -217,40 +597,107 @@ static int smk_huff8_build(struct smk_huff8_t * const t, struct smk_bit_t * cons
 	Return -1 on error. */
 static int smk_huff8_lookup(const struct smk_huff8_t * const t, struct smk_bit_t * const bs)
 {
-	int bit, index = 0;
 	/* null check */
 	assert(t);
 	assert(bs);
 
-	while (t->tree[index] & SMK_HUFF8_BRANCH) {
-		if ((bit = smk_bs_read_1(bs)) < 0) {
-			fputs("libsmacker::smk_huff8_lookup() - ERROR: get_bit returned -1\n", stderr);
-			return -1;
+	return smk_lut_lookup(t->lut, t->bits, bs);
+}
+
+/* Build the joint table for a 16-bit audio channel.
+	Each entry holds both bytes of a sample and their combined code length;
+	where the two codes do not fit in the index together, it falls back
+	to separate lookups (marked with SMK_LUT_SUB). */
+static void smk_huff8_joint_build(unsigned int * const joint, const struct smk_huff8_t * const low8, const struct smk_huff8_t * const hi8)
+{
+	/* high-byte leaves of the root table, sorted by code length */
+	unsigned int hi_code[256], hi_entry[256], hi_count = 0;
+	unsigned int i, j, k, len, lo_len, entry, code;
+	/* null check */
+	assert(joint);
+	assert(low8);
+	assert(hi8);
+
+	for (i = 0; i < (1U << SMK_HUFF8_JOINT_BITS); i ++)
+		joint[i] = SMK_LUT_SUB;
+
+	/* Each leaf shows up in the root table at the index equal to its code
+		(and again at every index starting with it). */
+	for (len = 0; len <= hi8->bits; len ++) {
+		for (i = 0; i < (1U << len); i ++) {
+			entry = hi8->lut[i];
+
+			if (! (entry & SMK_LUT_SUB) && SMK_LUT_LEN(entry) == len) {
+				hi_code[hi_count] = i;
+				hi_entry[hi_count] = entry;
+				hi_count ++;
+			}
 		}
+	}
 
-		if (bit) {
-			/* take the right branch */
-			index = t->tree[index] & SMK_HUFF8_LEAF_MASK;
-		} else {
-			/* take the left branch */
-			index ++;
+	for (i = 0; i < (1U << low8->bits); i ++) {
+		entry = low8->lut[i];
+
+		if ((entry & SMK_LUT_SUB) || (i >> SMK_LUT_LEN(entry)))
+			continue;
+
+		lo_len = SMK_LUT_LEN(entry);
+
+		for (j = 0; j < hi_count; j ++) {
+			len = lo_len + SMK_LUT_LEN(hi_entry[j]);
+
+			/* the rest are longer still */
+			if (len > SMK_HUFF8_JOINT_BITS)
+				break;
+
+			code = i | (hi_code[j] << lo_len);
+
+			for (k = code; k < (1U << SMK_HUFF8_JOINT_BITS); k += (1U << len))
+				joint[k] = (entry & 0xFF) | ((hi_entry[j] & 0xFF) << 8) | (len << 16);
 		}
 	}
+}
+
+/* Look up a 16-bit value (low byte, then high byte) through a joint table.
+	Return -1 on error. */
+static int smk_huff8_lookup16(const unsigned int * const joint, const struct smk_huff8_t * const low8, const struct smk_huff8_t * const hi8, struct smk_bit_t * const bs)
+{
+	unsigned int entry;
+	int low, hi;
+	/* null check */
+	assert(joint);
+	assert(bs);
+
+	if (bs->count < SMK_HUFF8_JOINT_BITS && smk_bs_refill(bs) < 0) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_huff8_lookup16() - ERROR: bitstream exhausted");
+		return -1;
+	}
+
+	entry = joint[smk_bs_peek(bs, SMK_HUFF8_JOINT_BITS)];
+
+	if (! (entry & SMK_LUT_SUB)) {
+		smk_bs_consume(bs, SMK_LUT_LEN(entry));
+		return entry & SMK_LUT_VALUE_MASK;
+	}
 
-	/* at leaf node.  return the value at this point. */
-	return t->tree[index];
+	/* a long code: take the bytes one at a time */
+	if ((low = smk_huff8_lookup(low8, bs)) < 0 ||
+		(hi = smk_huff8_lookup(hi8, bs)) < 0)
+		return -1;
+
+	return low | (hi << 8);
 }
 
 /* ************************************************************************* */
 /* HUFF16 Structure */
 /* ************************************************************************* */
-#define SMK_HUFF16_BRANCH    0x80000000
-#define SMK_HUFF16_CACHE     0x40000000
-#define SMK_HUFF16_LEAF_MASK 0x3FFFFFFF
+#define SMK_HUFF16_LUT_BITS 10
 
 struct smk_huff16_t {
-	unsigned int * tree;
-	size_t size;
+	/* lookup table: root table first, then sub-tables */
+	unsigned int * lut;
+	/* index width of the root table */
+	unsigned int bits;
 
 	/* recently-used values cache */
 	unsigned short cache[3];
@@ -259,118 +706,113 @@ struct smk_huff16_t {
 /* ************************************************************************* */
 /* HUFF16 Functions */
 /* ************************************************************************* */
-/* Recursive sub-func for building a tree into an array. */
-static int _smk_huff16_build_rec(struct smk_huff16_t * const t, struct smk_bit_t * const bs, const struct smk_huff8_t * const low8, const struct smk_huff8_t * const hi8, const size_t limit)
+/* Reads a big tree into an array, without recursion:
+	see smk_huff8_build_tree for how open branches are tracked.
+	Leaf values are decoded through the lookup tables of the low and high trees. */
+static int smk_huff16_build_tree(unsigned int * const tree, size_t * const size, struct smk_bit_t * const bs, const struct smk_huff8_t * const low8, const struct smk_huff8_t * const hi8, const unsigned short cache[3], const size_t limit)
 {
-	int bit, value;
-	assert(t);
+	size_t top = 0, depth = 0, next;
+	int bit, value, hi;
+	assert(tree);
+	assert(size);
 	assert(bs);
 	assert(low8);
 	assert(hi8);
 
-	/* Make sure we aren't running out of bounds */
-	if (t->size >= limit) {
-		fputs("libsmacker::_smk_huff16_build_rec() - ERROR: size exceeded\n", stderr);
-		return 0;
-	}
-
-	/* Read the first bit */
-	if ((bit = smk_bs_read_1(bs)) < 0) {
-		fputs("libsmacker::_smk_huff16_build_rec() - ERROR: get_bit returned -1\n", stderr);
-		return 0;
-	}
-
-	if (bit) {
-		/* See tree-in-array explanation for HUFF8 above */
-		/* track the current index */
-		value = t->size ++;
-
-		/* go build the left branch */
-		if (! _smk_huff16_build_rec(t, bs, low8, hi8, limit)) {
-			fputs("libsmacker::_smk_huff16_build_rec() - ERROR: failed to build left sub-tree\n", stderr);
+	for (;;) {
+		/* Make sure we aren't running out of bounds */
+		if (*size >= limit) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build_tree() - ERROR: size exceeded");
 			return 0;
 		}
 
-		/* now go back to our current location, and
-			mark our location as a "jump" */
-		t->tree[value] = SMK_HUFF16_BRANCH | t->size;
-
-		/* continue building the right side */
-		if (! _smk_huff16_build_rec(t, bs, low8, hi8, limit)) {
-			fputs("libsmacker::_smk_huff16_build_rec() - ERROR: failed to build right sub-tree\n", stderr);
-			return 0;
-		}
-	} else {
-		/* Bit unset signifies a Leaf node. */
-		/* Attempt to read LOW value */
-		if ((value = smk_huff8_lookup(low8, bs)) < 0) {
-			fputs("libsmacker::_smk_huff16_build_rec() - ERROR: get LOW value returned -1\n", stderr);
+		/* Read the first bit */
+		if ((bit = smk_bs_read_1(bs)) < 0) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build_tree() - ERROR: get_bit returned -1");
 			return 0;
 		}
 
-		t->tree[t->size] = value;
+		if (bit) {
+			/* See tree-in-array explanation for HUFF8 above */
+			tree[*size] = top;
+			top = (*size) ++;
+			depth ++;
+		} else {
+			/* Bit unset signifies a Leaf node. */
+			/* Attempt to read LOW value */
+			if ((value = smk_huff8_lookup(low8, bs)) < 0) {
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build_tree() - ERROR: get LOW value returned -1");
+				return 0;
+			}
+
+			/* now read HIGH value */
+			if ((hi = smk_huff8_lookup(hi8, bs)) < 0) {
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build_tree() - ERROR: get HIGH value returned -1");
+				return 0;
+			}
 
-		/* now read HIGH value */
-		if ((value = smk_huff8_lookup(hi8, bs)) < 0) {
-			fputs("libsmacker::_smk_huff16_build_rec() - ERROR: get HIGH value returned -1\n", stderr);
-			return 0;
-		}
+			value |= (hi << 8);
 
-		/* Looks OK: we got low and hi values. Return a new LEAF */
-		t->tree[t->size] |= (value << 8);
+			/* Last: when building the tree, some Values may correspond to cache positions.
+				Identify these values and set the Escape code byte accordingly. */
+			if (value == cache[0])
+				tree[*size] = SMK_NODE_CACHE;
+			else if (value == cache[1])
+				tree[*size] = SMK_NODE_CACHE | 1;
+			else if (value == cache[2])
+				tree[*size] = SMK_NODE_CACHE | 2;
+			else
+				tree[*size] = value;
 
-		/* Last: when building the tree, some Values may correspond to cache positions.
-			Identify these values and set the Escape code byte accordingly. */
-		if (t->tree[t->size] == t->cache[0])
-			t->tree[t->size] = SMK_HUFF16_CACHE;
-		else if (t->tree[t->size] == t->cache[1])
-			t->tree[t->size] = SMK_HUFF16_CACHE | 1;
-		else if (t->tree[t->size] == t->cache[2])
-			t->tree[t->size] = SMK_HUFF16_CACHE | 2;
+			(*size) ++;
 
-		t->size ++;
-	}
+			if (! depth)
+				return 1;
 
-	return 1;
+			next = tree[top];
+			tree[top] = SMK_NODE_BRANCH | *size;
+			top = next;
+			depth --;
+		}
+	}
 }
 
-/* Entry point for building a big 16-bit tree. */
-static int smk_huff16_build(struct smk_huff16_t * const t, struct smk_bit_t * const bs, const unsigned int alloc_size)
+/* Reads a big 16-bit tree into an array of at most limit nodes. */
+static int smk_huff16_build(struct smk_huff16_t * const t, struct smk_bit_t * const bs, const unsigned int alloc_size, unsigned int * const tree, const size_t limit, size_t * const size)
 {
 	struct smk_huff8_t low8, hi8;
-	size_t limit;
 	int value, i, bit;
 	/* null check */
 	assert(t);
 	assert(bs);
+	assert(tree);
+	assert(size);
 
 	/* Smacker huff trees begin with a set-bit. */
 	if ((bit = smk_bs_read_1(bs)) < 0) {
-		fputs("libsmacker::smk_huff16_build() - ERROR: initial get_bit returned -1\n", stderr);
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build() - ERROR: initial get_bit returned -1");
 		return 0;
 	}
 
-	t->size = 0;
-
 	/* First bit indicates whether a tree is present or not. */
 	/*  Very small or audio-only files may have no tree. */
 	if (bit) {
 		/* build low-8-bits tree */
 		if (! smk_huff8_build(&low8, bs)) {
-			fputs("libsmacker::smk_huff16_build() - ERROR: failed to build LOW tree\n", stderr);
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build() - ERROR: failed to build LOW tree");
 			return 0;
 		}
 
 		/* build hi-8-bits tree */
 		if (! smk_huff8_build(&hi8, bs)) {
-			fputs("libsmacker::smk_huff16_build() - ERROR: failed to build HIGH tree\n", stderr);
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build() - ERROR: failed to build HIGH tree");
 			return 0;
 		}
 
 		/* Init the escape code cache. */
 		for (i = 0; i < 3; i ++) {
 			if ((value = smk_bs_read_8(bs)) < 0) {
-				fprintf(stderr, "libsmacker::smk_huff16_build() - ERROR: get LOW value for cache %d returned -1\n", i);
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build() - ERROR: get LOW value for cache %d returned -1", i);
 				return 0;
 			}
 
@@ -378,68 +820,122 @@ static int smk_huff16_build(struct smk_huff16_t * const t, struct smk_bit_t * co
 
 			/* now read HIGH value */
 			if ((value = smk_bs_read_8(bs)) < 0) {
-				fprintf(stderr, "libsmacker::smk_huff16_build() - ERROR: get HIGH value for cache %d returned -1\n", i);
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build() - ERROR: get HIGH value for cache %d returned -1", i);
 				return 0;
 			}
 
 			t->cache[i] |= (value << 8);
 		}
 
-		/* Everything looks OK so far. Time to malloc structure. */
-		if (alloc_size < 12 || alloc_size % 4) {
-			fprintf(stderr, "libsmacker::smk_huff16_build() - ERROR: illegal value %u for alloc_size\n", alloc_size);
+		/* Everything looks OK so far: the tree must fill exactly alloc_size. */
+		if (alloc_size < 12 || alloc_size % 4 || (alloc_size - 12) / 4 > limit) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build() - ERROR: illegal value %u for alloc_size", alloc_size);
 			return 0;
 		}
 
-		limit = (alloc_size - 12) / 4;
-
-		if ((t->tree = malloc(limit * sizeof(unsigned int))) == NULL) {
-			perror("libsmacker::smk_huff16_build() - ERROR: failed to malloc() huff16 tree");
-			return 0;
-		}
+		/* Finally, read the Bigtree. */
+		*size = 0;
 
-		/* Finally, call recursive function to retrieve the Bigtree. */
-		if (! _smk_huff16_build_rec(t, bs, &low8, &hi8, limit)) {
-			fputs("libsmacker::smk_huff16_build() - ERROR: failed to build huff16 tree\n", stderr);
-			free(t->tree);
-			t->tree = NULL;
+		if (! smk_huff16_build_tree(tree, size, bs, &low8, &hi8, t->cache, (alloc_size - 12) / 4)) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build() - ERROR: failed to build huff16 tree");
 			return 0;
 		}
 
 		/* check that we completely filled the tree */
-		if (limit != t->size) {
-			fputs("libsmacker::smk_huff16_build() - ERROR: failed to completely decode huff16 tree\n", stderr);
-			free(t->tree);
-			t->tree = NULL;
+		if ((alloc_size - 12) / 4 != *size) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build() - ERROR: failed to completely decode huff16 tree");
 			return 0;
 		}
 	} else {
-		if ((t->tree = malloc(sizeof(unsigned int))) == NULL) {
-			perror("libsmacker::smk_huff16_build() - ERROR: failed to malloc() huff16 tree");
-			return 0;
-		}
-
-		t->tree[0] = 0;
-		//t->cache[0] = t->cache[1] = t->cache[2] = 0;
+		/* a missing tree decodes to 0: same as a single leaf */
+		tree[0] = 0;
+		*size = 1;
 	}
 
 	/* Check final end tag. */
 	if ((bit = smk_bs_read_1(bs)) < 0) {
-		fputs("libsmacker::smk_huff16_build() - ERROR: final get_bit returned -1\n", stderr);
-		free(t->tree);
-		t->tree = NULL;
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build() - ERROR: final get_bit returned -1");
 		return 0;
 	}
 
 	/* a 0 is expected here, a 1 generally indicates a problem! */
 	if (bit) {
-		fputs("libsmacker::smk_huff16_build() - ERROR: final get_bit returned 1\n", stderr);
-		free(t->tree);
-		t->tree = NULL;
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build() - ERROR: final get_bit returned 1");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Entry point for building the four big trees of a file.
+	All trees are read into one scratch array of nodes,
+	then flattened into lookup tables sharing one allocation (stored to lut). */
+static int smk_huff16_build_all(struct smk_huff16_t tree[4], unsigned int ** const lut, struct smk_bit_t * const bs, const unsigned long alloc_size[4])
+{
+	unsigned int * nodes = NULL;
+	size_t limit = 0, used = 0, size[4], offset[4], capacity = 0;
+	int i;
+	/* null check */
+	assert(tree);
+	assert(lut);
+	assert(bs);
+	assert(alloc_size);
+
+	/* Room for every tree at its declared size (a missing tree needs one node) */
+	for (i = 0; i < 4; i ++) {
+		if (alloc_size[i] >= 12 && alloc_size[i] % 4 == 0)
+			limit += (alloc_size[i] - 12) / 4;
+
+		limit ++;
+	}
+
+	if ((nodes = malloc(limit * sizeof(unsigned int))) == NULL) {
+		smk_error(SMK_ERR_MEMORY, "libsmacker::smk_huff16_build_all() - ERROR: failed to malloc() huff16 trees: %s", strerror(errno));
 		return 0;
 	}
 
+	for (i = 0; i < 4; i ++) {
+		if (! smk_huff16_build(&tree[i], bs, alloc_size[i], nodes + used, limit - used, &size[i])) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build_all() - ERROR: failed to build huff16 tree %d", i);
+			goto error;
+		}
+
+		if (SMK_LUT_SIZE(SMK_HUFF16_LUT_BITS, size[i]) > SMK_LUT_MAX_SIZE) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build_all() - ERROR: tree %d of %lu nodes is too large", i, (unsigned long)size[i]);
+			goto error;
+		}
+
+		offset[i] = capacity;
+		capacity += SMK_LUT_SIZE(SMK_HUFF16_LUT_BITS, size[i]);
+		used += size[i];
+	}
+
+	/* Flatten the trees for decoding: the arrays are not needed afterwards. */
+	if ((*lut = malloc(capacity * sizeof(unsigned int))) == NULL) {
+		smk_error(SMK_ERR_MEMORY, "libsmacker::smk_huff16_build_all() - ERROR: failed to malloc() huff16 lookup tables: %s", strerror(errno));
+		goto error;
+	}
+
+	used = 0;
+
+	for (i = 0; i < 4; i ++) {
+		tree[i].lut = *lut + offset[i];
+
+		if (! smk_lut_build(tree[i].lut, SMK_LUT_SIZE(SMK_HUFF16_LUT_BITS, size[i]), &tree[i].bits, SMK_HUFF16_LUT_BITS, nodes + used)) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_build_all() - ERROR: failed to build lookup table %d", i);
+			free(*lut);
+			*lut = NULL;
+			goto error;
+		}
+
+		used += size[i];
+	}
+
+	free(nodes);
 	return 1;
+error:
+	free(nodes);
+	return 0;
 }
 
 /* Look up a 16-bit value from a large huff tree.
@@ -447,32 +943,19 @@ static int smk_huff16_build(struct smk_huff16_t * const t, struct smk_bit_t * co
 	Note that this also updates the recently-used-values cache. */
 static int smk_huff16_lookup(struct smk_huff16_t * const t, struct smk_bit_t * const bs)
 {
-	int bit, value, index = 0;
+	int value;
 	/* null check */
 	assert(t);
 	assert(bs);
 
-	while (t->tree[index] & SMK_HUFF16_BRANCH) {
-		if ((bit = smk_bs_read_1(bs)) < 0) {
-			fputs("libsmacker::smk_huff16_lookup() - ERROR: get_bit returned -1\n", stderr);
-			return -1;
-		}
-
-		if (bit) {
-			/* take the right branch */
-			index = t->tree[index] & SMK_HUFF16_LEAF_MASK;
-		} else {
-			/* take the left branch */
-			index ++;
-		}
+	if ((value = smk_lut_lookup(t->lut, t->bits, bs)) < 0) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_huff16_lookup() - ERROR: lookup failed");
+		return -1;
 	}
 
-	/* Get the value at this point */
-	value = t->tree[index];
-
-	if (value & SMK_HUFF16_CACHE) {
+	if (value & SMK_LUT_CACHE) {
 		/* uses cached value instead of actual value */
-		value = t->cache[value & SMK_HUFF16_LEAF_MASK];
+		value = t->cache[value & SMK_LUT_VALUE_MASK];
 	}
 
 	if (t->cache[0] != value) {
@@ -487,14 +970,821 @@ static int smk_huff16_lookup(struct smk_huff16_t * const t, struct smk_bit_t * c
 }
 
 /* ************************************************************************* */
-/* SMACKER Structure */
+/* BLOCK Functions */
 /* ************************************************************************* */
-/* tree processing order */
+/* Writers for the 4x4 pixel blocks of a frame, at t with row stride w.
+	Values come straight from the FULL tree: two pixels each, low byte first.
+	Portable versions are always available; SIMD versions are picked
+	at runtime by smk_block_init() where the CPU supports them. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define SMK_BLOCK_X86
+	#include <emmintrin.h>
+	#include <tmmintrin.h>
+#endif
+
+/* Stores one 4-pixel row */
+static void smk_block_row(unsigned char * const t, const unsigned char p0, const unsigned char p1, const unsigned char p2, const unsigned char p3)
+{
+	unsigned char row[4];
+	row[0] = p0;
+	row[1] = p1;
+	row[2] = p2;
+	row[3] = p3;
+	memcpy(t, row, 4);
+}
+
+/* Two-colour block: bit (4 * row + col) of the mask selects s1 over s2 */
+static void smk_block_mono_c(unsigned char * t, const unsigned long w, unsigned int mask, const unsigned char s1, const unsigned char s2)
+{
+	/* byte masks for each nibble of the pixel mask */
+	static const unsigned char nibble[16][4] = {
+		{0, 0, 0, 0}, {0xFF, 0, 0, 0}, {0, 0xFF, 0, 0}, {0xFF, 0xFF, 0, 0},
+		{0, 0, 0xFF, 0}, {0xFF, 0, 0xFF, 0}, {0, 0xFF, 0xFF, 0}, {0xFF, 0xFF, 0xFF, 0},
+		{0, 0, 0, 0xFF}, {0xFF, 0, 0, 0xFF}, {0, 0xFF, 0, 0xFF}, {0xFF, 0xFF, 0, 0xFF},
+		{0, 0, 0xFF, 0xFF}, {0xFF, 0, 0xFF, 0xFF}, {0, 0xFF, 0xFF, 0xFF}, {0xFF, 0xFF, 0xFF, 0xFF}
+	};
+	const uint32_t c1 = s1 * 0x01010101U, c2 = s2 * 0x01010101U;
+	uint32_t m, row;
+	unsigned int k;
+
+	for (k = 0; k < 4; k ++) {
+		memcpy(&m, nibble[mask & 0x0F], 4);
+		row = (c1 & m) | (c2 & ~m);
+		memcpy(t, &row, 4);
+		mask >>= 4;
+		t += w;
+	}
+}
+
+/* Full block: two values per row, right half first */
+static void smk_block_full_c(unsigned char * t, const unsigned long w, const unsigned short v[8])
+{
+	unsigned int k;
+
+	for (k = 0; k < 8; k += 2) {
+		smk_block_row(t, v[k + 1] & 0xFF, v[k + 1] >> 8, v[k] & 0xFF, v[k] >> 8);
+		t += w;
+	}
+}
+
+/* Double block: one value per 2x2 quad row, each byte doubled */
+static void smk_block_double_c(unsigned char * t, const unsigned long w, const unsigned short v[2])
+{
+	unsigned int k;
+
+	for (k = 0; k < 2; k ++) {
+		smk_block_row(t, v[k] & 0xFF, v[k] & 0xFF, v[k] >> 8, v[k] >> 8);
+		smk_block_row(t + w, v[k] & 0xFF, v[k] & 0xFF, v[k] >> 8, v[k] >> 8);
+		t += 2 * w;
+	}
+}
+
+/* Half block: two values per row pair, right half first */
+static void smk_block_half_c(unsigned char * t, const unsigned long w, const unsigned short v[4])
+{
+	unsigned int k;
+
+	for (k = 0; k < 4; k += 2) {
+		smk_block_row(t, v[k + 1] & 0xFF, v[k + 1] >> 8, v[k] & 0xFF, v[k] >> 8);
+		smk_block_row(t + w, v[k + 1] & 0xFF, v[k + 1] >> 8, v[k] & 0xFF, v[k] >> 8);
+		t += 2 * w;
+	}
+}
+
+#ifdef SMK_BLOCK_X86
+/* Stores the four 32-bit lanes of r as rows */
+__attribute__((target("sse2")))
+static void smk_block_store_sse2(unsigned char * t, const unsigned long w, __m128i r)
+{
+	uint32_t row;
+	unsigned int k;
+
+	for (k = 0; k < 4; k ++) {
+		row = (uint32_t)_mm_cvtsi128_si32(r);
+		memcpy(t, &row, 4);
+		r = _mm_srli_si128(r, 4);
+		t += w;
+	}
+}
+
+/* Selects s1 where the byte in x has its pixel bit set, else s2 */
+__attribute__((target("sse2")))
+static __m128i smk_block_select_sse2(const __m128i x, const unsigned char s1, const unsigned char s2)
+{
+	const __m128i bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+	const __m128i sel = _mm_cmpeq_epi8(_mm_and_si128(x, bit), bit);
+	return _mm_or_si128(_mm_and_si128(sel, _mm_set1_epi8((char)s1)), _mm_andnot_si128(sel, _mm_set1_epi8((char)s2)));
+}
+
+__attribute__((target("sse2")))
+static void smk_block_mono_sse2(unsigned char * t, const unsigned long w, unsigned int mask, const unsigned char s1, const unsigned char s2)
+{
+	/* spread the low mask byte over bytes 0-7, the high one over 8-15 */
+	__m128i x = _mm_cvtsi32_si128((int)mask);
+	x = _mm_unpacklo_epi8(x, x);
+	x = _mm_unpacklo_epi16(x, x);
+	x = _mm_unpacklo_epi32(x, x);
+	smk_block_store_sse2(t, w, smk_block_select_sse2(x, s1, s2));
+}
+
+__attribute__((target("ssse3")))
+static void smk_block_mono_ssse3(unsigned char * t, const unsigned long w, unsigned int mask, const unsigned char s1, const unsigned char s2)
+{
+	const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+	smk_block_store_sse2(t, w, smk_block_select_sse2(_mm_shuffle_epi8(_mm_cvtsi32_si128((int)mask), spread), s1, s2));
+}
+
+__attribute__((target("sse2")))
+static void smk_block_full_sse2(unsigned char * t, const unsigned long w, const unsigned short v[8])
+{
+	/* swap the value pairs of each row */
+	__m128i r = _mm_loadu_si128((const __m128i *)v);
+	r = _mm_shufflelo_epi16(r, _MM_SHUFFLE(2, 3, 0, 1));
+	r = _mm_shufflehi_epi16(r, _MM_SHUFFLE(2, 3, 0, 1));
+	smk_block_store_sse2(t, w, r);
+}
+
+__attribute__((target("sse2")))
+static void smk_block_double_sse2(unsigned char * t, const unsigned long w, const unsigned short v[2])
+{
+	/* double every byte, then every row */
+	__m128i r = _mm_cvtsi32_si128((int)(v[0] | ((uint32_t)v[1] << 16)));
+	r = _mm_unpacklo_epi8(r, r);
+	r = _mm_unpacklo_epi32(r, r);
+	smk_block_store_sse2(t, w, r);
+}
+
+__attribute__((target("sse2")))
+static void smk_block_half_sse2(unsigned char * t, const unsigned long w, const unsigned short v[4])
+{
+	/* swap the value pairs, then double every row */
+	__m128i r = _mm_loadl_epi64((const __m128i *)v);
+	r = _mm_shufflelo_epi16(r, _MM_SHUFFLE(2, 3, 0, 1));
+	r = _mm_unpacklo_epi32(r, r);
+	smk_block_store_sse2(t, w, r);
+}
+#endif
+
+/* Block writers in use: portable until smk_block_init() finds better */
+static struct smk_block_ops_t {
+	void (* mono)(unsigned char * t, unsigned long w, unsigned int mask, unsigned char s1, unsigned char s2);
+	void (* full)(unsigned char * t, unsigned long w, const unsigned short v[8]);
+	void (* dbl)(unsigned char * t, unsigned long w, const unsigned short v[2]);
+	void (* half)(unsigned char * t, unsigned long w, const unsigned short v[4]);
+} smk_block = {
+	smk_block_mono_c,
+	smk_block_full_c,
+	smk_block_double_c,
+	smk_block_half_c
+};
+
+/* Detects the CPU and picks the block writers */
+static void smk_block_pick(void)
+{
+#ifdef SMK_BLOCK_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		smk_block.mono = smk_block_mono_sse2;
+		smk_block.full = smk_block_full_sse2;
+		smk_block.dbl = smk_block_double_sse2;
+		smk_block.half = smk_block_half_sse2;
+	}
+
+	if (__builtin_cpu_supports("ssse3"))
+		smk_block.mono = smk_block_mono_ssse3;
+#endif
+}
+
+/* Picks the block writers, once (opens on several threads may race here) */
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t smk_block_once = PTHREAD_ONCE_INIT;
+
+static void smk_block_init(void)
+{
+	pthread_once(&smk_block_once, smk_block_pick);
+}
+#else
+static void smk_block_init(void)
+{
+	static char done = 0;
+
+	if (done)
+		return;
+
+	smk_block_pick();
+	done = 1;
+}
+#endif
+
+/* Marks n blocks, from block index first on, in a dirty-block bitmask */
+static void smk_block_dirty(unsigned char * const dirty, unsigned long first, unsigned long n)
+{
+	/* single bits up to a byte boundary, then whole bytes, then the rest */
+	while (n && (first & 7)) {
+		dirty[first >> 3] |= 1 << (first & 7);
+		first ++;
+		n --;
+	}
+
+	if (n >= 8) {
+		memset(&dirty[first >> 3], 0xFF, n >> 3);
+		first += n & ~7UL;
+		n &= 7;
+	}
+
+	while (n) {
+		dirty[first >> 3] |= 1 << (first & 7);
+		first ++;
+		n --;
+	}
+}
+
+/* A parsed block, queued to be written later by smk_block_apply().
+	Used by the two-phase video decode: entropy decoding stays serial,
+	writing the pixels can then be split over threads. */
+struct smk_block_cmd_t {
+	/* offset of the top-left pixel in the frame */
+	unsigned long skip;
+	/* block type (0, 1, 3, 4 or 5), and block count of a SOLID run */
+	unsigned short type, count;
+	/* MONO colours, or the SOLID colour in s1 */
+	unsigned char s1, s2;
+	/* FULL tree values, or the MONO pixel mask in v[0] */
+	unsigned short v[8];
+};
+
+#ifdef HAVE_PTHREAD_H
+/* Writes the queued blocks [cmd, end) into frame (row stride w) */
+static void smk_block_apply(unsigned char * const frame, const unsigned long w, const struct smk_block_cmd_t * cmd, const struct smk_block_cmd_t * const end)
+{
+	unsigned char * t;
+	unsigned int i;
+
+	for (; cmd < end; cmd ++) {
+		t = frame + cmd->skip;
+
+		switch (cmd->type) {
+		case 0:
+			smk_block.mono(t, w, cmd->v[0], cmd->s1, cmd->s2);
+			break;
+
+		case 1:
+			smk_block.full(t, w, cmd->v);
+			break;
+
+		case 3:
+			for (i = 0; i < 4; i ++) {
+				memset(t, cmd->s1, 4 * cmd->count);
+				t += w;
+			}
+
+			break;
+
+		case 4:
+			smk_block.dbl(t, w, cmd->v);
+			break;
+
+		case 5:
+			smk_block.half(t, w, cmd->v);
+			break;
+		}
+	}
+}
+#endif
+
+/* ************************************************************************* */
+/* POOL Structure */
+/* ************************************************************************* */
+/* A fixed set of worker threads running numbered tasks in parallel.
+	Only built with pthreads; without them no pool is ever created. */
+struct smk_pool_t;
+
+#ifdef HAVE_PTHREAD_H
+struct smk_pool_t {
+	/* worker threads */
+	pthread_t * thread;
+	unsigned int threads;
+
+	/* guards everything below */
+	pthread_mutex_t lock;
+	/* signalled when a job is posted, and when its last task finishes */
+	pthread_cond_t work, done;
+
+	/* current job: fn(arg, i) for every i below total */
+	void (* fn)(void * arg, unsigned int i);
+	void * arg;
+	unsigned int next, total, pending;
+
+	/* set to make the workers exit */
+	unsigned char quit;
+};
+
+/* ************************************************************************* */
+/* POOL Functions */
+/* ************************************************************************* */
+/* Runs tasks of the current job until none are left to start.
+	Called, and returns, with the lock held. */
+static void smk_pool_take(struct smk_pool_t * const pool)
+{
+	unsigned int i;
+
+	while (pool->next < pool->total) {
+		i = pool->next ++;
+		pthread_mutex_unlock(&pool->lock);
+		pool->fn(pool->arg, i);
+		pthread_mutex_lock(&pool->lock);
+
+		if (-- pool->pending == 0)
+			pthread_cond_signal(&pool->done);
+	}
+}
+
+/* Worker thread body */
+static void * smk_pool_main(void * arg)
+{
+	struct smk_pool_t * const pool = arg;
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		smk_pool_take(pool);
+
+		if (pool->quit)
+			break;
+
+		pthread_cond_wait(&pool->work, &pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Stops the workers and frees the pool */
+static void smk_pool_destroy(struct smk_pool_t * pool)
+{
+	unsigned int i;
+	/* null check */
+	assert(pool);
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads; i ++)
+		pthread_join(pool->thread[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	smk_free(pool->thread);
+	smk_free(pool);
+}
+
+/* Starts a pool of the given number of worker threads */
+static struct smk_pool_t * smk_pool_create(const unsigned int threads)
+{
+	struct smk_pool_t * pool = NULL;
+	unsigned int i;
+	smk_malloc(pool, sizeof(struct smk_pool_t));
+	smk_malloc(pool->thread, threads * sizeof(pthread_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < threads; i ++) {
+		if (pthread_create(&pool->thread[i], NULL, smk_pool_main, pool)) {
+			smk_error(SMK_ERR_MEMORY, "libsmacker::smk_pool_create(%u) - ERROR: failed to start worker thread %u", threads, i);
+			smk_pool_destroy(pool);
+			return NULL;
+		}
+
+		pool->threads = i + 1;
+	}
+
+	return pool;
+}
+
+/* Runs fn(arg, i) for i = 0 .. n-1 on the workers and the calling thread,
+	returning once all of them have finished */
+static void smk_pool_run(struct smk_pool_t * const pool, void (* fn)(void * arg, unsigned int i), void * arg, const unsigned int n)
+{
+	/* null check */
+	assert(pool);
+	assert(fn);
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->next = 0;
+	pool->total = n;
+	pool->pending = n;
+	pthread_cond_broadcast(&pool->work);
+	smk_pool_take(pool);
+
+	while (pool->pending)
+		pthread_cond_wait(&pool->done, &pool->lock);
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Splitting queued blocks into bands of block rows, one per task */
+struct smk_block_job_t {
+	unsigned char * frame;
+	unsigned long w;
+	const struct smk_block_cmd_t * cmd, * end;
+	unsigned long rows;
+	unsigned int tasks;
+};
+
+/* First queued block at or after pixel offset skip (blocks are queued in frame order) */
+static const struct smk_block_cmd_t * smk_block_find(const struct smk_block_job_t * const job, const unsigned long skip)
+{
+	const struct smk_block_cmd_t * lo = job->cmd, * hi = job->end, * mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (mid->skip < skip)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Pool task: writes band i of the frame */
+static void smk_block_task(void * arg, const unsigned int i)
+{
+	const struct smk_block_job_t * const job = arg;
+	const unsigned long band = 4 * job->w;
+	smk_block_apply(job->frame, job->w,
+		smk_block_find(job, band * (job->rows * i / job->tasks)),
+		smk_block_find(job, band * (job->rows * (i + 1) / job->tasks)));
+}
+
+/* Writes the queued blocks [cmd, end) into an h-row frame, in parallel bands */
+static void smk_block_apply_pool(struct smk_pool_t * const pool, unsigned char * const frame, const unsigned long w, const unsigned long h, const struct smk_block_cmd_t * const cmd, const struct smk_block_cmd_t * const end)
+{
+	struct smk_block_job_t job;
+	job.frame = frame;
+	job.w = w;
+	job.cmd = cmd;
+	job.end = end;
+	job.rows = (h + 3) / 4;
+	/* a few bands per thread, to even out the load */
+	job.tasks = 4 * (pool->threads + 1);
+
+	if (job.tasks > job.rows)
+		job.tasks = job.rows;
+
+	smk_pool_run(pool, smk_block_task, &job, job.tasks);
+}
+#endif
+
+/* ************************************************************************* */
+/* IO Structure */
+/* ************************************************************************* */
+/* A stream read through callbacks: the caller's (smk_open_callbacks),
+	or stdio's (smk_open_file, smk_open_filepointer) */
+struct smk_io_t {
+	smk_read_callback read;
+	smk_seek_callback seek;
+	smk_tell_callback tell;
+	void * handle;
+};
+
+/* Where to find a frame, and what it holds: one record per chunk */
+struct smk_index_t {
+	/* chunk position in the stream (disk mode), or in the arena (memory mode) */
+	uint64_t offset;
+	uint32_t size;
+	/* keyframe flag, and type mask (e.g. 'audio track 3, 2, and palette swap') */
+	unsigned char keyframe;
+	unsigned char type;
+};
+
+/* Size of the largest of frames chunks, to size a chunk buffer */
+static unsigned long smk_max_chunk(const struct smk_index_t * const index, const unsigned long frames)
+{
+	unsigned long f, max_size = 0;
+
+	for (f = 0; f < frames; f ++) {
+		if (index[f].size > max_size)
+			max_size = index[f].size;
+	}
+
+	return max_size;
+}
+
+/* ************************************************************************* */
+/* IO Functions */
+/* ************************************************************************* */
+/* stdio callbacks: the handle is a FILE * */
+static long smk_io_file_read(void * handle, void * buf, const unsigned long size)
+{
+	size_t bytesRead = fread(buf, 1, size, (FILE *)handle);
+
+	if (bytesRead < size && ferror((FILE *)handle))
+		return -1;
+
+	return (long)bytesRead;
+}
+
+static int smk_io_file_seek(void * handle, const unsigned long offset)
+{
+	return fseek((FILE *)handle, (long)offset, SEEK_SET);
+}
+
+static long smk_io_file_tell(void * handle)
+{
+	return ftell((FILE *)handle);
+}
+
+/* pread callbacks: the handle is this smk's own position in a
+	descriptor that other smk may share (nothing moves the descriptor) */
+struct smk_fd_t;
+
+#ifdef HAVE_PREAD
+struct smk_fd_t {
+	int fd;
+	uint64_t pos;
+};
+
+static long smk_io_fd_read(void * handle, void * buf, const unsigned long size)
+{
+	struct smk_fd_t * const f = handle;
+	unsigned long done = 0;
+	ssize_t n;
+
+	while (done < size) {
+		n = pread(f->fd, (unsigned char *)buf + done, size - done, (off_t)(f->pos + done));
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		/* end of file */
+		if (n == 0)
+			break;
+
+		done += n;
+	}
+
+	f->pos += done;
+	return (long)done;
+}
+
+static int smk_io_fd_seek(void * handle, const unsigned long offset)
+{
+	((struct smk_fd_t *)handle)->pos = offset;
+	return 0;
+}
+
+static long smk_io_fd_tell(void * handle)
+{
+	return (long)((struct smk_fd_t *)handle)->pos;
+}
+#endif
+
+/* ************************************************************************* */
+/* READAHEAD Structure */
+/* ************************************************************************* */
+/* Disk-mode prefetch: a background thread reading the chunks after the
+	current one into a ring of buffers, so a slow read doesn't stall
+	smk_next().  Only built with pthreads. */
+struct smk_ahead_t;
+
+#ifdef HAVE_PTHREAD_H
+struct smk_ahead_t {
+	pthread_t thread;
+
+	/* guards everything below, except the slot contents */
+	pthread_mutex_t lock;
+	/* signalled when a slot is filled, freed, or the ring re-targeted */
+	pthread_cond_t cond;
+
+	/* the stream (used only by the reader thread while it runs),
+		and the frame index of the smk */
+	const struct smk_io_t * io;
+	const struct smk_index_t * index;
+	unsigned long frames;
+	unsigned char ring_frame;
+
+	/* slots buffers of stride bytes each (largest chunk plus padding),
+		with the frame each one holds, and its read error (errno, or -1) */
+	unsigned char * buffer;
+	unsigned long stride;
+	unsigned long * frame;
+	int * err;
+	unsigned int slots;
+
+	/* filled slots run from head, count long; the caller holds the
+		head slot while it decodes from it */
+	unsigned int head, count;
+	unsigned char held;
+
+	/* next frame to read (frames: nothing left) */
+	unsigned long next;
+	/* bumped on re-target, so a read already under way is dropped */
+	unsigned long gen;
+	/* file position after the last read ((uint64_t)-1 if unknown) */
+	uint64_t pos;
+
+	/* set to make the reader exit */
+	unsigned char quit;
+};
+
+/* ************************************************************************* */
+/* READAHEAD Functions */
+/* ************************************************************************* */
+/* Frame read after f (playback loops back to 1 past the ring frame) */
+static unsigned long smk_ahead_after(const struct smk_ahead_t * const ahead, const unsigned long f)
+{
+	if (f + 1 < ahead->frames)
+		return f + 1;
+
+	return ahead->ring_frame ? 1 : ahead->frames;
+}
+
+/* Reader thread body */
+static void * smk_ahead_main(void * arg)
+{
+	struct smk_ahead_t * const ahead = arg;
+	unsigned char * buffer;
+	const struct smk_index_t * chunk;
+	unsigned long f, gen;
+	unsigned int slot;
+	long n;
+	int err;
+	pthread_mutex_lock(&ahead->lock);
+
+	for (;;) {
+		if (ahead->quit)
+			break;
+
+		if (ahead->count == ahead->slots || ahead->next >= ahead->frames) {
+			pthread_cond_wait(&ahead->cond, &ahead->lock);
+			continue;
+		}
+
+		/* fill the slot after the last filled one, unlocked */
+		slot = (ahead->head + ahead->count) % ahead->slots;
+		f = ahead->next;
+		gen = ahead->gen;
+		pthread_mutex_unlock(&ahead->lock);
+		buffer = ahead->buffer + slot * ahead->stride;
+		chunk = &ahead->index[f];
+		err = 0;
+		errno = 0;
+
+		if (ahead->pos != chunk->offset && ahead->io->seek(ahead->io->handle, (unsigned long)chunk->offset))
+			err = errno ? errno : -1;
+		else if ((n = ahead->io->read(ahead->io->handle, buffer, chunk->size)) != (long)chunk->size)
+			err = (n < 0 && errno) ? errno : -1;
+		else
+			memset(buffer + chunk->size, 0, SMK_BS_PAD);
+
+		ahead->pos = err ? (uint64_t)-1 : chunk->offset + chunk->size;
+		pthread_mutex_lock(&ahead->lock);
+
+		/* publish, unless the caller moved elsewhere meanwhile */
+		if (gen == ahead->gen) {
+			ahead->frame[slot] = f;
+			ahead->err[slot] = err;
+			ahead->count ++;
+			ahead->next = smk_ahead_after(ahead, f);
+			pthread_cond_broadcast(&ahead->cond);
+		}
+	}
+
+	pthread_mutex_unlock(&ahead->lock);
+	return NULL;
+}
+
+/* Stops the reader and frees the ring */
+static void smk_ahead_destroy(struct smk_ahead_t * ahead)
+{
+	/* null check */
+	assert(ahead);
+	pthread_mutex_lock(&ahead->lock);
+	ahead->quit = 1;
+	pthread_cond_broadcast(&ahead->cond);
+	pthread_mutex_unlock(&ahead->lock);
+	pthread_join(ahead->thread, NULL);
+	pthread_cond_destroy(&ahead->cond);
+	pthread_mutex_destroy(&ahead->lock);
+	smk_free(ahead->err);
+	smk_free(ahead->frame);
+	smk_free(ahead->buffer);
+	smk_free(ahead);
+}
+
+/* Starts a reader prefetching up to chunks chunks of io,
+	beginning with frame first */
+static struct smk_ahead_t * smk_ahead_create(const struct smk_io_t * io, const struct smk_index_t * index, const unsigned long frames, const unsigned char ring_frame, const unsigned int chunks, const unsigned long first)
+{
+	struct smk_ahead_t * ahead = NULL;
+	smk_malloc(ahead, sizeof(struct smk_ahead_t));
+	ahead->io = io;
+	ahead->index = index;
+	ahead->frames = frames;
+	ahead->ring_frame = ring_frame;
+	ahead->stride = smk_max_chunk(index, frames) + SMK_BS_PAD;
+	/* one more slot than asked for: the chunk being decoded */
+	ahead->slots = chunks + 1;
+	smk_malloc(ahead->buffer, ahead->slots * ahead->stride);
+	smk_malloc(ahead->frame, ahead->slots * sizeof(unsigned long));
+	smk_malloc(ahead->err, ahead->slots * sizeof(int));
+	ahead->next = first;
+	ahead->pos = (uint64_t)-1;
+	pthread_mutex_init(&ahead->lock, NULL);
+	pthread_cond_init(&ahead->cond, NULL);
+
+	if (pthread_create(&ahead->thread, NULL, smk_ahead_main, ahead)) {
+		smk_error(SMK_ERR_MEMORY, "libsmacker::smk_ahead_create(%u) - ERROR: failed to start reader thread", chunks);
+		pthread_cond_destroy(&ahead->cond);
+		pthread_mutex_destroy(&ahead->lock);
+		smk_free(ahead->err);
+		smk_free(ahead->frame);
+		smk_free(ahead->buffer);
+		smk_free(ahead);
+		return NULL;
+	}
+
+	return ahead;
+}
+
+/* Waits for chunk f and returns its (padded) buffer, or NULL on a read error.
+	Releases the chunk handed out before; if f isn't the next one queued,
+	drops the queue and restarts reading at f. */
+static unsigned char * smk_ahead_get(struct smk_ahead_t * const ahead, const unsigned long f)
+{
+	unsigned char * buffer = NULL;
+	int err;
+	pthread_mutex_lock(&ahead->lock);
+
+	/* done with the last chunk: its slot may be refilled */
+	if (ahead->held) {
+		ahead->head = (ahead->head + 1) % ahead->slots;
+		ahead->count --;
+		ahead->held = 0;
+		pthread_cond_broadcast(&ahead->cond);
+	}
+
+	/* re-target: the queue (if any) doesn't start at f */
+	if (!(ahead->count && ahead->frame[ahead->head] == f) &&
+		!(ahead->count == 0 && ahead->next == f)) {
+		ahead->gen ++;
+		ahead->head = 0;
+		ahead->count = 0;
+		ahead->next = f;
+		pthread_cond_broadcast(&ahead->cond);
+	}
+
+	while (ahead->count == 0)
+		pthread_cond_wait(&ahead->cond, &ahead->lock);
+
+	ahead->held = 1;
+	err = ahead->err[ahead->head];
+
+	if (err == 0)
+		buffer = ahead->buffer + ahead->head * ahead->stride;
+
+	pthread_mutex_unlock(&ahead->lock);
+
+	if (err)
+		smk_error(SMK_ERR_IO, "libsmacker::smk_ahead_get(ahead,%lu) - ERROR: read of chunk (offset %lu, %lu bytes) failed: %s", f, (unsigned long)ahead->index[f].offset, (unsigned long)ahead->index[f].size, err > 0 ? strerror(err) : "short read");
+
+	return buffer;
+}
+#endif
+
+/* ************************************************************************* */
+/* SMACKER Structure */
+/* ************************************************************************* */
+/* tree processing order */
 #define SMK_TREE_MMAP	0
 #define SMK_TREE_MCLR	1
 #define SMK_TREE_FULL	2
 #define SMK_TREE_TYPE	3
 
+/* source mode for smk_open_memory_borrow(): chunks point into the caller's buffer */
+#define SMK_MODE_BORROW	0x03
+/* source mode for smk_push_create(): chunks are fed into the chunk buffer */
+#define SMK_MODE_PUSH	0x04
+
+/* Count of the handles on one parsed file (smk_clone()): atomic with GCC,
+	else under a lock where there are threads to race */
+struct smk_refs_t {
+	unsigned long count;
+#if defined(HAVE_PTHREAD_H) && !defined(__GNUC__)
+	pthread_mutex_t lock;
+#endif
+};
+
 struct smk_t {
 	/* meta-info */
 	/* file mode: see flags, smacker.h */
@@ -517,22 +1807,44 @@ struct smk_t {
 		depending on the file mode. */
 	union {
 		struct {
-			/* on-disk mode */
+			/* on-disk mode: the stream, and the file to close
+				(NULL for the caller's callbacks) */
+			struct smk_io_t io;
 			FILE * fp;
-			unsigned long * chunk_offset;
+			/* smk_open_fd(): position in the shared descriptor (NULL otherwise) */
+			struct smk_fd_t * fd;
+			/* chunk buffer, sized for the largest chunk (plus padding) */
+			unsigned char * buffer;
+			/* file position after the last read, to skip needless seeks
+				((uint64_t)-1 when unknown) */
+			uint64_t pos;
+			/* background reader (NULL: chunks are read by smk_render) */
+			struct smk_ahead_t * ahead;
 		} file;
 
-		/* in-memory mode: unprocessed chunks */
+		/* in-memory mode: all unprocessed chunks, back to back,
+			each at its index offset (plus padding after the last) */
+		unsigned char * arena;
+
+		/* mmap and borrow modes: pointers into the file image */
 		unsigned char ** chunk_data;
 	} source;
 
-	/* shared array of "chunk sizes"*/
-	unsigned long * chunk_size;
+	/* borrow mode: padded copy of the chunks that end too close to the
+		end of the caller's buffer for the bitstream reader */
+	unsigned char * tail;
+
+	/* mmap mode: the mapping, which also covers SMK_BS_PAD bytes past
+		the end of the file (so bitstreams may read beyond the last chunk) */
+	void * map;
+	size_t map_size;
+
+	/* Holds per-frame chunk size, offset, keyframe flag and type mask */
+	struct smk_index_t * index;
 
-	/* Holds per-frame flags (i.e. 'keyframe') */
-	unsigned char * keyframe;
-	/* Holds per-frame type mask (e.g. 'audio track 3, 2, and palette swap') */
-	unsigned char * frame_type;
+	/* handles sharing the index, trees and chunks (see smk_clone()):
+		whichever is closed last frees them */
+	struct smk_refs_t * refs;
 
 	/* video and audio structures */
 	/* Video data type: enable/disable decode switch,
@@ -557,11 +1869,29 @@ struct smk_t {
 		/* Huffman trees */
 		unsigned long tree_size[4];
 		struct smk_huff16_t tree[4];
+		/* one block holding the lookup tables of all trees */
+		unsigned int * tree_lut;
 
 		/* Palette data type: pointer to last-decoded-palette */
 		unsigned char palette[256][3];
 		/* Last-unpacked frame */
 		unsigned char * frame;
+
+		/* blocks written by the last frame: one bit per 4x4 block (LSB first),
+			in rows of (w + 3) / 4 blocks */
+		unsigned char * dirty;
+		/* scratch for smk_get_dirty_rects: two rows of (w + 3) / 4 + 1 entries */
+		unsigned long * dirty_runs;
+		/* did the last frame write any block, or change the palette? */
+		unsigned char frame_changed;
+		unsigned char palette_changed;
+
+		/* decoder picked for this version and width */
+		char (* render)(struct smk_video_t * s, struct smk_pool_t * pool, unsigned char * p, unsigned int size);
+
+		/* blocks of the current frame, queued for the worker threads
+			(NULL when decoding in a single pass) */
+		struct smk_block_cmd_t * cmd;
 	} video;
 
 	/* audio structure */
@@ -588,26 +1918,59 @@ struct smk_t {
 		void * buffer;
 		unsigned long	buffer_size;
 	} audio[7];
+
+	/* worker threads (NULL: everything runs on the calling thread) */
+	struct smk_pool_t * pool;
+	/* with workers: decode each frame's records side by side,
+		rather than one after another with the video split in bands */
+	unsigned char concurrent;
+
+	/* background decoder (NULL: frames are decoded by smk_first / smk_next) */
+	struct smk_pipe_t * pipe;
 };
 
 union smk_read_t {
-	FILE * file;
+	const struct smk_io_t * io;
 	unsigned char * ram;
 };
 
+/* Bytes in the dirty-block bitmask (never zero) */
+static unsigned long smk_dirty_size(const struct smk_video_t * s)
+{
+	return ((s->w + 3) / 4 * ((s->h + 3) / 4) + 7) / 8 + 1;
+}
+
+/* Bytes in the smk_get_dirty_rects scratch */
+static unsigned long smk_dirty_runs_size(const struct smk_video_t * s)
+{
+	return 2 * ((s->w + 3) / 4 + 1) * sizeof(unsigned long);
+}
+
+/* Picks the video decoder (defined with the renderers, below) */
+static void smk_render_video_init(struct smk_video_t * s);
+
+/* Stops the background decoder (defined with the pipeline, below) */
+struct smk_pipe_t;
+#ifdef HAVE_PTHREAD_H
+static void smk_pipe_destroy(struct smk_pipe_t * pipe);
+#endif
+
 /* ************************************************************************* */
 /* SMACKER Functions */
 /* ************************************************************************* */
-/* An fread wrapper: consumes N bytes, or returns -1
+/* A read callback wrapper: consumes N bytes, or returns -1
 	on failure (when size doesn't match expected) */
-static char smk_read_file(void * buf, const size_t size, FILE * fp)
+static char smk_read_io(void * buf, const unsigned long size, const struct smk_io_t * io)
 {
-	/* don't bother checking buf or fp, fread does it for us */
-	size_t bytesRead = fread(buf, 1, size, fp);
+	long bytesRead = io->read(io->handle, buf, size);
+
+	if (bytesRead < 0) {
+		smk_error(SMK_ERR_IO, "libsmacker::smk_read_io(buf,%lu,io) - ERROR: Read failed (%s)", size, strerror(errno));
+		return -1;
+	}
 
-	if (bytesRead != size) {
-		fprintf(stderr, "libsmacker::smk_read_file(buf,%lu,fp) - ERROR: Short read, %lu bytes returned\n", (unsigned long)size, (unsigned long)bytesRead);
-		perror("\tReason");
+	if ((unsigned long)bytesRead != size) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_read_io(buf,%lu,io) - ERROR: Short read, %lu bytes returned (end of file)", size, (unsigned long)bytesRead);
 		return -1;
 	}
 
@@ -619,7 +1982,7 @@ static char smk_read_file(void * buf, const size_t size, FILE * fp)
 static char smk_read_memory(void * buf, const unsigned long size, unsigned char ** p, unsigned long * p_size)
 {
 	if (size > *p_size) {
-		fprintf(stderr, "libsmacker::smk_read_memory(buf,%lu,p,%lu) - ERROR: Short read\n", (unsigned long)size, (unsigned long)*p_size);
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_read_memory(buf,%lu,p,%lu) - ERROR: Short read", (unsigned long)size, (unsigned long)*p_size);
 		return -1;
 	}
 
@@ -636,7 +1999,7 @@ static char smk_read_memory(void * buf, const unsigned long size, unsigned char
 { \
 	if (m) \
 	{ \
-		r = (smk_read_file(ret,n,fp.file)); \
+		r = (smk_read_io(ret,n,fp.io)); \
 	} \
 	else \
 	{ \
@@ -644,7 +2007,7 @@ static char smk_read_memory(void * buf, const unsigned long size, unsigned char
 	} \
 	if (r < 0) \
 	{ \
-		fprintf(stderr,"libsmacker::smk_read(...) - Errors encountered on read, bailing out (file: %s, line: %lu)\n", __FILE__, (unsigned long)__LINE__); \
+		smk_error(smk_error_code, "libsmacker::smk_read(...) - Errors encountered on read, bailing out (file: %s, line: %lu)", __FILE__, (unsigned long)__LINE__); \
 		goto error; \
 	} \
 }
@@ -679,17 +2042,27 @@ static smk smk_open_generic(const unsigned char m, union smk_read_t fp, unsigned
 	struct smk_bit_t bs;
 
 	/** **/
+	/* pick the block writers for this CPU */
+	smk_block_init();
+
 	/* safe malloc the structure */
 	if ((s = calloc(1, sizeof(struct smk_t))) == NULL) {
-		perror("libsmacker::smk_open_generic() - ERROR: failed to malloc() smk structure");
+		smk_error(SMK_ERR_MEMORY, "libsmacker::smk_open_generic() - ERROR: failed to malloc() smk structure: %s", strerror(errno));
 		return NULL;
 	}
 
+	/* start counting the handles now, so clones never race to do it */
+	smk_malloc(s->refs, sizeof(struct smk_refs_t));
+	s->refs->count = 1;
+#if defined(HAVE_PTHREAD_H) && !defined(__GNUC__)
+	pthread_mutex_init(&s->refs->lock, NULL);
+#endif
+
 	/* Check for a valid signature */
 	smk_read(buf, 3);
 
 	if (buf[0] != 'S' || buf[1] != 'M' || buf[2] != 'K') {
-		fprintf(stderr, "libsmacker::smk_open_generic - ERROR: invalid SMKn signature (got: %s)\n", buf);
+		smk_error(SMK_ERR_FORMAT, "libsmacker::smk_open_generic - ERROR: invalid SMKn signature (got: %s)", buf);
 		goto error;
 	}
 
@@ -697,15 +2070,15 @@ static smk smk_open_generic(const unsigned char m, union smk_read_t fp, unsigned
 	smk_read(&s->video.v, 1);
 
 	if (s->video.v != '2' && s->video.v != '4') {
-		fprintf(stderr, "libsmacker::smk_open_generic - Warning: invalid SMK version %c (expected: 2 or 4)\n", s->video.v);
-
 		/* take a guess */
+		temp_l = s->video.v;
+
 		if (s->video.v < '4')
 			s->video.v = '2';
 		else
 			s->video.v = '4';
 
-		fprintf(stderr, "\tProcessing will continue as type %c\n", s->video.v);
+		smk_warn(SMK_ERR_FORMAT, "libsmacker::smk_open_generic - Warning: invalid SMK version %c (expected: 2 or 4), processing will continue as type %c", (char)temp_l, s->video.v);
 	}
 
 	/* width, height, total num frames */
@@ -741,7 +2114,7 @@ static smk smk_open_generic(const unsigned char m, union smk_read_t fp, unsigned
 
 	if (temp_u & 0x04) {
 		if (s->video.y_scale_mode == SMK_FLAG_Y_DOUBLE)
-			fputs("libsmacker::smk_open_generic - Warning: SMK file specifies both Y-Double AND Y-Interlace.\n", stderr);
+			smk_warn(SMK_ERR_FORMAT, "libsmacker::smk_open_generic - Warning: SMK file specifies both Y-Double AND Y-Interlace.");
 
 		s->video.y_scale_mode = SMK_FLAG_Y_INTERLACE;
 	}
@@ -774,7 +2147,7 @@ static smk smk_open_generic(const unsigned char m, union smk_read_t fp, unsigned
 			s->audio[temp_l].channels = ((temp_u & 0x10000000) ? 2 : 1);
 
 			if (temp_u & 0x0c000000) {
-				fprintf(stderr, "libsmacker::smk_open_generic - Warning: audio track %ld is compressed with Bink (perceptual) Audio Codec: this is currently unsupported by libsmacker\n", temp_l);
+				smk_warn(SMK_ERR_UNSUPPORTED, "libsmacker::smk_open_generic - Warning: audio track %ld is compressed with Bink (perceptual) Audio Codec: this is currently unsupported by libsmacker", temp_l);
 				s->audio[temp_l].compress = 2;
 			}
 
@@ -786,81 +2159,234 @@ static smk smk_open_generic(const unsigned char m, union smk_read_t fp, unsigned
 	/* Skip over Dummy field */
 	smk_read_ul(temp_u);
 	/* FrameSizes and Keyframe marker are stored together. */
-	smk_malloc(s->keyframe, (s->f + s->ring_frame));
-	smk_malloc(s->chunk_size, (s->f + s->ring_frame) * sizeof(unsigned long));
+	smk_malloc(s->index, (s->f + s->ring_frame) * sizeof(struct smk_index_t));
 
 	for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
-		smk_read_ul(s->chunk_size[temp_u]);
+		unsigned long chunk_size;
+		smk_read_ul(chunk_size);
 
 		/* Set Keyframe */
-		if (s->chunk_size[temp_u] & 0x01)
-			s->keyframe[temp_u] = 1;
+		if (chunk_size & 0x01)
+			s->index[temp_u].keyframe = 1;
 
 		/* Bits 1 is used, but the purpose is unknown. */
-		s->chunk_size[temp_u] &= 0xFFFFFFFC;
+		s->index[temp_u].size = chunk_size & 0xFFFFFFFC;
 	}
 
 	/* That was easy... Now read FrameTypes! */
-	smk_malloc(s->frame_type, (s->f + s->ring_frame));
-
 	for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++)
-		smk_read(&s->frame_type[temp_u], 1);
+		smk_read(&s->index[temp_u].type, 1);
 
 	/* HuffmanTrees
 		We know the sizes already: read and assemble into
 		something actually parse-able at run-time */
-	smk_malloc(hufftree_chunk, tree_size);
+	smk_malloc(hufftree_chunk, tree_size + SMK_BS_PAD);
 	smk_read(hufftree_chunk, tree_size);
 	/* set up a Bitstream */
 	smk_bs_init(&bs, hufftree_chunk, tree_size);
 
 	/* create some tables */
-	for (temp_u = 0; temp_u < 4; temp_u ++) {
-		if (! smk_huff16_build(&s->video.tree[temp_u], &bs, s->video.tree_size[temp_u])) {
-			fprintf(stderr, "libsmacker::smk_open_generic - ERROR: failed to create huff16 tree %lu\n", temp_u);
-			goto error;
-		}
+	if (! smk_huff16_build_all(s->video.tree, &s->video.tree_lut, &bs, s->video.tree_size)) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_open_generic - ERROR: failed to create huff16 trees");
+		goto error;
 	}
 
 	/* clean up */
 	smk_free(hufftree_chunk);
 	/* Go ahead and malloc storage for the video frame */
 	smk_malloc(s->video.frame, s->video.w * s->video.h);
+	smk_malloc(s->video.dirty, smk_dirty_size(&s->video));
+	smk_malloc(s->video.dirty_runs, smk_dirty_runs_size(&s->video));
+	smk_render_video_init(&s->video);
 	/* final processing: depending on ProcessMode, handle what to do with rest of file data */
 	s->mode = process_mode;
 
 	/* Handle the rest of the data.
 		For MODE_MEMORY, read the chunks and store */
 	if (s->mode == SMK_MODE_MEMORY) {
+		/* total size of the chunks */
+		uint64_t offset = 0;
+
+		for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
+			s->index[temp_u].offset = offset;
+			offset += s->index[temp_u].size;
+		}
+
+		if (offset > (unsigned long)-1 - SMK_BS_PAD || (!m && offset > size)) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_open_generic - ERROR: frames end past end of file (%lu bytes of chunks)", (unsigned long)offset);
+			goto error;
+		}
+
+		/* A corrupt header may claim any size: where the stream can seek,
+			check that the chunks are really there before allocating them */
+		if (m && offset && fp.io->seek && fp.io->tell && (temp_l = fp.io->tell(fp.io->handle)) >= 0) {
+			if (offset > (uint64_t)(LONG_MAX - temp_l)) {
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_open_generic - ERROR: frames end past the largest seekable offset (%lu)", (unsigned long)LONG_MAX);
+				goto error;
+			}
+
+			if (fp.io->seek(fp.io->handle, (unsigned long)(temp_l + offset - 1)) == 0 &&
+				(fp.io->read(fp.io->handle, buf, 1) != 1 || fp.io->seek(fp.io->handle, (unsigned long)temp_l))) {
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_open_generic - ERROR: file is incomplete, frames end at offset %lu", (unsigned long)(temp_l + offset));
+				goto error;
+			}
+		}
+
+		/* one block, filled by one read: only the padding needs clearing.
+			Not smk_malloc: a failure here fails the open, not the program */
+		if ((s->source.arena = malloc((unsigned long)offset + SMK_BS_PAD)) == NULL) {
+			smk_error(SMK_ERR_MEMORY, "libsmacker::smk_open_generic - ERROR: failed to malloc() %lu bytes of chunks: %s", (unsigned long)offset, strerror(errno));
+			goto error;
+		}
+
+		memset(s->source.arena + offset, 0, SMK_BS_PAD);
+		smk_read(s->source.arena, (unsigned long)offset);
+	} else if (s->mode == SMK_MODE_MMAP || s->mode == SMK_MODE_BORROW) {
+		/* MODE_MMAP / BORROW: point every chunk into the file image, checking it all fits */
 		smk_malloc(s->source.chunk_data, (s->f + s->ring_frame) * sizeof(unsigned char *));
 
 		for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
-			smk_malloc(s->source.chunk_data[temp_u], s->chunk_size[temp_u]);
-			smk_read(s->source.chunk_data[temp_u], s->chunk_size[temp_u]);
+			if (s->index[temp_u].size > size) {
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_open_generic - ERROR: frame %lu (size %lu) extends past end of file", temp_u, (unsigned long)s->index[temp_u].size);
+				goto error;
+			}
+
+			s->source.chunk_data[temp_u] = fp.ram;
+			fp.ram += s->index[temp_u].size;
+			size -= s->index[temp_u].size;
+		}
+
+		/* The mapping is padded, but a borrowed buffer may end right after
+			the last chunk: copy the chunks near its end into a padded tail. */
+		if (s->mode == SMK_MODE_BORROW) {
+			unsigned long tail_size;
+
+			for (temp_u = s->f + s->ring_frame; temp_u > 0; temp_u --) {
+				if ((unsigned long)(fp.ram - s->source.chunk_data[temp_u - 1]) - s->index[temp_u - 1].size + size >= SMK_BS_PAD)
+					break;
+			}
+
+			if (temp_u < s->f + s->ring_frame) {
+				tail_size = fp.ram - s->source.chunk_data[temp_u];
+				smk_malloc(s->tail, tail_size + SMK_BS_PAD);
+				memcpy(s->tail, s->source.chunk_data[temp_u], tail_size);
+
+				for (temp_l = s->f + s->ring_frame - 1; temp_l >= (long)temp_u; temp_l --)
+					s->source.chunk_data[temp_l] = s->tail + (s->source.chunk_data[temp_l] - s->source.chunk_data[temp_u]);
+			}
+		}
+	} else if (s->mode == SMK_MODE_PUSH) {
+		/* MODE_PUSH: the chunks arrive later, one at a time.
+			Not smk_malloc: no file backs the chunk sizes yet, so a
+			failure here fails the open, not the program */
+		temp_u = smk_max_chunk(s->index, s->f + s->ring_frame);
+
+		if ((s->source.file.buffer = malloc(temp_u + SMK_BS_PAD)) == NULL) {
+			smk_error(SMK_ERR_MEMORY, "libsmacker::smk_open_generic - ERROR: failed to malloc() a %lu byte chunk buffer: %s", temp_u, strerror(errno));
+			goto error;
 		}
 	} else {
-		/* MODE_STREAM: don't read anything now, just precompute offsets.
-			use fseek to verify that the file is "complete" */
-		smk_malloc(s->source.file.chunk_offset, (s->f + s->ring_frame) * sizeof(unsigned long));
+		/* end of the chunks so far */
+		uint64_t offset;
+
+		/* MODE_STREAM: don't read anything now, just precompute offsets
+			(each chunk follows the last).  Then read the final byte,
+			to verify that the file is "complete" */
+		if ((temp_l = fp.io->tell(fp.io->handle)) < 0) {
+			smk_error(SMK_ERR_IO, "libsmacker::smk_open - ERROR: tell failed: %s", strerror(errno));
+			goto error;
+		}
+
+		offset = temp_l;
 
 		for (temp_u = 0; temp_u < (s->f + s->ring_frame); temp_u ++) {
-			s->source.file.chunk_offset[temp_u] = ftell(fp.file);
+			s->index[temp_u].offset = offset;
+			offset += s->index[temp_u].size;
+		}
+
+		/* seeks take a long */
+		if (offset > LONG_MAX) {
+			smk_error(SMK_ERR_UNSUPPORTED, "libsmacker::smk_open - ERROR: frames end past the largest seekable offset (%lu)", (unsigned long)LONG_MAX);
+			goto error;
+		}
 
-			if (fseek(fp.file, s->chunk_size[temp_u], SEEK_CUR)) {
-				fprintf(stderr, "libsmacker::smk_open - ERROR: fseek to frame %lu not OK.\n", temp_u);
-				perror("\tError reported was");
+		if (offset > (uint64_t)temp_l) {
+			if (fp.io->seek(fp.io->handle, (unsigned long)offset - 1) || fp.io->read(fp.io->handle, buf, 1) != 1) {
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_open - ERROR: file is incomplete, frames end at offset %lu", (unsigned long)offset);
 				goto error;
 			}
 		}
+
+		s->source.file.io = *fp.io;
+		s->source.file.pos = offset;
+		/* one buffer, reused for every chunk, plus the zeroed tail
+			the bitstream reader expects */
+		smk_malloc(s->source.file.buffer, smk_max_chunk(s->index, s->f + s->ring_frame) + SMK_BS_PAD);
 	}
 
 	return s;
 error:
-	smk_free(hufftree_chunk);
+	/* (gone already if the chunks failed) */
+	if (hufftree_chunk)
+		smk_free(hufftree_chunk);
+
 	smk_close(s);
 	return NULL;
 }
 
+#ifdef HAVE_SYS_MMAN_H
+/* open an smk (by mapping a file, from offset start) */
+static smk smk_open_mmap(const int fd, const long start)
+{
+	smk s;
+	union smk_read_t fp;
+	struct stat st;
+	size_t size;
+	unsigned char * map;
+
+	if (start < 0 || fstat(fd, &st)) {
+		smk_error(SMK_ERR_IO, "libsmacker::smk_open_mmap() - ERROR: could not stat file: %s", strerror(errno));
+		return NULL;
+	}
+
+	if (st.st_size <= start) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_open_mmap() - ERROR: file is empty");
+		return NULL;
+	}
+
+	/* Reserve room for the file plus the bitstream padding, then map
+		the file over it: the rest of the reservation reads as zeroes */
+	size = (size_t)st.st_size + SMK_BS_PAD;
+
+	if ((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		smk_error(SMK_ERR_MEMORY, "libsmacker::smk_open_mmap() - ERROR: failed to reserve %lu bytes: %s", (unsigned long)size, strerror(errno));
+		return NULL;
+	}
+
+	/* shared, read-only pages: every process playing the file uses the same page cache */
+	if (mmap(map, (size_t)st.st_size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		smk_error(SMK_ERR_IO, "libsmacker::smk_open_mmap() - ERROR: failed to map file: %s", strerror(errno));
+		munmap(map, size);
+		return NULL;
+	}
+
+#ifdef MADV_SEQUENTIAL
+	/* playback walks the file front to back */
+	madvise(map, size, MADV_SEQUENTIAL);
+#endif
+	fp.ram = map + start;
+
+	if (!(s = smk_open_generic(0, fp, (unsigned long)(st.st_size - start), SMK_MODE_MMAP))) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	s->map = map;
+	s->map_size = size;
+	return s;
+}
+#endif
+
 /* open an smk (from a memory buffer) */
 smk smk_open_memory(const unsigned char * buffer, const unsigned long size)
 {
@@ -868,7 +2394,7 @@ smk smk_open_memory(const unsigned char * buffer, const unsigned long size)
 	union smk_read_t fp;
 
 	if (buffer == NULL) {
-		fputs("libsmacker::smk_open_memory() - ERROR: buffer pointer is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_open_memory() - ERROR: buffer pointer is NULL");
 		return NULL;
 	}
 
@@ -876,54 +2402,180 @@ smk smk_open_memory(const unsigned char * buffer, const unsigned long size)
 	fp.ram = (unsigned char *)buffer;
 
 	if (!(s = smk_open_generic(0, fp, size, SMK_MODE_MEMORY)))
-		fprintf(stderr, "libsmacker::smk_open_memory(buffer,%lu) - ERROR: Fatal error in smk_open_generic, returning NULL.\n", size);
+		smk_error(smk_error_code, "libsmacker::smk_open_memory(buffer,%lu) - ERROR: Fatal error in smk_open_generic, returning NULL.", size);
+
+	return s;
+}
+
+/* open an smk (from a memory buffer, without copying it) */
+smk smk_open_memory_borrow(const unsigned char * buffer, const unsigned long size)
+{
+	smk s = NULL;
+	union smk_read_t fp;
+
+	if (buffer == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_open_memory_borrow() - ERROR: buffer pointer is NULL");
+		return NULL;
+	}
+
+	/* set up the read union for Memory mode */
+	fp.ram = (unsigned char *)buffer;
+
+	if (!(s = smk_open_generic(0, fp, size, SMK_MODE_BORROW)))
+		smk_error(smk_error_code, "libsmacker::smk_open_memory_borrow(buffer,%lu) - ERROR: Fatal error in smk_open_generic, returning NULL.", size);
 
 	return s;
 }
 
 /* open an smk (from a file) */
-smk smk_open_filepointer(FILE * file, const unsigned char mode)
+smk smk_open_filepointer(FILE * file, unsigned char mode)
 {
 	smk s = NULL;
 	union smk_read_t fp;
+	struct smk_io_t io;
 
 	if (file == NULL) {
-		fputs("libsmacker::smk_open_filepointer() - ERROR: file pointer is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_open_filepointer() - ERROR: file pointer is NULL");
 		return NULL;
 	}
 
-	/* Copy file ptr to internal union */
-	fp.file = file;
+	if (mode == SMK_MODE_MMAP) {
+#ifdef HAVE_SYS_MMAN_H
+
+		if (!(s = smk_open_mmap(fileno(file), ftell(file))))
+			smk_error(smk_error_code, "libsmacker::smk_open_filepointer(file,%u) - ERROR: Fatal error in smk_open_mmap, returning NULL.", mode);
+
+		/* the mapping outlives the file */
+		fclose(file);
+		return s;
+#else
+		smk_warn(SMK_ERR_UNSUPPORTED, "libsmacker::smk_open_filepointer(file,%u) - Warning: mmap is not supported, using SMK_MODE_MEMORY", mode);
+		mode = SMK_MODE_MEMORY;
+#endif
+	}
+
+	/* Read the file through stdio */
+	io.read = smk_io_file_read;
+	io.seek = smk_io_file_seek;
+	io.tell = smk_io_file_tell;
+	io.handle = file;
+	fp.io = &io;
 
 	if (!(s = smk_open_generic(1, fp, 0, mode))) {
-		fprintf(stderr, "libsmacker::smk_open_filepointer(file,%u) - ERROR: Fatal error in smk_open_generic, returning NULL.\n", mode);
-		fclose(fp.file);
+		smk_error(smk_error_code, "libsmacker::smk_open_filepointer(file,%u) - ERROR: Fatal error in smk_open_generic, returning NULL.", mode);
+		fclose(file);
 		goto error;
 	}
 
 	if (mode == SMK_MODE_MEMORY)
-		fclose(fp.file);
+		fclose(file);
 	else
-		s->source.file.fp = fp.file;
+		s->source.file.fp = file;
 
 	/* fall through, return s or null */
 error:
 	return s;
 }
 
+/* open an smk (from a file descriptor, with positional reads) */
+smk smk_open_fd(const int fd, unsigned char mode)
+{
+#ifdef HAVE_PREAD
+	smk s = NULL;
+	union smk_read_t fp;
+	struct smk_io_t io;
+	struct smk_fd_t * f = NULL;
+
+	if (fd < 0) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_open_fd(%d,%u) - ERROR: invalid file descriptor", fd, mode);
+		return NULL;
+	}
+
+	if (mode == SMK_MODE_MMAP) {
+#ifdef HAVE_SYS_MMAN_H
+
+		if (!(s = smk_open_mmap(fd, 0)))
+			smk_error(smk_error_code, "libsmacker::smk_open_fd(%d,%u) - ERROR: Fatal error in smk_open_mmap, returning NULL.", fd, mode);
+
+		return s;
+#else
+		smk_warn(SMK_ERR_UNSUPPORTED, "libsmacker::smk_open_fd(%d,%u) - Warning: mmap is not supported, using SMK_MODE_MEMORY", fd, mode);
+		mode = SMK_MODE_MEMORY;
+#endif
+	}
+
+	/* Read the descriptor from its start, keeping our own position */
+	smk_malloc(f, sizeof(struct smk_fd_t));
+	f->fd = fd;
+	io.read = smk_io_fd_read;
+	io.seek = smk_io_fd_seek;
+	io.tell = smk_io_fd_tell;
+	io.handle = f;
+	fp.io = &io;
+
+	if (!(s = smk_open_generic(1, fp, 0, mode))) {
+		smk_error(smk_error_code, "libsmacker::smk_open_fd(%d,%u) - ERROR: Fatal error in smk_open_generic, returning NULL.", fd, mode);
+		smk_free(f);
+		return NULL;
+	}
+
+	if (mode == SMK_MODE_MEMORY) {
+		smk_free(f);
+	} else
+		s->source.file.fd = f;
+
+	return s;
+#else
+	smk_error(SMK_ERR_UNSUPPORTED, "libsmacker::smk_open_fd(%d,%u) - ERROR: libsmacker was built without pread support", fd, mode);
+	return NULL;
+#endif
+}
+
+/* open an smk (through the caller's I/O callbacks) */
+smk smk_open_callbacks(smk_read_callback read, smk_seek_callback seek, smk_tell_callback tell, void * handle, unsigned char mode)
+{
+	smk s = NULL;
+	union smk_read_t fp;
+	struct smk_io_t io;
+
+	if (read == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_open_callbacks() - ERROR: read callback is NULL");
+		return NULL;
+	}
+
+	/* there is nothing to map: every mode but disk reads it all now */
+	if (mode != SMK_MODE_DISK)
+		mode = SMK_MODE_MEMORY;
+	else if (seek == NULL || tell == NULL) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_open_callbacks(read,seek,tell,handle,%u) - ERROR: SMK_MODE_DISK needs seek and tell callbacks", mode);
+		return NULL;
+	}
+
+	/* set up the read union for callback mode */
+	io.read = read;
+	io.seek = seek;
+	io.tell = tell;
+	io.handle = handle;
+	fp.io = &io;
+
+	if (!(s = smk_open_generic(1, fp, 0, mode)))
+		smk_error(smk_error_code, "libsmacker::smk_open_callbacks(read,seek,tell,handle,%u) - ERROR: Fatal error in smk_open_generic, returning NULL.", mode);
+
+	return s;
+}
+
 /* open an smk (from a file) */
 smk smk_open_file(const char * filename, const unsigned char mode)
 {
 	FILE * fp;
 
 	if (filename == NULL) {
-		fputs("libsmacker::smk_open_file() - ERROR: filename is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_open_file() - ERROR: filename is NULL");
 		return NULL;
 	}
 
 	if (!(fp = fopen(filename, "rb"))) {
-		fprintf(stderr, "libsmacker::smk_open_file(%s,%u) - ERROR: could not open file\n", filename, mode);
-		perror("\tError reported was");
+		smk_error(SMK_ERR_IO, "libsmacker::smk_open_file(%s,%u) - ERROR: could not open file: %s", filename, mode, strerror(errno));
 		goto error;
 	}
 
@@ -934,22 +2586,132 @@ error:
 	return NULL;
 }
 
+/* Counts a handle in (delta 1) or out (-1) of a shared set, returning how many are left */
+static unsigned long smk_refs_add(struct smk_refs_t * const refs, const int delta)
+{
+#if defined(__GNUC__)
+	return __atomic_add_fetch(&refs->count, delta, __ATOMIC_ACQ_REL);
+#elif defined(HAVE_PTHREAD_H)
+	unsigned long count;
+	pthread_mutex_lock(&refs->lock);
+	count = (refs->count += delta);
+	pthread_mutex_unlock(&refs->lock);
+	return count;
+#else
+	return (refs->count += delta);
+#endif
+}
+
+/* open another handle on the same smk, sharing everything but the decoding state */
+smk smk_clone(const smk object)
+{
+	smk s = NULL;
+	unsigned char track;
+
+	/* null check */
+	if (object == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_clone() - ERROR: smk is NULL");
+		return NULL;
+	}
+
+	if (object->mode == SMK_MODE_PUSH) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_clone() - ERROR: pushed input can't be cloned");
+		return NULL;
+	}
+
+	/* A disk-mode stream can't be read by two handles at once, a shared descriptor can */
+	if (object->mode == SMK_MODE_DISK && !object->source.file.fd) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_clone() - ERROR: in disk mode, only smk from smk_open_fd() can be cloned");
+		return NULL;
+	}
+
+	if (object->pipe) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_clone() - ERROR: stop the pipeline first");
+		return NULL;
+	}
+
+	smk_refs_add(object->refs, 1);
+	smk_malloc(s, sizeof(struct smk_t));
+	*s = *object;
+
+	/* Own decoding state: rewound, with a blank frame and palette,
+		the same switches, and no threads */
+	s->cur_frame = 0;
+	s->pool = NULL;
+	s->pipe = NULL;
+	s->video.cmd = NULL;
+	s->video.frame = NULL;
+	s->video.dirty = NULL;
+	s->video.dirty_runs = NULL;
+	s->video.frame_changed = 0;
+	s->video.palette_changed = 0;
+	memset(s->video.palette, 0, 256 * 3);
+	smk_malloc(s->video.frame, s->video.w * s->video.h);
+	smk_malloc(s->video.dirty, smk_dirty_size(&s->video));
+	smk_malloc(s->video.dirty_runs, smk_dirty_runs_size(&s->video));
+
+	for (track = 0; track < 7; track ++) {
+		s->audio[track].buffer = NULL;
+		s->audio[track].buffer_size = 0;
+
+		if (object->audio[track].buffer)
+			smk_malloc(s->audio[track].buffer, object->audio[track].max_buffer);
+	}
+
+	if (s->mode == SMK_MODE_DISK) {
+#ifdef HAVE_PREAD
+		/* Own position in the descriptor, and own chunk buffer */
+		s->source.file.fd = NULL;
+		s->source.file.buffer = NULL;
+		s->source.file.ahead = NULL;
+		s->source.file.pos = (uint64_t) -1;
+		smk_malloc(s->source.file.fd, sizeof(struct smk_fd_t));
+		s->source.file.fd->fd = object->source.file.fd->fd;
+		s->source.file.io.handle = s->source.file.fd;
+		smk_malloc(s->source.file.buffer, smk_max_chunk(s->index, s->f + s->ring_frame) + SMK_BS_PAD);
+#endif
+	}
+
+	return s;
+}
+
 /* close out an smk file and clean up memory */
 void smk_close(smk s)
 {
 	unsigned long u;
 
 	if (s == NULL) {
-		fputs("libsmacker::smk_close() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_close() - ERROR: smk is NULL");
 		return;
 	}
 
-	/* free video sub-components */
-	for (u = 0; u < 4; u ++) {
-		if (s->video.tree[u].tree) free(s->video.tree[u].tree);
+#ifdef HAVE_PTHREAD_H
+
+	/* stop the background decoder, which uses everything below */
+	if (s->pipe)
+		smk_pipe_destroy(s->pipe);
+
+	/* stop worker threads */
+	if (s->pool) {
+		smk_pool_destroy(s->pool);
+		smk_free(s->video.cmd);
 	}
 
-	smk_free(s->video.frame);
+	/* and the reader, before freeing the index it reads */
+	if ((s->mode == SMK_MODE_DISK || s->mode == SMK_MODE_PUSH) && s->source.file.ahead)
+		smk_ahead_destroy(s->source.file.ahead);
+
+#endif
+
+	/* free video sub-components (an open that failed early has none) */
+	if (s->video.frame)
+		smk_free(s->video.frame);
+
+	if (s->video.dirty)
+		smk_free(s->video.dirty);
+
+	if (s->video.dirty_runs)
+		smk_free(s->video.dirty_runs);
 
 	/* free audio sub-components */
 	for (u = 0; u < 7; u++) {
@@ -957,26 +2719,57 @@ void smk_close(smk s)
 			smk_free(s->audio[u].buffer);
 	}
 
-	smk_free(s->keyframe);
-	smk_free(s->frame_type);
-
-	if (s->mode == SMK_MODE_DISK) {
-		/* disk-mode */
+	if (s->mode == SMK_MODE_DISK || s->mode == SMK_MODE_PUSH) {
+		/* disk-mode (push mode uses only the chunk buffer) */
 		if (s->source.file.fp)
 			fclose(s->source.file.fp);
 
-		smk_free(s->source.file.chunk_offset);
-	} else {
-		/* mem-mode */
-		if (s->source.chunk_data != NULL) {
-			for (u = 0; u < (s->f + s->ring_frame); u++)
-				smk_free(s->source.chunk_data[u]);
+		if (s->source.file.fd)
+			smk_free(s->source.file.fd);
 
-			smk_free(s->source.chunk_data);
+		if (s->source.file.buffer)
+			smk_free(s->source.file.buffer);
+	}
+
+	/* The rest may be shared with clones: left to the last one closed */
+	if (s->refs) {
+		if (smk_refs_add(s->refs, -1)) {
+			smk_free(s);
+			return;
 		}
+
+#if defined(HAVE_PTHREAD_H) && !defined(__GNUC__)
+		pthread_mutex_destroy(&s->refs->lock);
+#endif
+		smk_free(s->refs);
+	}
+
+	if (s->video.tree_lut)
+		smk_free(s->video.tree_lut);
+
+	if (s->index)
+		smk_free(s->index);
+
+	if (s->mode == SMK_MODE_MMAP || s->mode == SMK_MODE_BORROW) {
+		/* mmap / borrow mode: chunks belong to the file image */
+		if (s->source.chunk_data != NULL)
+			smk_free(s->source.chunk_data);
+
+		if (s->tail)
+			smk_free(s->tail);
+
+#ifdef HAVE_SYS_MMAN_H
+
+		if (s->map)
+			munmap(s->map, s->map_size);
+
+#endif
+	} else if (s->mode == SMK_MODE_MEMORY) {
+		/* mem-mode */
+		if (s->source.arena != NULL)
+			smk_free(s->source.arena);
 	}
 
-	smk_free(s->chunk_size);
 	smk_free(s);
 }
 
@@ -985,17 +2778,18 @@ char smk_info_all(const smk object, unsigned long * frame, unsigned long * frame
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_info_all() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_info_all() - ERROR: smk is NULL");
 		return -1;
 	}
 
 	if (!frame && !frame_count && !usf) {
-		fputs("libsmacker::smk_info_all(object,frame,frame_count,usf) - ERROR: Request for info with all-NULL return references\n", stderr);
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_info_all(object,frame,frame_count,usf) - ERROR: Request for info with all-NULL return references");
 		goto error;
 	}
 
+	/* the ring frame is frame 0 again; a file may have no frames at all */
 	if (frame)
-		*frame = (object->cur_frame % object->f);
+		*frame = (object->f ? object->cur_frame % object->f : 0);
 
 	if (frame_count)
 		*frame_count = object->f;
@@ -1012,12 +2806,12 @@ char smk_info_video(const smk object, unsigned long * w, unsigned long * h, unsi
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_info_video() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_info_video() - ERROR: smk is NULL");
 		return -1;
 	}
 
 	if (!w && !h && !y_scale_mode) {
-		fputs("libsmacker::smk_info_all(object,w,h,y_scale_mode) - ERROR: Request for info with all-NULL return references\n", stderr);
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_info_all(object,w,h,y_scale_mode) - ERROR: Request for info with all-NULL return references");
 		return -1;
 	}
 
@@ -1039,12 +2833,12 @@ char smk_info_audio(const smk object, unsigned char * track_mask, unsigned char
 
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_info_audio() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_info_audio() - ERROR: smk is NULL");
 		return -1;
 	}
 
 	if (!track_mask && !channels && !bitdepth && !audio_rate) {
-		fputs("libsmacker::smk_info_audio(object,track_mask,channels,bitdepth,audio_rate) - ERROR: Request for info with all-NULL return references\n", stderr);
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_info_audio(object,track_mask,channels,bitdepth,audio_rate) - ERROR: Request for info with all-NULL return references");
 		return -1;
 	}
 
@@ -1083,7 +2877,7 @@ char smk_enable_all(smk object, const unsigned char mask)
 
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_enable_all() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_enable_all() - ERROR: smk is NULL");
 		return -1;
 	}
 
@@ -1102,7 +2896,7 @@ char smk_enable_video(smk object, const unsigned char enable)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_enable_video() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_enable_video() - ERROR: smk is NULL");
 		return -1;
 	}
 
@@ -1114,7 +2908,7 @@ char smk_enable_audio(smk object, const unsigned char track, const unsigned char
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_enable_audio() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_enable_audio() - ERROR: smk is NULL");
 		return -1;
 	}
 
@@ -1122,59 +2916,292 @@ char smk_enable_audio(smk object, const unsigned char track, const unsigned char
 	return 0;
 }
 
-const unsigned char * smk_get_palette(const smk object)
+/* Sets how many threads (the caller's included) decode each frame */
+char smk_set_threads(smk object, const unsigned int threads)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_get_palette() - ERROR: smk is NULL\n", stderr);
-		return NULL;
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_set_threads() - ERROR: smk is NULL");
+		return -1;
 	}
 
-	return (unsigned char *)object->video.palette;
+	if (object->pipe) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_set_threads() - ERROR: stop the pipeline first");
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+
+	/* stop any previous workers */
+	if (object->pool) {
+		smk_pool_destroy(object->pool);
+		object->pool = NULL;
+		smk_free(object->video.cmd);
+	}
+
+	if (threads < 2)
+		return 0;
+
+	if ((object->pool = smk_pool_create(threads - 1)) == NULL) {
+		smk_error(SMK_ERR_MEMORY, "libsmacker::smk_set_threads(object,%u) - ERROR: failed to create worker pool", threads);
+		return -1;
+	}
+
+	/* room for every block of a frame (and never a zero-sized block) */
+	smk_malloc(object->video.cmd, ((object->video.w + 3) / 4) * ((object->video.h + 3) / 4) * sizeof(struct smk_block_cmd_t) + 1);
+	return 0;
+#else
+
+	if (threads < 2)
+		return 0;
+
+	smk_error(SMK_ERR_UNSUPPORTED, "libsmacker::smk_set_threads(object,%u) - ERROR: libsmacker was built without thread support", threads);
+	return -1;
+#endif
 }
-const unsigned char * smk_get_video(const smk object)
+
+/* Sets whether the workers decode a frame's records side by side */
+char smk_set_concurrent(smk object, const unsigned char enable)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_get_video() - ERROR: smk is NULL\n", stderr);
-		return NULL;
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_set_concurrent() - ERROR: smk is NULL");
+		return -1;
 	}
 
-	return object->video.frame;
+	if (object->pipe) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_set_concurrent() - ERROR: stop the pipeline first");
+		return -1;
+	}
+
+	object->concurrent = (enable != 0);
+	return 0;
 }
-const unsigned char * smk_get_audio(const smk object, const unsigned char t)
+
+/* Sets how many chunks a background thread reads ahead in disk mode */
+char smk_set_readahead(smk object, const unsigned int chunks)
+{
+	/* null check */
+	if (object == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_set_readahead() - ERROR: smk is NULL");
+		return -1;
+	}
+
+	if (object->pipe) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_set_readahead() - ERROR: stop the pipeline first");
+		return -1;
+	}
+
+	/* everything else is in memory already */
+	if (object->mode != SMK_MODE_DISK)
+		return 0;
+
+#ifdef HAVE_PTHREAD_H
+
+	/* stop any previous reader: the file position is its own */
+	if (object->source.file.ahead) {
+		smk_ahead_destroy(object->source.file.ahead);
+		object->source.file.ahead = NULL;
+		object->source.file.pos = (uint64_t)-1;
+	}
+
+	if (chunks == 0)
+		return 0;
+
+	if ((object->source.file.ahead = smk_ahead_create(&object->source.file.io,
+		object->index,
+		object->f + object->ring_frame, object->ring_frame, chunks, object->cur_frame + 1)) == NULL) {
+		smk_error(smk_error_code, "libsmacker::smk_set_readahead(object,%u) - ERROR: failed to start read-ahead", chunks);
+		return -1;
+	}
+
+	return 0;
+#else
+
+	if (chunks == 0)
+		return 0;
+
+	smk_error(SMK_ERR_UNSUPPORTED, "libsmacker::smk_set_readahead(object,%u) - ERROR: libsmacker was built without thread support", chunks);
+	return -1;
+#endif
+}
+
+const unsigned char * smk_get_palette(const smk object)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_get_audio() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_get_palette() - ERROR: smk is NULL");
 		return NULL;
 	}
 
-	return object->audio[t].buffer;
+	return (unsigned char *)object->video.palette;
 }
-unsigned long smk_get_audio_size(const smk object, const unsigned char t)
+const unsigned char * smk_get_video(const smk object)
 {
 	/* null check */
 	if (object == NULL) {
-		fputs("libsmacker::smk_get_audio_size() - ERROR: smk is NULL\n", stderr);
-		return 0;
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_get_video() - ERROR: smk is NULL");
+		return NULL;
 	}
 
-	return object->audio[t].buffer_size;
+	return object->video.frame;
 }
 
-/* Decompresses a palette-frame. */
-static char smk_render_palette(struct smk_video_t * s, unsigned char * p, unsigned long size)
+/* tell what the last frame changed */
+char smk_info_changes(const smk object, unsigned char * frame_changed, unsigned char * palette_changed)
 {
-	/* Index into palette */
-	unsigned short i = 0;
-	/* Helper variables */
-	unsigned short count, src;
-	static unsigned char oldPalette[256][3];
-	/* Smacker palette map: smk colors are 6-bit, this table expands them to 8. */
-	const unsigned char palmap[64] = {
-		0x00, 0x04, 0x08, 0x0C, 0x10, 0x14, 0x18, 0x1C,
-		0x20, 0x24, 0x28, 0x2C, 0x30, 0x34, 0x38, 0x3C,
+	/* null check */
+	if (object == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_info_changes() - ERROR: smk is NULL");
+		return -1;
+	}
+
+	if (!frame_changed && !palette_changed) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_info_changes(object,frame_changed,palette_changed) - ERROR: Request for info with all-NULL return references");
+		return -1;
+	}
+
+	if (frame_changed)
+		*frame_changed = object->video.frame_changed;
+
+	if (palette_changed)
+		*palette_changed = object->video.palette_changed;
+
+	return 0;
+}
+
+const unsigned char * smk_get_dirty_blocks(const smk object)
+{
+	/* null check */
+	if (object == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_get_dirty_blocks() - ERROR: smk is NULL");
+		return NULL;
+	}
+
+	return object->video.dirty;
+}
+
+/* Merges the dirty blocks into rectangles: runs of blocks in a row,
+	joined with the run directly above when they span the same columns */
+unsigned long smk_get_dirty_rects(const smk object, unsigned long rect[][4], const unsigned long max)
+{
+	unsigned long bw, by, bx, x0, x1, y1, n = 0, i;
+	/* for each block column: 1 + index of the rectangle whose run
+		starts there on the previous / current row (0 if none) */
+	unsigned long * above, * here, * swap;
+
+	/* null check */
+	if (object == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_get_dirty_rects() - ERROR: smk is NULL");
+		return 0;
+	}
+
+	if (rect == NULL || max == 0) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_get_dirty_rects() - ERROR: no room for rectangles");
+		return 0;
+	}
+
+	if (!object->video.frame_changed)
+		return 0;
+
+	bw = (object->video.w + 3) / 4;
+	above = object->video.dirty_runs;
+	here = above + bw + 1;
+	memset(above, 0, (bw + 1) * sizeof(unsigned long));
+
+	for (by = 0; by * 4 < object->video.h; by ++) {
+		memset(here, 0, bw * sizeof(unsigned long));
+		y1 = by * 4 + 4;
+
+		if (y1 > object->video.h)
+			y1 = object->video.h;
+
+		for (bx = 0; bx < bw; bx ++) {
+			i = by * bw + bx;
+
+			if (!(object->video.dirty[i >> 3] & (1 << (i & 7))))
+				continue;
+
+			/* find the end of this run */
+			x0 = bx;
+
+			do {
+				bx ++;
+				i ++;
+			} while (bx < bw && (object->video.dirty[i >> 3] & (1 << (i & 7))));
+
+			x1 = bx * 4;
+
+			if (x1 > object->video.w)
+				x1 = object->video.w;
+
+			i = above[x0];
+
+			if (i && rect[i - 1][0] == x0 * 4 && rect[i - 1][0] + rect[i - 1][2] == x1) {
+				/* same columns as the run above: grow that one down */
+				rect[i - 1][3] = y1 - rect[i - 1][1];
+				here[x0] = i;
+			} else if (n < max) {
+				rect[n][0] = x0 * 4;
+				rect[n][1] = by * 4;
+				rect[n][2] = x1 - x0 * 4;
+				rect[n][3] = y1 - by * 4;
+				n ++;
+				here[x0] = n;
+			} else {
+				/* out of room: the last rectangle covers everything else */
+				if (rect[n - 1][0] + rect[n - 1][2] < x1)
+					rect[n - 1][2] = x1 - rect[n - 1][0];
+
+				if (rect[n - 1][0] > x0 * 4) {
+					rect[n - 1][2] += rect[n - 1][0] - x0 * 4;
+					rect[n - 1][0] = x0 * 4;
+				}
+
+				rect[n - 1][3] = y1 - rect[n - 1][1];
+			}
+		}
+
+		swap = above;
+		above = here;
+		here = swap;
+	}
+
+	return n;
+}
+const unsigned char * smk_get_audio(const smk object, const unsigned char t)
+{
+	/* null check */
+	if (object == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_get_audio() - ERROR: smk is NULL");
+		return NULL;
+	}
+
+	return object->audio[t].buffer;
+}
+unsigned long smk_get_audio_size(const smk object, const unsigned char t)
+{
+	/* null check */
+	if (object == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_get_audio_size() - ERROR: smk is NULL");
+		return 0;
+	}
+
+	return object->audio[t].buffer_size;
+}
+
+/* Decompresses a palette-frame. */
+static char smk_render_palette(struct smk_video_t * s, unsigned char * p, unsigned long size)
+{
+	/* Index into palette */
+	unsigned short i = 0;
+	/* Helper variables */
+	unsigned short count, src;
+	unsigned char oldPalette[256][3];
+	/* Smacker palette map: smk colors are 6-bit, this table expands them to 8. */
+	const unsigned char palmap[64] = {
+		0x00, 0x04, 0x08, 0x0C, 0x10, 0x14, 0x18, 0x1C,
+		0x20, 0x24, 0x28, 0x2C, 0x30, 0x34, 0x38, 0x3C,
 		0x41, 0x45, 0x49, 0x4D, 0x51, 0x55, 0x59, 0x5D,
 		0x61, 0x65, 0x69, 0x6D, 0x71, 0x75, 0x79, 0x7D,
 		0x82, 0x86, 0x8A, 0x8E, 0x92, 0x96, 0x9A, 0x9E,
@@ -1199,7 +3226,7 @@ static char smk_render_palette(struct smk_video_t * s, unsigned char * p, unsign
 
 			/* check for overflow condition */
 			if (i + count > 256) {
-				fprintf(stderr, "libsmacker::palette_render(s,p,size) - ERROR: overflow, 0x80 attempt to skip %d entries from %d\n", count, i);
+				smk_error(SMK_ERR_DATA, "libsmacker::palette_render(s,p,size) - ERROR: overflow, 0x80 attempt to skip %d entries from %d", count, i);
 				goto error;
 			}
 
@@ -1211,7 +3238,7 @@ static char smk_render_palette(struct smk_video_t * s, unsigned char * p, unsign
 				starting from entry (s),
 				to the next entries of the new palette. */
 			if (size < 2) {
-				fputs("libsmacker::palette_render(s,p,size) - ERROR: 0x40 ran out of bytes for copy\n", stderr);
+				smk_error(SMK_ERR_DATA, "libsmacker::palette_render(s,p,size) - ERROR: 0x40 ran out of bytes for copy");
 				goto error;
 			}
 
@@ -1227,7 +3254,7 @@ static char smk_render_palette(struct smk_video_t * s, unsigned char * p, unsign
 			/* overflow: see if we write/read beyond 256colors, or overwrite own palette */
 			if (i + count > 256 || src + count > 256 ||
 				(src < i && src + count > i)) {
-				fprintf(stderr, "libsmacker::palette_render(s,p,size) - ERROR: overflow, 0x40 attempt to copy %d entries from %d to %d\n", count, src, i);
+				smk_error(SMK_ERR_DATA, "libsmacker::palette_render(s,p,size) - ERROR: overflow, 0x40 attempt to copy %d entries from %d to %d", count, src, i);
 				goto error;
 			}
 
@@ -1238,13 +3265,13 @@ static char smk_render_palette(struct smk_video_t * s, unsigned char * p, unsign
 			/* 0x00: Set Color block
 				Direct-set the next 3 bytes for palette index */
 			if (size < 3) {
-				fprintf(stderr, "libsmacker::palette_render - ERROR: 0x3F ran out of bytes for copy, size=%lu\n", size);
+				smk_error(SMK_ERR_DATA, "libsmacker::palette_render - ERROR: 0x3F ran out of bytes for copy, size=%lu", size);
 				goto error;
 			}
 
 			for (count = 0; count < 3; count ++) {
 				if (*p > 0x3F) {
-					fprintf(stderr, "libsmacker::palette_render - ERROR: palette index exceeds 0x3F (entry [%u][%u])\n", i, count);
+					smk_error(SMK_ERR_DATA, "libsmacker::palette_render - ERROR: palette index exceeds 0x3F (entry [%u][%u])", i, count);
 					goto error;
 				}
 
@@ -1258,23 +3285,45 @@ static char smk_render_palette(struct smk_video_t * s, unsigned char * p, unsign
 	}
 
 	if (i < 256) {
-		fprintf(stderr, "libsmacker::palette_render - ERROR: did not completely fill palette (idx=%u)\n", i);
+		smk_error(SMK_ERR_DATA, "libsmacker::palette_render - ERROR: did not completely fill palette (idx=%u)", i);
 		goto error;
 	}
 
+	s->palette_changed = (memcmp(oldPalette, s->palette, 256 * 3) != 0);
 	return 0;
 error:
 	/* Error, return -1
 		The new palette probably has errors but is preferrable to a black screen */
+	s->palette_changed = (memcmp(oldPalette, s->palette, 256 * 3) != 0);
 	return -1;
 }
 
-static char smk_render_video(struct smk_video_t * s, unsigned char * p, unsigned int size)
+#if defined(__GNUC__)
+	#define SMK_FORCE_INLINE __inline__ __attribute__((always_inline))
+#elif defined(_MSC_VER)
+	#define SMK_FORCE_INLINE __forceinline
+#else
+	#define SMK_FORCE_INLINE
+#endif
+
+/* Video decoder body, instantiated below for each version and common width:
+	with v4 and w known at compile time, the version checks fold away
+	and the row stride becomes a constant. */
+static SMK_FORCE_INLINE char smk_render_video_body(struct smk_video_t * s, struct smk_pool_t * pool, unsigned char * p, unsigned int size, const unsigned char v4, const unsigned long w)
 {
 	unsigned char * t = s->frame;
+	/* next queued block, when applying them on the worker threads */
+	struct smk_block_cmd_t * c = NULL;
 	unsigned char s1, s2;
-	unsigned short temp;
+	/* colour values for one block */
+	unsigned short v[8];
 	unsigned long i, j, k, row, col, skip;
+	/* dirty-block tracking: index of the current block, and whether any was written */
+	unsigned char * const dirty = s->dirty;
+	unsigned long blk = 0;
+	unsigned char changed = 0;
+	/* blocks per row, when runs can be handled as row spans */
+	unsigned long span;
 	/* used for video decoding */
 	struct smk_bit_t bs;
 	/* results from a tree lookup */
@@ -1306,10 +3355,18 @@ static char smk_render_video(struct smk_video_t * s, unsigned char * p, unsigned
 	for (i = 0; i < 4; i++)
 		memset(&s->tree[i].cache, 0, 3 * sizeof(unsigned short));
 
+	/* Span fast paths need every row to hold a whole number of blocks */
+	span = (w && !(w & 3)) ? w / 4 : 0;
+
+	/* With workers, parse the whole frame first and write it in bands
+		afterwards. Bands only stay apart when blocks don't straddle rows. */
+	if (pool && span)
+		c = s->cmd;
+
 	while (row < s->h) {
 		if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_TYPE], &bs)) < 0) {
-			fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from TYPE tree.\n", stderr);
-			return -1;
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_render_video() - ERROR: failed to lookup from TYPE tree.");
+			goto error;
 		}
 
 		type = ((unpack & 0x0003));
@@ -1317,7 +3374,7 @@ static char smk_render_video(struct smk_video_t * s, unsigned char * p, unsigned
 		typedata = ((unpack & 0xFF00) >> 8);
 
 		/* support for v4 full-blocks */
-		if (type == 1 && s->v == '4') {
+		if (type == 1 && v4) {
 			bit = smk_bs_read_1(&bs);
 
 			if (bit)
@@ -1330,61 +3387,103 @@ static char smk_render_video(struct smk_video_t * s, unsigned char * p, unsigned
 			}
 		}
 
+		if (span && type == 2) {
+			/* VOID run: jump straight past it */
+			blk += sizetable[blocklen];
+			j = col / 4 + sizetable[blocklen];
+			row += 4 * (j / span);
+			col = 4 * (j % span);
+			continue;
+		}
+
+		if (span && type == 3) {
+			/* SOLID run: one fill per scanline, a block row at a time */
+			j = sizetable[blocklen];
+
+			while (j && row < s->h) {
+				k = (w - col) / 4;
+
+				if (k > j)
+					k = j;
+
+				skip = (row * w) + col;
+
+				if (c) {
+					c->skip = skip;
+					c->type = 3;
+					c->count = k;
+					c->s1 = typedata;
+					c ++;
+				} else {
+					for (i = 0; i < 4; i ++) {
+						memset(&t[skip], typedata, 4 * k);
+						skip += w;
+					}
+				}
+
+				smk_block_dirty(dirty, blk, k);
+				changed = 1;
+				blk += k;
+				j -= k;
+				col += 4 * k;
+
+				if (col >= w) {
+					col = 0;
+					row += 4;
+				}
+			}
+
+			continue;
+		}
+
 		for (j = 0; (j < sizetable[blocklen]) && (row < s->h); j ++) {
-			skip = (row * s->w) + col;
+			skip = (row * w) + col;
 
 			switch (type) {
 			case 0:
 				if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_MCLR], &bs)) < 0) {
-					fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from MCLR tree.\n", stderr);
-					return -1;
+					smk_error(SMK_ERR_DATA, "libsmacker::smk_render_video() - ERROR: failed to lookup from MCLR tree.");
+					goto error;
 				}
 
 				s1 = (unpack & 0xFF00) >> 8;
 				s2 = (unpack & 0x00FF);
 
 				if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_MMAP], &bs)) < 0) {
-					fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from MMAP tree.\n", stderr);
-					return -1;
+					smk_error(SMK_ERR_DATA, "libsmacker::smk_render_video() - ERROR: failed to lookup from MMAP tree.");
+					goto error;
 				}
 
-				temp = 0x01;
-
-				for (k = 0; k < 4; k ++) {
-					for (i = 0; i < 4; i ++) {
-						if (unpack & temp)
-							t[skip + i] = s1;
-						else
-							t[skip + i] = s2;
-
-						temp = temp << 1;
-					}
-
-					skip += s->w;
-				}
+				if (c) {
+					c->skip = skip;
+					c->type = 0;
+					c->s1 = s1;
+					c->s2 = s2;
+					c->v[0] = unpack;
+					c ++;
+				} else
+					smk_block.mono(&t[skip], w, unpack, s1, s2);
 
 				break;
 
 			case 1: /* FULL BLOCK */
-				for (k = 0; k < 4; k ++) {
-					if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_FULL], &bs)) < 0) {
-						fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.\n", stderr);
-						return -1;
-					}
-
-					t[skip + 3] = ((unpack & 0xFF00) >> 8);
-					t[skip + 2] = (unpack & 0x00FF);
-
+				for (k = 0; k < 8; k ++) {
 					if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_FULL], &bs)) < 0) {
-						fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.\n", stderr);
-						return -1;
+						smk_error(SMK_ERR_DATA, "libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.");
+						goto error;
 					}
 
-					t[skip + 1] = ((unpack & 0xFF00) >> 8);
-					t[skip] = (unpack & 0x00FF);
-					skip += s->w;
+					v[k] = unpack;
 				}
 
+				if (c) {
+					c->skip = skip;
+					c->type = 1;
+					memcpy(c->v, v, 8 * sizeof(unsigned short));
+					c ++;
+				} else
+					smk_block.full(&t[skip], w, v);
+
 				break;
 
 			case 2: /* VOID BLOCK */
@@ -1392,78 +3491,159 @@ static char smk_render_video(struct smk_video_t * s, unsigned char * p, unsigned
 				if (s->frame)
 				{
 					memcpy(&t[skip], &s->frame[skip], 4);
-					skip += s->w;
+					skip += w;
 					memcpy(&t[skip], &s->frame[skip], 4);
-					skip += s->w;
+					skip += w;
 					memcpy(&t[skip], &s->frame[skip], 4);
-					skip += s->w;
+					skip += w;
 					memcpy(&t[skip], &s->frame[skip], 4);
 				} */
 				break;
 
 			case 3: /* SOLID BLOCK */
 				memset(&t[skip], typedata, 4);
-				skip += s->w;
+				skip += w;
 				memset(&t[skip], typedata, 4);
-				skip += s->w;
+				skip += w;
 				memset(&t[skip], typedata, 4);
-				skip += s->w;
+				skip += w;
 				memset(&t[skip], typedata, 4);
 				break;
 
 			case 4: /* V4 DOUBLE BLOCK */
 				for (k = 0; k < 2; k ++) {
 					if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_FULL], &bs)) < 0) {
-						fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.\n", stderr);
-						return -1;
+						smk_error(SMK_ERR_DATA, "libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.");
+						goto error;
 					}
 
-					for (i = 0; i < 2; i ++) {
-						memset(&t[skip + 2], (unpack & 0xFF00) >> 8, 2);
-						memset(&t[skip], (unpack & 0x00FF), 2);
-						skip += s->w;
-					}
+					v[k] = unpack;
 				}
 
+				if (c) {
+					c->skip = skip;
+					c->type = 4;
+					memcpy(c->v, v, 2 * sizeof(unsigned short));
+					c ++;
+				} else
+					smk_block.dbl(&t[skip], w, v);
+
 				break;
 
 			case 5: /* V4 HALF BLOCK */
-				for (k = 0; k < 2; k ++) {
-					if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_FULL], &bs)) < 0) {
-						fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.\n", stderr);
-						return -1;
-					}
-
-					t[skip + 3] = ((unpack & 0xFF00) >> 8);
-					t[skip + 2] = (unpack & 0x00FF);
-					t[skip + s->w + 3] = ((unpack & 0xFF00) >> 8);
-					t[skip + s->w + 2] = (unpack & 0x00FF);
-
+				for (k = 0; k < 4; k ++) {
 					if ((unpack = smk_huff16_lookup(&s->tree[SMK_TREE_FULL], &bs)) < 0) {
-						fputs("libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.\n", stderr);
-						return -1;
+						smk_error(SMK_ERR_DATA, "libsmacker::smk_render_video() - ERROR: failed to lookup from FULL tree.");
+						goto error;
 					}
 
-					t[skip + 1] = ((unpack & 0xFF00) >> 8);
-					t[skip] = (unpack & 0x00FF);
-					t[skip + s->w + 1] = ((unpack & 0xFF00) >> 8);
-					t[skip + s->w] = (unpack & 0x00FF);
-					skip += (s->w << 1);
+					v[k] = unpack;
 				}
 
+				if (c) {
+					c->skip = skip;
+					c->type = 5;
+					memcpy(c->v, v, 4 * sizeof(unsigned short));
+					c ++;
+				} else
+					smk_block.half(&t[skip], w, v);
+
 				break;
 			}
 
+			if (type != 2) {
+				dirty[blk >> 3] |= 1 << (blk & 7);
+				changed = 1;
+			}
+
+			blk ++;
 			col += 4;
 
-			if (col >= s->w) {
+			if (col >= w) {
 				col = 0;
 				row += 4;
 			}
 		}
 	}
 
+#ifdef HAVE_PTHREAD_H
+
+	if (c)
+		smk_block_apply_pool(pool, t, w, s->h, s->cmd, c);
+
+#endif
+	s->frame_changed = changed;
+
+	/* overruns are only caught on refill: check the last few symbols too */
+	if (bs.left < 0) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_render_video() - ERROR: bitstream exhausted.");
+		return -1;
+	}
+
 	return 0;
+error:
+	/* still write what was parsed, as a single pass would have done */
+#ifdef HAVE_PTHREAD_H
+
+	if (c)
+		smk_block_apply_pool(pool, t, w, s->h, s->cmd, c);
+
+#endif
+	s->frame_changed = changed;
+	return -1;
+}
+
+static char smk_render_video_v2(struct smk_video_t * s, struct smk_pool_t * pool, unsigned char * p, unsigned int size)
+{
+	return smk_render_video_body(s, pool, p, size, 0, s->w);
+}
+
+static char smk_render_video_v2_320(struct smk_video_t * s, struct smk_pool_t * pool, unsigned char * p, unsigned int size)
+{
+	return smk_render_video_body(s, pool, p, size, 0, 320);
+}
+
+static char smk_render_video_v2_640(struct smk_video_t * s, struct smk_pool_t * pool, unsigned char * p, unsigned int size)
+{
+	return smk_render_video_body(s, pool, p, size, 0, 640);
+}
+
+static char smk_render_video_v4(struct smk_video_t * s, struct smk_pool_t * pool, unsigned char * p, unsigned int size)
+{
+	return smk_render_video_body(s, pool, p, size, 1, s->w);
+}
+
+static char smk_render_video_v4_320(struct smk_video_t * s, struct smk_pool_t * pool, unsigned char * p, unsigned int size)
+{
+	return smk_render_video_body(s, pool, p, size, 1, 320);
+}
+
+static char smk_render_video_v4_640(struct smk_video_t * s, struct smk_pool_t * pool, unsigned char * p, unsigned int size)
+{
+	return smk_render_video_body(s, pool, p, size, 1, 640);
+}
+
+/* Picks the video decoder for this file's version and width */
+static void smk_render_video_init(struct smk_video_t * s)
+{
+	/* null check */
+	assert(s);
+
+	if (s->v == '4') {
+		if (s->w == 320)
+			s->render = smk_render_video_v4_320;
+		else if (s->w == 640)
+			s->render = smk_render_video_v4_640;
+		else
+			s->render = smk_render_video_v4;
+	} else {
+		if (s->w == 320)
+			s->render = smk_render_video_v2_320;
+		else if (s->w == 640)
+			s->render = smk_render_video_v2_640;
+		else
+			s->render = smk_render_video_v2;
+	}
 }
 
 /* Decompress audio track i. */
@@ -1473,22 +3653,30 @@ static char smk_render_audio(struct smk_audio_t * s, unsigned char * p, unsigned
 	unsigned char * t = s->buffer;
 	struct smk_bit_t bs;
 	char bit;
-	short unpack, unpack2;
+	int unpack;
 	/* used for audio decoding */
 	struct smk_huff8_t aud_tree[4];
+	/* joint low/high byte tables for 16-bit channels */
+	unsigned int joint[2][1 << SMK_HUFF8_JOINT_BITS];
 	/* null check */
 	assert(s);
 	assert(p);
 
 	if (!s->compress) {
 		/* Raw PCM data, update buffer size and perform copy */
+		if (size > (unsigned long)s->max_buffer) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_render_audio() - ERROR: %lu bytes of audio for a %lu byte buffer.", size, (unsigned long)s->max_buffer);
+			s->buffer_size = 0;
+			goto error;
+		}
+
 		s->buffer_size = size;
 		memcpy(t, p, size);
 	} else if (s->compress == 1) {
 		/* SMACKER DPCM compression */
 		/* need at least 4 bytes to process */
 		if (size < 4) {
-			fputs("libsmacker::smk_render_audio() - ERROR: need 4 bytes to get unpacked output buffer size.\n", stderr);
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_render_audio() - ERROR: need 4 bytes to get unpacked output buffer size.");
 			goto error;
 		}
 
@@ -1497,6 +3685,17 @@ static char smk_render_audio(struct smk_audio_t * s, unsigned char * p, unsigned
 			((unsigned int) p[2] << 16) |
 			((unsigned int) p[1] << 8) |
 			((unsigned int) p[0]);
+
+		/* whole samples are written, the first before any check:
+			all of them must fit the buffer */
+		k = (s->bitdepth / 8) * s->channels;
+
+		if ((unsigned long)s->max_buffer < k || s->buffer_size > (unsigned long)s->max_buffer / k * k) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_render_audio() - ERROR: %lu bytes unpacked for a %lu byte buffer.", s->buffer_size, (unsigned long)s->max_buffer);
+			s->buffer_size = 0;
+			goto error;
+		}
+
 		p += 4;
 		size -= 4;
 		/* Compressed audio: must unpack here */
@@ -1505,37 +3704,45 @@ static char smk_render_audio(struct smk_audio_t * s, unsigned char * p, unsigned
 		bit = smk_bs_read_1(&bs);
 
 		if (!bit) {
-			fputs("libsmacker::smk_render_audio - ERROR: initial get_bit returned 0\n", stderr);
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_render_audio - ERROR: initial get_bit returned 0");
 			goto error;
 		}
 
 		bit = smk_bs_read_1(&bs);
 
 		if (s->channels != (bit == 1 ? 2 : 1))
-			fputs("libsmacker::smk_render - ERROR: mono/stereo mismatch\n", stderr);
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_render - ERROR: mono/stereo mismatch");
 
 		bit = smk_bs_read_1(&bs);
 
 		if (s->bitdepth != (bit == 1 ? 16 : 8))
-			fputs("libsmacker::smk_render - ERROR: 8-/16-bit mismatch\n", stderr);
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_render - ERROR: 8-/16-bit mismatch");
 
 		/* build the trees */
-		smk_huff8_build(&aud_tree[0], &bs);
+		if (! smk_huff8_build(&aud_tree[0], &bs))
+			goto error_tree;
+
 		j = 1;
 		k = 1;
 
 		if (s->bitdepth == 16) {
-			smk_huff8_build(&aud_tree[1], &bs);
+			if (! smk_huff8_build(&aud_tree[1], &bs))
+				goto error_tree;
+
 			k = 2;
 		}
 
 		if (s->channels == 2) {
-			smk_huff8_build(&aud_tree[2], &bs);
+			if (! smk_huff8_build(&aud_tree[2], &bs))
+				goto error_tree;
+
 			j = 2;
 			k = 2;
 
 			if (s->bitdepth == 16) {
-				smk_huff8_build(&aud_tree[3], &bs);
+				if (! smk_huff8_build(&aud_tree[3], &bs))
+					goto error_tree;
+
 				k = 4;
 			}
 		}
@@ -1560,155 +3767,382 @@ static char smk_render_audio(struct smk_audio_t * s, unsigned char * p, unsigned
 			((unsigned char *)t)[0] = (unsigned char)unpack;
 
 		/* All set: let's read some DATA! */
-		while (k < s->buffer_size) {
-			if (s->bitdepth == 8) {
-				unpack = smk_huff8_lookup(&aud_tree[0], &bs);
-				((unsigned char *)t)[j] = (char)unpack + ((unsigned char *)t)[j - s->channels];
+		if (s->bitdepth == 8) {
+			while (k < s->buffer_size) {
+				if ((unpack = smk_huff8_lookup(&aud_tree[0], &bs)) < 0)
+					goto error_data;
+
+				t[j] = (char)unpack + t[j - s->channels];
 				j ++;
-				k++;
-			} else {
-				unpack = smk_huff8_lookup(&aud_tree[0], &bs);
-				unpack2 = smk_huff8_lookup(&aud_tree[1], &bs);
-				((short *)t)[j] = (short)(unpack | (unpack2 << 8)) + ((short *)t)[j - s->channels];
+				k ++;
+
+				if (s->channels == 2) {
+					if ((unpack = smk_huff8_lookup(&aud_tree[2], &bs)) < 0)
+						goto error_data;
+
+					t[j] = (char)unpack + t[j - 2];
+					j ++;
+					k ++;
+				}
+			}
+		} else {
+			/* 16-bit samples: both bytes come from one table lookup */
+			smk_huff8_joint_build(joint[0], &aud_tree[0], &aud_tree[1]);
+
+			if (s->channels == 2)
+				smk_huff8_joint_build(joint[1], &aud_tree[2], &aud_tree[3]);
+
+			while (k < s->buffer_size) {
+				if ((unpack = smk_huff8_lookup16(joint[0], &aud_tree[0], &aud_tree[1], &bs)) < 0)
+					goto error_data;
+
+				((short *)t)[j] = (short)unpack + ((short *)t)[j - s->channels];
 				j ++;
 				k += 2;
-			}
 
-			if (s->channels == 2) {
-				if (s->bitdepth == 8) {
-					unpack = smk_huff8_lookup(&aud_tree[2], &bs);
-					((unsigned char *)t)[j] = (char)unpack + ((unsigned char *)t)[j - 2];
-					j ++;
-					k++;
-				} else {
-					unpack = smk_huff8_lookup(&aud_tree[2], &bs);
-					unpack2 = smk_huff8_lookup(&aud_tree[3], &bs);
-					((short *)t)[j] = (short)(unpack | (unpack2 << 8)) + ((short *)t)[j - 2];
+				if (s->channels == 2) {
+					if ((unpack = smk_huff8_lookup16(joint[1], &aud_tree[2], &aud_tree[3], &bs)) < 0)
+						goto error_data;
+
+					((short *)t)[j] = (short)unpack + ((short *)t)[j - 2];
 					j ++;
 					k += 2;
 				}
 			}
 		}
+
+		/* overruns are only caught on refill: check the last few samples too */
+		if (bs.left < 0)
+			goto error_data;
 	}
 
 	return 0;
+error_tree:
+	smk_error(SMK_ERR_DATA, "libsmacker::smk_render_audio() - ERROR: failed to build audio tree");
+	s->buffer_size = 0;
+	return -1;
+error_data:
+	/* only keep what was decoded before the stream ran out */
+	smk_error(SMK_ERR_DATA, "libsmacker::smk_render_audio() - ERROR: bitstream exhausted");
+	s->buffer_size = k;
+	return -1;
 error:
 	return -1;
 }
 
-/* "Renders" (unpacks) the frame at cur_frame
-	Preps all the image and audio pointers */
-static char smk_render(smk s)
+/* Disk mode: reads bytes [from, to) of the chunk at cur_frame into
+	the same place in the chunk buffer, seeking only if needed */
+static char smk_render_fetch(smk s, const unsigned long from, const unsigned long to)
 {
-	unsigned long i, size;
-	unsigned char * buffer = NULL, * p, track;
-	/* null check */
-	assert(s);
+	const uint64_t offset = s->index[s->cur_frame].offset + from;
 
-	/* Retrieve current chunk_size for this frame. */
-	if (!(i = s->chunk_size[s->cur_frame])) {
-		fprintf(stderr, "libsmacker::smk_render(s) - Warning: frame %lu: chunk_size is 0.\n", s->cur_frame);
-		goto error;
+	/* Skip to the bytes in file (sequential reads are already there) */
+	if (s->source.file.pos != offset) {
+		if (s->source.file.io.seek(s->source.file.io.handle, (unsigned long)offset)) {
+			smk_error(SMK_ERR_IO, "libsmacker::smk_render_fetch(s,%lu,%lu) - ERROR: seek to frame %lu (offset %lu) failed: %s", from, to, s->cur_frame, (unsigned long)offset, strerror(errno));
+			s->source.file.pos = (uint64_t)-1;
+			return -1;
+		}
 	}
 
-	if (s->mode == SMK_MODE_DISK) {
-		/* Skip to frame in file */
-		if (fseek(s->source.file.fp, s->source.file.chunk_offset[s->cur_frame], SEEK_SET)) {
-			fprintf(stderr, "libsmacker::smk_render(s) - ERROR: fseek to frame %lu (offset %lu) failed.\n", s->cur_frame, s->source.file.chunk_offset[s->cur_frame]);
-			perror("\tError reported was");
-			goto error;
-		}
+	if (smk_read_io(s->source.file.buffer + from, to - from, &s->source.file.io) < 0) {
+		s->source.file.pos = (uint64_t)-1;
+		return -1;
+	}
 
-		/* In disk-streaming mode: make way for our incoming chunk buffer */
-		if ((buffer = malloc(i)) == NULL) {
-			perror("libsmacker::smk_render() - ERROR: failed to malloc() buffer");
-			return -1;
-		}
+	s->source.file.pos = offset + (to - from);
+	return 0;
+}
 
-		/* Read into buffer */
-		if (smk_read_file(buffer, s->chunk_size[s->cur_frame], s->source.file.fp) < 0) {
-			fprintf(stderr, "libsmacker::smk_render(s) - ERROR: frame %lu (offset %lu): smk_read had errors.\n", s->cur_frame, s->source.file.chunk_offset[s->cur_frame]);
-			goto error;
-		}
-	} else {
-		/* Just point buffer at the right place */
-		if (!s->source.chunk_data[s->cur_frame]) {
-			fprintf(stderr, "libsmacker::smk_render(s) - ERROR: frame %lu: memory chunk is a NULL pointer.\n", s->cur_frame);
-			goto error;
-		}
+/* Disk mode: reads the i-byte chunk at cur_frame for smk_render.
+	Records that won't be decoded are skipped, not read: the palette
+	and video with video disabled, and the audio of disabled tracks.
+	Their length prefixes are still read, so smk_render can walk the
+	chunk (and find any bad lengths) exactly as if it were complete. */
+static char smk_render_read(smk s, const unsigned long i)
+{
+	const unsigned char type = s->index[s->cur_frame].type;
+	const unsigned char * const buffer = s->source.file.buffer;
+	unsigned long p = 0, size;
+	unsigned char track;
 
-		buffer = s->source.chunk_data[s->cur_frame];
+	/* everything wanted: one read */
+	for (track = 0; track < 7; track ++) {
+		if ((type & (0x02 << track)) && !s->audio[track].enable)
+			break;
 	}
 
-	p = buffer;
+	if (s->video.enable && track == 7)
+		return smk_render_fetch(s, 0, i);
 
-	/* Palette record first */
-	if (s->frame_type[s->cur_frame] & 0x01) {
-		/* need at least 1 byte to process */
-		if (!i) {
-			fprintf(stderr, "libsmacker::smk_render(s) - ERROR: frame %lu: insufficient data for a palette rec.\n", s->cur_frame);
-			goto error;
-		}
+	/* Palette record */
+	if (type & 0x01) {
+		if (smk_render_fetch(s, 0, 1) < 0)
+			return -1;
 
-		/* Byte 1 in block, times 4, tells how many
-			subsequent bytes are present */
-		size = 4 * (*p);
+		size = 4 * buffer[0];
 
-		/* If video rendering enabled, kick this off for decode. */
-		if (s->video.enable)
-			smk_render_palette(&(s->video), p + 1, size - 1);
+		/* bad length: leave it to smk_render */
+		if (!size || size > i)
+			return 0;
 
-		p += size;
-		i -= size;
+		if (s->video.enable && smk_render_fetch(s, 1, size) < 0)
+			return -1;
+
+		p = size;
 	}
 
-	/* Unpack audio chunks */
+	/* Audio records */
 	for (track = 0; track < 7; track ++) {
-		if (s->frame_type[s->cur_frame] & (0x02 << track)) {
-			/* need at least 4 byte to process */
-			if (i < 4) {
-				fprintf(stderr, "libsmacker::smk_render(s) - ERROR: frame %lu: insufficient data for audio[%u] rec.\n", s->cur_frame, track);
-				goto error;
-			}
+		if (type & (0x02 << track)) {
+			if (i - p < 4)
+				return 0;
 
-			/* First 4 bytes in block tell how many
-				subsequent bytes are present */
-			size = (((unsigned int) p[3] << 24) |
+			if (smk_render_fetch(s, p, p + 4) < 0)
+				return -1;
+
+			size = (((unsigned long) buffer[p + 3] << 24) |
+					((unsigned long) buffer[p + 2] << 16) |
+					((unsigned long) buffer[p + 1] << 8) |
+					((unsigned long) buffer[p]));
+
+			if (size < 4 || size > i - p)
+				return 0;
+
+			if (s->audio[track].enable && smk_render_fetch(s, p + 4, p + size) < 0)
+				return -1;
+
+			p += size;
+		}
+	}
+
+	/* Video record: the rest */
+	if (s->video.enable)
+		return smk_render_fetch(s, p, i);
+
+	return 0;
+}
+
+/* The records of one chunk: audio tracks 0-6, then video (7).
+	NULL where a record is absent or its decoding is disabled. */
+struct smk_render_job_t {
+	smk s;
+	unsigned char * p[8];
+	unsigned long size[8];
+
+	/* records handed out as pool tasks */
+	unsigned char task[8];
+	unsigned int tasks;
+
+	/* per record: result, and the error code it raised (on its own thread) */
+	char result[8];
+	int error[8];
+};
+
+/* Decodes record r of job, catching the code it raises in job->error[r]:
+	the thread's own code is put back, as a success must not clear it */
+static void smk_render_record(struct smk_render_job_t * const job, struct smk_pool_t * const pool, const unsigned char r)
+{
+	const int code = smk_error_code;
+
+	smk_error_code = SMK_ERR_NONE;
+
+	if (r == 7)
+		job->result[7] = job->s->video.render(&job->s->video, pool, job->p[7], job->size[7]);
+	else
+		job->result[r] = smk_render_audio(&job->s->audio[r], job->p[r], job->size[r]);
+
+	job->error[r] = smk_error_code;
+	smk_error_code = code;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Pool task: decodes one record.  Video takes the single-pass decoder,
+	as the pool is busy running the records. */
+static void smk_render_task(void * arg, const unsigned int i)
+{
+	struct smk_render_job_t * const job = arg;
+
+	smk_render_record(job, NULL, job->task[i]);
+}
+#endif
+
+/* "Renders" (unpacks) the frame at cur_frame
+	Preps all the image and audio pointers */
+static char smk_render(smk s)
+{
+	unsigned long i, size;
+	unsigned char * buffer = NULL, * p, track;
+	struct smk_render_job_t job;
+	char failed = 0;
+	/* null check */
+	assert(s);
+	/* Nothing has changed yet */
+	s->video.frame_changed = 0;
+	s->video.palette_changed = 0;
+	memset(s->video.dirty, 0, smk_dirty_size(&s->video));
+
+	/* a file may have no frames at all */
+	if (s->cur_frame >= s->f + s->ring_frame) {
+		smk_error(SMK_ERR_DATA, "libsmacker::smk_render(s) - ERROR: frame %lu: file has only %lu frames.", s->cur_frame, s->f);
+		goto error;
+	}
+
+	/* Retrieve current chunk_size for this frame. */
+	if (!(i = s->index[s->cur_frame].size)) {
+		smk_warn(SMK_ERR_DATA, "libsmacker::smk_render(s) - Warning: frame %lu: chunk_size is 0.", s->cur_frame);
+		goto error;
+	}
+
+	if (s->mode == SMK_MODE_DISK && s->source.file.ahead) {
+#ifdef HAVE_PTHREAD_H
+
+		/* Take the chunk from the read-ahead ring */
+		if ((buffer = smk_ahead_get(s->source.file.ahead, s->cur_frame)) == NULL) {
+			smk_error(smk_error_code, "libsmacker::smk_render(s) - ERROR: frame %lu (offset %lu): read-ahead had errors.", s->cur_frame, (unsigned long)s->index[s->cur_frame].offset);
+			goto error;
+		}
+
+#endif
+	} else if (s->mode == SMK_MODE_DISK) {
+		/* In disk-streaming mode: reuse the chunk buffer,
+			re-zeroing the tail the bitstream reader expects */
+		buffer = s->source.file.buffer;
+		memset(buffer + i, 0, SMK_BS_PAD);
+
+		/* Read into buffer (just the parts that will be decoded) */
+		if (smk_render_read(s, i) < 0) {
+			smk_error(smk_error_code, "libsmacker::smk_render(s) - ERROR: frame %lu (offset %lu): smk_read had errors.", s->cur_frame, (unsigned long)s->index[s->cur_frame].offset);
+			goto error;
+		}
+	} else if (s->mode == SMK_MODE_PUSH) {
+		/* In push mode: smk_push_feed() gathered the chunk already */
+		buffer = s->source.file.buffer;
+		memset(buffer + i, 0, SMK_BS_PAD);
+	} else if (s->mode == SMK_MODE_MEMORY) {
+		/* Just point buffer at the right place */
+		buffer = s->source.arena + s->index[s->cur_frame].offset;
+	} else {
+		/* Just point buffer at the right place */
+		if (!s->source.chunk_data[s->cur_frame]) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_render(s) - ERROR: frame %lu: memory chunk is a NULL pointer.", s->cur_frame);
+			goto error;
+		}
+
+		buffer = s->source.chunk_data[s->cur_frame];
+	}
+
+	p = buffer;
+
+	/* Palette record first */
+	if (s->index[s->cur_frame].type & 0x01) {
+		/* need at least 1 byte to process */
+		if (!i) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_render(s) - ERROR: frame %lu: insufficient data for a palette rec.", s->cur_frame);
+			goto error;
+		}
+
+		/* Byte 1 in block, times 4, tells how many
+			subsequent bytes are present */
+		size = 4 * (*p);
+
+		/* records must stay inside the chunk (and its padding) */
+		if (!size || size > i) {
+			smk_error(SMK_ERR_DATA, "libsmacker::smk_render(s) - ERROR: frame %lu: palette rec size %lu exceeds chunk.", s->cur_frame, size);
+			goto error;
+		}
+
+		/* If video rendering enabled, kick this off for decode. */
+		if (s->video.enable)
+			smk_render_palette(&(s->video), p + 1, size - 1);
+
+		p += size;
+		i -= size;
+	}
+
+	/* Unpack audio chunks */
+	for (track = 0; track < 7; track ++) {
+		if (s->index[s->cur_frame].type & (0x02 << track)) {
+			/* need at least 4 byte to process */
+			if (i < 4) {
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_render(s) - ERROR: frame %lu: insufficient data for audio[%u] rec.", s->cur_frame, track);
+				goto error;
+			}
+
+			/* First 4 bytes in block tell how many
+				subsequent bytes are present */
+			size = (((unsigned int) p[3] << 24) |
 					((unsigned int) p[2] << 16) |
 					((unsigned int) p[1] << 8) |
 					((unsigned int) p[0]));
 
-			/* If audio rendering enabled, kick this off for decode. */
-			if (s->audio[track].enable)
-				smk_render_audio(&s->audio[track], p + 4, size - 4);
+			if (size < 4 || size > i) {
+				smk_error(SMK_ERR_DATA, "libsmacker::smk_render(s) - ERROR: frame %lu: audio[%u] rec size %lu exceeds chunk.", s->cur_frame, track, size);
+				goto error;
+			}
 
+			/* If audio rendering enabled, mark this for decode. */
+			job.p[track] = (s->audio[track].enable ? p + 4 : NULL);
+			job.size[track] = size - 4;
 			p += size;
 			i -= size;
-		} else
+		} else {
+			job.p[track] = NULL;
 			s->audio[track].buffer_size = 0;
+		}
 	}
 
-	/* Unpack video chunk */
-	if (s->video.enable) {
-		if (smk_render_video(&(s->video), p, i) < 0) {
-			fprintf(stderr, "libsmacker::smk_render(s) - ERROR: frame %lu: failed to render video.\n", s->cur_frame);
-			goto error;
+	/* Video record: the rest */
+	job.p[7] = (s->video.enable ? p : NULL);
+	job.size[7] = i;
+	job.s = s;
+#ifdef HAVE_PTHREAD_H
+
+	/* Decode the records side by side on the workers, if there are two or more */
+	if (s->pool && s->concurrent) {
+		job.tasks = 0;
+
+		/* video first: it is usually the longest */
+		for (track = 8; track --; ) {
+			if (job.p[track])
+				job.task[job.tasks ++] = track;
+		}
+
+		if (job.tasks > 1) {
+			smk_pool_run(s->pool, smk_render_task, &job, job.tasks);
+			goto done;
 		}
 	}
 
-	if (s->mode == SMK_MODE_DISK) {
-		/* Remember that buffer we allocated?  Trash it */
-		smk_free(buffer);
+#endif
+
+	/* Unpack audio chunks, then video */
+	for (track = 0; track < 8; track ++) {
+		if (job.p[track])
+			smk_render_record(&job, s->pool, track);
 	}
 
-	return 0;
-error:
+#ifdef HAVE_PTHREAD_H
+done:
+#endif
 
-	if (s->mode == SMK_MODE_DISK) {
-		/* Remember that buffer we allocated?  Trash it */
-		smk_free(buffer);
+	/* Raise what went wrong on this thread, whichever thread it happened on */
+	for (track = 0; track < 8; track ++) {
+		if (job.p[track] && job.result[track] < 0) {
+			if (track == 7)
+				smk_error(job.error[7] ? job.error[7] : SMK_ERR_DATA, "libsmacker::smk_render(s) - ERROR: frame %lu: failed to render video.", s->cur_frame);
+			else
+				smk_error(job.error[track] ? job.error[track] : SMK_ERR_DATA, "libsmacker::smk_render(s) - ERROR: frame %lu: failed to render audio[%u].", s->cur_frame, track);
+
+			failed = 1;
+		}
 	}
 
+	if (failed)
+		goto error;
+
+	return 0;
+error:
 	return -1;
 }
 
@@ -1717,14 +4151,24 @@ char smk_first(smk s)
 {
 	/* null check */
 	if (s == NULL) {
-		fputs("libsmacker::smk_first() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_first() - ERROR: smk is NULL");
+		return -1;
+	}
+
+	if (s->mode == SMK_MODE_PUSH) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_first() - ERROR: frames of pushed input arrive through smk_push_feed()");
+		return -1;
+	}
+
+	if (s->pipe) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_first() - ERROR: frames come from smk_pipeline_acquire() while the pipeline runs");
 		return -1;
 	}
 
 	s->cur_frame = 0;
 
 	if (smk_render(s) < 0) {
-		fprintf(stderr, "libsmacker::smk_first(s) - Warning: frame %lu: smk_render returned errors.\n", s->cur_frame);
+		smk_warn(SMK_ERR_DATA, "libsmacker::smk_first(s) - Warning: frame %lu: smk_render returned errors.", s->cur_frame);
 		return -1;
 	}
 
@@ -1738,7 +4182,17 @@ char smk_next(smk s)
 {
 	/* null check */
 	if (s == NULL) {
-		fputs("libsmacker::smk_next() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_next() - ERROR: smk is NULL");
+		return -1;
+	}
+
+	if (s->mode == SMK_MODE_PUSH) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_next() - ERROR: frames of pushed input arrive through smk_push_feed()");
+		return -1;
+	}
+
+	if (s->pipe) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_next() - ERROR: frames come from smk_pipeline_acquire() while the pipeline runs");
 		return -1;
 	}
 
@@ -1746,7 +4200,7 @@ char smk_next(smk s)
 		s->cur_frame ++;
 
 		if (smk_render(s) < 0) {
-			fprintf(stderr, "libsmacker::smk_next(s) - Warning: frame %lu: smk_render returned errors.\n", s->cur_frame);
+			smk_warn(SMK_ERR_DATA, "libsmacker::smk_next(s) - Warning: frame %lu: smk_render returned errors.", s->cur_frame);
 			return -1;
 		}
 
@@ -1758,7 +4212,7 @@ char smk_next(smk s)
 		s->cur_frame = 1;
 
 		if (smk_render(s) < 0) {
-			fprintf(stderr, "libsmacker::smk_next(s) - Warning: frame %lu: smk_render returned errors.\n", s->cur_frame);
+			smk_warn(SMK_ERR_DATA, "libsmacker::smk_next(s) - Warning: frame %lu: smk_render returned errors.", s->cur_frame);
 			return -1;
 		}
 
@@ -1776,7 +4230,22 @@ char smk_seek_keyframe(smk s, unsigned long f)
 {
 	/* null check */
 	if (s == NULL) {
-		fputs("libsmacker::smk_seek_keyframe() - ERROR: smk is NULL\n", stderr);
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_seek_keyframe() - ERROR: smk is NULL");
+		return -1;
+	}
+
+	if (s->mode == SMK_MODE_PUSH) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_seek_keyframe() - ERROR: frames of pushed input arrive through smk_push_feed()");
+		return -1;
+	}
+
+	if (s->pipe) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_seek_keyframe() - ERROR: frames come from smk_pipeline_acquire() while the pipeline runs");
+		return -1;
+	}
+
+	if (f >= s->f) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_seek_keyframe(s,%lu) - ERROR: file has only %lu frames", f, s->f);
 		return -1;
 	}
 
@@ -1784,14 +4253,837 @@ char smk_seek_keyframe(smk s, unsigned long f)
 	s->cur_frame = f;
 
 	/* roll back to previous keyframe in stream, or 0 if no keyframes exist */
-	while (s->cur_frame > 0 && !(s->keyframe[s->cur_frame]))
+	while (s->cur_frame > 0 && !(s->index[s->cur_frame].keyframe))
 		s->cur_frame --;
 
 	/* render the frame: we're ready */
 	if (smk_render(s) < 0) {
-		fprintf(stderr, "libsmacker::smk_seek_keyframe(s,%lu) - Warning: frame %lu: smk_render returned errors.\n", f, s->cur_frame);
+		smk_warn(SMK_ERR_DATA, "libsmacker::smk_seek_keyframe(s,%lu) - Warning: frame %lu: smk_render returned errors.", f, s->cur_frame);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* ************************************************************************* */
+/* PUSH Structure */
+/* ************************************************************************* */
+/* Bytes of the header before its variable-length part: signature,
+	dimensions, frame count, rate, flags, audio buffer sizes,
+	tree sizes, audio rates and a dummy field */
+#define SMK_PUSH_FIXED	104
+
+/* Incremental decoder, fed bytes in file order */
+struct smk_push_t {
+	/* event sink */
+	smk_event_callback callback;
+	void * userdata;
+
+	/* the smk, once its header is in (NULL before) */
+	smk s;
+
+	/* header bytes gathered so far, and how many it takes */
+	unsigned char * header;
+	unsigned long have, need;
+
+	/* chunk being gathered: its frame, and bytes in so far */
+	unsigned long frame, fill;
+
+	/* set once the header failed to parse */
+	unsigned char failed;
+};
+
+/* ************************************************************************* */
+/* PUSH Functions */
+/* ************************************************************************* */
+/* read a ul from header offset */
+static unsigned long smk_push_ul(const unsigned char * p)
+{
+	return ((unsigned long) p[3] << 24) |
+		((unsigned long) p[2] << 16) |
+		((unsigned long) p[1] << 8) |
+		((unsigned long) p[0]);
+}
+
+/* Start an incremental decoder */
+smk_push smk_push_create(smk_event_callback callback, void * userdata)
+{
+	smk_push push = NULL;
+
+	if (callback == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_push_create() - ERROR: callback is NULL");
+		return NULL;
+	}
+
+	smk_malloc(push, sizeof(struct smk_push_t));
+	push->callback = callback;
+	push->userdata = userdata;
+	/* first, just the fixed part of the header */
+	push->need = SMK_PUSH_FIXED;
+	smk_malloc(push->header, push->need);
+	return push;
+}
+
+/* Gather header bytes, opening the smk once they are all in.
+	Returns the bytes consumed, or -1 on a bad header. */
+static long smk_push_header(smk_push push, const unsigned char * data, unsigned long size)
+{
+	unsigned char * header = NULL;
+	union smk_read_t fp;
+	unsigned long frames, tree_size;
+
+	if (size > push->need - push->have)
+		size = push->need - push->have;
+
+	memcpy(push->header + push->have, data, size);
+	push->have += size;
+
+	if (push->have < push->need)
+		return size;
+
+	if (push->need == SMK_PUSH_FIXED) {
+		/* fixed part in: find the length of the rest
+			(chunk sizes, frame types, trees) */
+		frames = smk_push_ul(push->header + 12) + (smk_push_ul(push->header + 20) & 0x01);
+		tree_size = smk_push_ul(push->header + 52);
+
+		if (tree_size > 0xFFFFFFFFUL - SMK_PUSH_FIXED ||
+			frames > (0xFFFFFFFFUL - SMK_PUSH_FIXED - tree_size) / 5) {
+			smk_error(SMK_ERR_FORMAT, "libsmacker::smk_push_feed(push,data,%lu) - ERROR: header size out of range (%lu frames, %lu bytes of trees)", size, frames, tree_size);
+			return -1;
+		}
+
+		/* Not smk_malloc: the size comes from the input, so a failure
+			here fails the feed, not the program */
+		if ((header = malloc(SMK_PUSH_FIXED + 5 * frames + tree_size)) == NULL) {
+			smk_error(SMK_ERR_MEMORY, "libsmacker::smk_push_feed(push,data,%lu) - ERROR: failed to malloc() a %lu byte header: %s", size, SMK_PUSH_FIXED + 5 * frames + tree_size, strerror(errno));
+			return -1;
+		}
+
+		push->need = SMK_PUSH_FIXED + 5 * frames + tree_size;
+		memcpy(header, push->header, SMK_PUSH_FIXED);
+		smk_free(push->header);
+		push->header = header;
+
+		/* no frames and no trees: the header is already complete */
+		if (push->have < push->need)
+			return size;
+	}
+
+	/* whole header in: parse it */
+	fp.ram = push->header;
+
+	if (!(push->s = smk_open_generic(0, fp, push->need, SMK_MODE_PUSH))) {
+		smk_error(smk_error_code, "libsmacker::smk_push_feed(push,data,%lu) - ERROR: Fatal error in smk_open_generic.", size);
+		return -1;
+	}
+
+	smk_free(push->header);
+	push->callback(push->userdata, push->s, SMK_EVENT_HEADER);
+	return size;
+}
+
+/* Decode every complete chunk, in order.
+	Returns -1 if any failed to decode (the rest still are). */
+static char smk_push_frames(smk_push push)
+{
+	smk s = push->s;
+	char r = 0;
+
+	while (push->frame < s->f + s->ring_frame && push->fill == s->index[push->frame].size) {
+		s->cur_frame = push->frame ++;
+		push->fill = 0;
+
+		if (smk_render(s) < 0) {
+			smk_warn(SMK_ERR_DATA, "libsmacker::smk_push_feed(push) - Warning: frame %lu: smk_render returned errors.", s->cur_frame);
+			r = -1;
+			continue;
+		}
+
+		push->callback(push->userdata, s, SMK_EVENT_FRAME);
+	}
+
+	return r;
+}
+
+/* Feed the next bytes of the file */
+char smk_push_feed(smk_push push, const unsigned char * data, unsigned long size)
+{
+	unsigned long n;
+	long consumed;
+	char r = 0;
+
+	/* null check */
+	if (push == NULL || (data == NULL && size)) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_push_feed() - ERROR: push or data is NULL");
+		return -1;
+	}
+
+	if (push->failed) {
+		smk_error(SMK_ERR_FORMAT, "libsmacker::smk_push_feed(push,data,%lu) - ERROR: header was invalid, nothing more can be decoded", size);
+		return -1;
+	}
+
+	/* header first */
+	while (push->s == NULL) {
+		if (size == 0)
+			return 0;
+
+		if ((consumed = smk_push_header(push, data, size)) < 0) {
+			push->failed = 1;
+			return -1;
+		}
+
+		data += consumed;
+		size -= consumed;
+	}
+
+	/* then chunks, straight into the chunk buffer */
+	for (;;) {
+		if (smk_push_frames(push) < 0)
+			r = -1;
+
+		/* anything past the last chunk is ignored */
+		if (size == 0 || push->frame >= push->s->f + push->s->ring_frame)
+			break;
+
+		n = push->s->index[push->frame].size - push->fill;
+
+		if (n > size)
+			n = size;
+
+		memcpy(push->s->source.file.buffer + push->fill, data, n);
+		push->fill += n;
+		data += n;
+		size -= n;
+	}
+
+	return r;
+}
+
+/* Stop an incremental decoder, closing its smk */
+void smk_push_close(smk_push push)
+{
+	if (push == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_push_close() - ERROR: push is NULL");
+		return;
+	}
+
+	if (push->s)
+		smk_close(push->s);
+
+	if (push->header)
+		smk_free(push->header);
+
+	smk_free(push);
+}
+
+/* ************************************************************************* */
+/* PIPELINE Structure */
+/* ************************************************************************* */
+/* Background decoder: a thread decoding frames in smk_next() order,
+	copying each into a ring of slots the caller takes and gives back.
+	A single producer and a single consumer: each side only writes its
+	own counter, so handing over a slot takes no lock.  The lock and
+	condition are just for sleeping on a full or empty ring, and are
+	only touched when a side sleeps (or must be woken). */
+#ifdef HAVE_PTHREAD_H
+struct smk_pipe_t {
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* slots blocks of stride bytes (frame, palette, then audio),
+		each described by a frame record and its smk_next() result */
+	unsigned char * data;
+	unsigned long stride;
+	struct smk_frame_t * frame;
+	char * status;
+	unsigned int slots;
+
+	/* frames made by the worker; taken, and given back, by the caller */
+	unsigned long produced, acquired, released;
+
+	/* set by the worker at the end of a non-looping file,
+		and by the caller to stop the worker */
+	unsigned long finished, quit;
+
+	/* threads asleep on cond */
+	unsigned long sleeping;
+
+	/* smk_decode_range() workers: segments seg, seg + step, ... of those
+		between bound[] (keyframes), putting only frames from first on */
+	const unsigned long * bound;
+	unsigned long seg, segments, first;
+	unsigned int step;
+};
+
+/* ************************************************************************* */
+/* PIPELINE Functions */
+/* ************************************************************************* */
+/* Reads a counter or flag the other thread writes, with the lock held.
+	Sequentially consistent, like the stores and the sleeping count:
+	a store either sees a sleeper, or is seen by it before it sleeps.
+	(Without atomics, everything goes through the lock.) */
+static unsigned long smk_pipe_peek(const unsigned long * const p)
+{
+#ifdef __GNUC__
+	return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#else
+	return *p;
+#endif
+}
+
+/* The same, without the lock */
+static unsigned long smk_pipe_load(struct smk_pipe_t * const pipe, const unsigned long * const p)
+{
+#ifdef __GNUC__
+	(void)pipe;
+	return smk_pipe_peek(p);
+#else
+	unsigned long v;
+	pthread_mutex_lock(&pipe->lock);
+	v = smk_pipe_peek(p);
+	pthread_mutex_unlock(&pipe->lock);
+	return v;
+#endif
+}
+
+/* Sets a counter or flag the other thread reads, waking it if asleep */
+static void smk_pipe_store(struct smk_pipe_t * const pipe, unsigned long * const p, const unsigned long v)
+{
+#ifdef __GNUC__
+	__atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&pipe->sleeping, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	pthread_mutex_lock(&pipe->lock);
+#else
+	pthread_mutex_lock(&pipe->lock);
+	*p = v;
+#endif
+	pthread_cond_signal(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Marks the calling thread asleep (or awake again), with the lock held */
+static void smk_pipe_sleeping(struct smk_pipe_t * const pipe, const int delta)
+{
+#ifdef __GNUC__
+	__atomic_add_fetch(&pipe->sleeping, delta, __ATOMIC_SEQ_CST);
+#else
+	(void)pipe;
+	(void)delta;
+#endif
+}
+
+/* Worker side: waits until slot n is free.  0 once told to quit. */
+static char smk_pipe_wait_slot(struct smk_pipe_t * const pipe, const unsigned long n)
+{
+	if (n - smk_pipe_load(pipe, &pipe->released) == pipe->slots) {
+		pthread_mutex_lock(&pipe->lock);
+		smk_pipe_sleeping(pipe, 1);
+
+		while (n - smk_pipe_peek(&pipe->released) == pipe->slots && !smk_pipe_peek(&pipe->quit))
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+		smk_pipe_sleeping(pipe, -1);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+
+	return !smk_pipe_load(pipe, &pipe->quit);
+}
+
+/* Worker side: copies the frame s holds into slot n, with its status r, and hands it over */
+static void smk_pipe_put(struct smk_pipe_t * const pipe, const smk s, const unsigned long n, const char r)
+{
+	struct smk_frame_t * const frame = &pipe->frame[n % pipe->slots];
+	unsigned char track;
+	/* the ring frame leads back into frame 0: numbered as smk_info_all() does */
+	frame->frame = (s->cur_frame < s->f ? s->cur_frame : 0);
+	memcpy((unsigned char *)frame->video, s->video.frame, s->video.w * s->video.h);
+	memcpy((unsigned char *)frame->palette, s->video.palette, 256 * 3);
+
+	for (track = 0; track < 7; track ++) {
+		frame->audio_size[track] = (s->audio[track].enable ? s->audio[track].buffer_size : 0);
+
+		if (frame->audio_size[track])
+			memcpy((unsigned char *)frame->audio[track], s->audio[track].buffer, frame->audio_size[track]);
+	}
+
+	frame->frame_changed = s->video.frame_changed;
+	frame->palette_changed = s->video.palette_changed;
+	pipe->status[n % pipe->slots] = r;
+	smk_pipe_store(pipe, &pipe->produced, n + 1);
+}
+
+/* Caller side: waits until frame n is in.  0 if the worker finished first. */
+static char smk_pipe_wait_frame(struct smk_pipe_t * const pipe, const unsigned long n)
+{
+	if (n == smk_pipe_load(pipe, &pipe->produced)) {
+		pthread_mutex_lock(&pipe->lock);
+		smk_pipe_sleeping(pipe, 1);
+
+		while (n == smk_pipe_peek(&pipe->produced) && !smk_pipe_peek(&pipe->finished))
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+		smk_pipe_sleeping(pipe, -1);
+		pthread_mutex_unlock(&pipe->lock);
+
+		if (n == smk_pipe_load(pipe, &pipe->produced))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Worker thread body */
+static void * smk_pipe_main(void * arg)
+{
+	smk s = arg;
+	struct smk_pipe_t * const pipe = s->pipe;
+	const unsigned long frames = s->f + s->ring_frame;
+	unsigned long n;
+	char r;
+
+	for (n = 0; ; n ++) {
+		/* on to the next frame, as smk_next() (looping if the file does) */
+		if (n) {
+			if (s->cur_frame + 1 < frames)
+				s->cur_frame ++;
+			else if (s->ring_frame)
+				s->cur_frame = 1;
+			else {
+				smk_pipe_store(pipe, &pipe->finished, 1);
+				break;
+			}
+		}
+
+		/* wait for a free slot */
+		if (!smk_pipe_wait_slot(pipe, n))
+			break;
+
+		/* decode */
+		if (smk_render(s) < 0) {
+			smk_warn(SMK_ERR_DATA, "libsmacker::smk_pipe_main(s) - Warning: frame %lu: smk_render returned errors.", s->cur_frame);
+			r = -1;
+		} else if (s->cur_frame + 1 == frames)
+			r = SMK_LAST;
+		else
+			r = SMK_MORE;
+
+		/* copy it out */
+		smk_pipe_put(pipe, s, n, r);
+	}
+
+	return NULL;
+}
+
+/* Allocates a ring of slots sized for the frames of s (the worker is started by the caller) */
+static struct smk_pipe_t * smk_pipe_create(const smk s, const unsigned int slots)
+{
+	struct smk_pipe_t * pipe = NULL;
+	unsigned long size;
+	unsigned int i;
+	unsigned char track;
+
+	/* one block per slot: frame, palette, and every track's largest buffer */
+	size = s->video.w * s->video.h + 256 * 3;
+
+	for (track = 0; track < 7; track ++) {
+		if (s->audio[track].exists)
+			size += s->audio[track].max_buffer;
+	}
+
+	smk_malloc(pipe, sizeof(struct smk_pipe_t));
+	pipe->slots = slots;
+	pipe->stride = size;
+	smk_malloc(pipe->data, slots * size);
+	smk_malloc(pipe->frame, slots * sizeof(struct smk_frame_t));
+	smk_malloc(pipe->status, slots);
+
+	for (i = 0; i < slots; i ++) {
+		pipe->frame[i].video = pipe->data + i * size;
+		pipe->frame[i].palette = pipe->frame[i].video + s->video.w * s->video.h;
+		size = 256 * 3;
+
+		for (track = 0; track < 7; track ++) {
+			pipe->frame[i].audio[track] = pipe->frame[i].video + s->video.w * s->video.h + size;
+
+			if (s->audio[track].exists)
+				size += s->audio[track].max_buffer;
+		}
+
+		size = pipe->stride;
+	}
+
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+	return pipe;
+}
+
+/* Frees a ring whose worker is stopped (or never ran) */
+static void smk_pipe_free(struct smk_pipe_t * pipe)
+{
+	/* null check */
+	assert(pipe);
+	pthread_cond_destroy(&pipe->cond);
+	pthread_mutex_destroy(&pipe->lock);
+	smk_free(pipe->status);
+	smk_free(pipe->frame);
+	smk_free(pipe->data);
+	smk_free(pipe);
+}
+
+/* Stops the worker and frees the ring */
+static void smk_pipe_destroy(struct smk_pipe_t * pipe)
+{
+	/* null check */
+	assert(pipe);
+	smk_pipe_store(pipe, &pipe->quit, 1);
+	pthread_join(pipe->thread, NULL);
+	smk_pipe_free(pipe);
+}
+#endif
+
+/* Starts (or, with 0 slots, stops) decoding on a background thread */
+char smk_set_pipeline(smk object, const unsigned int slots)
+{
+#ifdef HAVE_PTHREAD_H
+	struct smk_pipe_t * pipe;
+#endif
+
+	/* null check */
+	if (object == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_set_pipeline() - ERROR: smk is NULL");
+		return -1;
+	}
+
+	if (object->mode == SMK_MODE_PUSH) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_set_pipeline() - ERROR: frames of pushed input arrive through smk_push_feed()");
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+
+	/* stop any previous worker: the smk is left at its last frame */
+	if (object->pipe) {
+		smk_pipe_destroy(object->pipe);
+		object->pipe = NULL;
+	}
+
+	if (slots == 0)
+		return 0;
+
+	pipe = smk_pipe_create(object, slots);
+	/* start from the top, as smk_first() */
+	object->cur_frame = 0;
+	object->pipe = pipe;
+
+	if (pthread_create(&pipe->thread, NULL, smk_pipe_main, object)) {
+		smk_error(SMK_ERR_MEMORY, "libsmacker::smk_set_pipeline(object,%u) - ERROR: failed to start decoder thread", slots);
+		object->pipe = NULL;
+		smk_pipe_free(pipe);
+		return -1;
+	}
+
+	return 0;
+#else
+
+	if (slots == 0)
+		return 0;
+
+	smk_error(SMK_ERR_UNSUPPORTED, "libsmacker::smk_set_pipeline(object,%u) - ERROR: libsmacker was built without thread support", slots);
+	return -1;
+#endif
+}
+
+/* Takes the next decoded frame, waiting for it if need be */
+char smk_pipeline_acquire(smk object, struct smk_frame_t * frame)
+{
+#ifdef HAVE_PTHREAD_H
+	struct smk_pipe_t * pipe;
+	unsigned long n;
+#endif
+
+	/* null check */
+	if (object == NULL || frame == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_pipeline_acquire() - ERROR: smk or frame is NULL");
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+
+	if ((pipe = object->pipe) == NULL) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_pipeline_acquire() - ERROR: pipeline is not running");
+		return -1;
+	}
+
+	/* every slot taken: one must be released first */
+	if ((n = pipe->acquired) - pipe->released == pipe->slots) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_pipeline_acquire() - ERROR: all %u slots are held", pipe->slots);
+		return -1;
+	}
+
+	/* wait for the worker, unless it is done */
+	if (!smk_pipe_wait_frame(pipe, n))
+		return SMK_DONE;
+
+	*frame = pipe->frame[n % pipe->slots];
+	pipe->acquired = n + 1;
+	return pipe->status[n % pipe->slots];
+#else
+	smk_error(SMK_ERR_UNSUPPORTED, "libsmacker::smk_pipeline_acquire() - ERROR: libsmacker was built without thread support");
+	return -1;
+#endif
+}
+
+/* Gives back the oldest frame taken, for the worker to reuse */
+char smk_pipeline_release(smk object)
+{
+#ifdef HAVE_PTHREAD_H
+	struct smk_pipe_t * pipe;
+#endif
+
+	/* null check */
+	if (object == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_pipeline_release() - ERROR: smk is NULL");
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+
+	if ((pipe = object->pipe) == NULL || pipe->released == pipe->acquired) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_pipeline_release() - ERROR: no frame is held");
+		return -1;
+	}
+
+	smk_pipe_store(pipe, &pipe->released, pipe->released + 1);
+	return 0;
+#else
+	smk_error(SMK_ERR_UNSUPPORTED, "libsmacker::smk_pipeline_release() - ERROR: libsmacker was built without thread support");
+	return -1;
+#endif
+}
+
+/* ************************************************************************* */
+/* RANGE Functions */
+/* ************************************************************************* */
+/* Batch decoding of a frame range, split at keyframes into segments that
+	separate decoders (one per thread, each a clone of the smk) work
+	through side by side.  Frames are handed to the callback in order, on
+	the calling thread. */
+
+/* Decodes frame cur_frame of segment start, starting over (as a newly opened smk)
+	at the top of the segment, so results never depend on the segments before */
+static char smk_state_render(smk s, const unsigned long start)
+{
+	if (s->cur_frame == start) {
+		memset(s->video.frame, 0, s->video.w * s->video.h);
+		memset(s->video.palette, 0, 256 * 3);
+	}
+
+	if (smk_render(s) < 0) {
+		smk_warn(SMK_ERR_DATA, "libsmacker::smk_decode_range() - Warning: frame %lu: smk_render returned errors.", s->cur_frame);
 		return -1;
 	}
 
 	return 0;
 }
+
+/* Points a frame record at the buffers of a decoder */
+static void smk_state_frame(const smk s, struct smk_frame_t * const frame)
+{
+	unsigned char track;
+	frame->frame = s->cur_frame;
+	frame->video = s->video.frame;
+	frame->palette = (const unsigned char *)s->video.palette;
+
+	for (track = 0; track < 7; track ++) {
+		frame->audio[track] = s->audio[track].buffer;
+		frame->audio_size[track] = (s->audio[track].enable ? s->audio[track].buffer_size : 0);
+	}
+
+	frame->frame_changed = s->video.frame_changed;
+	frame->palette_changed = s->video.palette_changed;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Worker thread body: decodes its segments into its ring */
+static void * smk_range_main(void * arg)
+{
+	smk s = arg;
+	struct smk_pipe_t * const pipe = s->pipe;
+	unsigned long n = 0, k;
+	char r;
+
+	for (k = pipe->seg; k < pipe->segments; k += pipe->step) {
+		for (s->cur_frame = pipe->bound[k]; s->cur_frame < pipe->bound[k + 1]; s->cur_frame ++) {
+			r = smk_state_render(s, pipe->bound[k]);
+
+			/* frames before the range only lead up to it */
+			if (s->cur_frame < pipe->first)
+				continue;
+
+			if (!smk_pipe_wait_slot(pipe, n))
+				return NULL;
+
+			smk_pipe_put(pipe, s, n ++, r);
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+/* Decodes frames first to last on up to threads decoders, handing them to callback in order */
+char smk_decode_range(smk object, const unsigned long first, unsigned long last, unsigned int threads, const unsigned int slots, const smk_frame_callback callback, void * userdata)
+{
+	smk s;
+	unsigned long * bound = NULL;
+	unsigned long segments, k, f;
+	struct smk_frame_t frame;
+	char ret = 0;
+#ifdef HAVE_PTHREAD_H
+	smk * state = NULL;
+	unsigned int workers, i;
+	struct smk_pipe_t * pipe;
+	unsigned long n;
+	int stop;
+#endif
+
+	/* null check */
+	if (object == NULL || callback == NULL) {
+		smk_error(SMK_ERR_NULL, "libsmacker::smk_decode_range() - ERROR: smk or callback is NULL");
+		return -1;
+	}
+
+	/* the decoders are clones */
+	if (object->mode == SMK_MODE_PUSH || (object->mode == SMK_MODE_DISK && !object->source.file.fd)) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_decode_range() - ERROR: needs the chunks in memory, or an smk from smk_open_fd()");
+		return -1;
+	}
+
+	if (object->pipe) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_decode_range() - ERROR: stop the pipeline first");
+		return -1;
+	}
+
+	/* check the range before clipping it (a file may have no frames) */
+	if (first >= object->f || first > last) {
+		smk_error(SMK_ERR_ARGUMENT, "libsmacker::smk_decode_range(object,%lu,%lu) - ERROR: empty range (file has %lu frames)", first, last, object->f);
+		return -1;
+	}
+
+	/* the ring frame only replays the first */
+	if (last >= object->f)
+		last = object->f - 1;
+
+	/* Segments: from the keyframe at or before first (or frame 0),
+		then one at each later keyframe up to last */
+	smk_malloc(bound, (last - first + 2) * sizeof(unsigned long));
+	bound[0] = first;
+
+	while (bound[0] > 0 && !object->index[bound[0]].keyframe)
+		bound[0] --;
+
+	segments = 1;
+
+	for (f = first + 1; f <= last; f ++) {
+		if (object->index[f].keyframe)
+			bound[segments ++] = f;
+	}
+
+	bound[segments] = last + 1;
+	/* a decoder per thread, but no more than there are segments */
+#ifdef HAVE_PTHREAD_H
+
+	if (threads > segments)
+		threads = segments;
+
+#else
+	(void)slots;
+	threads = 1;
+#endif
+
+	if (threads < 2) {
+		/* Just the one decoder, on this thread */
+		s = smk_clone(object);
+
+		for (k = 0; k < segments; k ++) {
+			for (s->cur_frame = bound[k]; s->cur_frame < bound[k + 1]; s->cur_frame ++) {
+				if (smk_state_render(s, bound[k]) < 0)
+					ret = -1;
+
+				if (s->cur_frame < first)
+					continue;
+
+				smk_state_frame(s, &frame);
+
+				if (callback(userdata, &frame))
+					goto done;
+			}
+		}
+
+done:
+		smk_close(s);
+		smk_free(bound);
+		return ret;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	/* One decoder and ring per thread, taking every threads'th segment */
+	smk_malloc(state, threads * sizeof(smk));
+
+	for (workers = 0; workers < threads; workers ++) {
+		s = state[workers] = smk_clone(object);
+		pipe = s->pipe = smk_pipe_create(object, slots ? slots : 1);
+		pipe->bound = bound;
+		pipe->seg = workers;
+		pipe->segments = segments;
+		pipe->first = first;
+		pipe->step = threads;
+
+		if (pthread_create(&pipe->thread, NULL, smk_range_main, s)) {
+			smk_error(SMK_ERR_MEMORY, "libsmacker::smk_decode_range() - ERROR: failed to start decoder thread %u", workers);
+			smk_pipe_free(pipe);
+			s->pipe = NULL;
+			smk_close(s);
+			ret = -1;
+			goto stop;
+		}
+	}
+
+	/* Take the frames in order: segment k comes from ring k % threads */
+	for (k = 0; k < segments; k ++) {
+		pipe = state[k % threads]->pipe;
+
+		for (f = (bound[k] > first ? bound[k] : first); f < bound[k + 1]; f ++) {
+			n = pipe->acquired;
+			smk_pipe_wait_frame(pipe, n);
+
+			if (pipe->status[n % pipe->slots] < 0)
+				ret = -1;
+
+			stop = callback(userdata, &pipe->frame[n % pipe->slots]);
+			pipe->acquired = n + 1;
+			smk_pipe_store(pipe, &pipe->released, n + 1);
+
+			if (stop)
+				goto stop;
+		}
+	}
+
+stop:
+
+	/* (closing stops the worker) */
+	for (i = 0; i < workers; i ++)
+		smk_close(state[i]);
+
+	smk_free(state);
+#endif
+	smk_free(bound);
+	return ret;
+}
@@ -27,6 +27,8 @@
 
 /** forward-declaration for an struct */
 typedef struct smk_t * smk;
+/** forward-declaration for the incremental decoder */
+typedef struct smk_push_t * smk_push;
 
 /** a few defines as return codes from smk_next() */
 #define SMK_DONE	0x00
@@ -37,6 +39,8 @@ typedef struct smk_t * smk;
 /** file-processing mode, pass to smk_open_file */
 #define SMK_MODE_DISK	0x00
 #define SMK_MODE_MEMORY	0x01
+/** map the file and decode straight from the mapping (SMK_MODE_MEMORY where mmap is unavailable) */
+#define SMK_MODE_MMAP	0x02
 
 /** Y-scale meanings */
 #define	SMK_FLAG_Y_NONE	0x00
@@ -53,18 +57,151 @@ typedef struct smk_t * smk;
 #define	SMK_AUDIO_TRACK_6	0x40
 #define	SMK_VIDEO_TRACK	0x80
 
+/** log message severity, passed to the log callback */
+#define SMK_LOG_ERROR	0x00
+#define SMK_LOG_WARNING	0x01
+
+/** error codes, as returned by smk_last_error() */
+#define SMK_ERR_NONE	0x00
+#define SMK_ERR_NULL	0x01	/* NULL object or buffer passed in */
+#define SMK_ERR_ARGUMENT	0x02	/* other invalid argument */
+#define SMK_ERR_IO	0x03	/* open, read or seek failed */
+#define SMK_ERR_MEMORY	0x04	/* out of memory (or threads) */
+#define SMK_ERR_FORMAT	0x05	/* not an smk file, or a bad header */
+#define SMK_ERR_DATA	0x06	/* corrupt or truncated file data */
+#define SMK_ERR_UNSUPPORTED	0x07	/* feature missing from this build or library */
+
+/** log callback: receives every error and warning message (without newline).
+	It may be called from library threads, several at once: it must be reentrant. */
+typedef void (* smk_log_callback)(void * userdata, int level, int code, const char * message);
+
+/** a frame handed out by smk_pipeline_acquire() (the pointers stay valid,
+	and the contents unchanged, until its slot is released), or to a
+	smk_frame_callback (valid during the call) */
+struct smk_frame_t {
+	/* frame number, as smk_info_all() gives it (the ring frame is 0) */
+	unsigned long frame;
+	/* w * h indices, 256 RGB triplets */
+	const unsigned char * video;
+	const unsigned char * palette;
+	/* per track (empty if disabled) */
+	const unsigned char * audio[7];
+	unsigned long audio_size[7];
+	/* as smk_info_changes() */
+	unsigned char frame_changed;
+	unsigned char palette_changed;
+};
+
+/** frame callback for smk_decode_range(): return nonzero to stop */
+typedef int (* smk_frame_callback)(void * userdata, const struct smk_frame_t * frame);
+
+/** events from smk_push_feed() */
+#define SMK_EVENT_HEADER	0x00	/* header parsed: info, enable and thread calls may be made */
+#define SMK_EVENT_FRAME	0x01	/* a frame was decoded: get its video, palette and audio */
+
+/** event callback for smk_push_create(): object stays owned by the decoder */
+typedef void (* smk_event_callback)(void * userdata, smk object, int event);
+
+/** I/O callbacks for smk_open_callbacks(), all given the caller's handle.
+	read: copies up to size bytes into buf, returning the count (short at end of stream), or -1 on error
+	seek: moves to offset bytes from the start of the stream, returning 0 on success
+	tell: returns the current offset from the start of the stream, or -1 on error */
+typedef long (* smk_read_callback)(void * handle, void * buf, unsigned long size);
+typedef int (* smk_seek_callback)(void * handle, unsigned long offset);
+typedef long (* smk_tell_callback)(void * handle);
+
+/** THREAD SAFETY
+	libsmacker keeps no state shared between handles: every smk (palette included)
+	decodes on its own, so different smk may be used on different threads at once.
+	That includes clones of one smk, and smk sharing a descriptor (smk_open_fd).
+	A single smk is used by one thread at a time. Per function:
+
+	smk_set_log_callback	global: call before other threads use the library
+	smk_last_error	per thread, any time: sees only errors raised on that thread
+		(process-wide on compilers without thread-local storage: see smk_last_error)
+	smk_open_*	any thread, any time
+	smk_clone	reads its argument only: any number of threads may clone one smk at
+		once, while no other call runs on it; the new smk is independent. (Built
+		with neither pthreads nor GCC, make and close the clones of an smk on one thread.)
+	smk_close	one thread, with no other call on that smk running
+	smk_info_*, smk_get_*	one thread per smk; smk_get_* pointers stay valid until
+		the next decoding call on that smk
+	smk_enable_*, smk_set_*	one thread per smk, not during a decoding call on it
+	smk_first, smk_next, smk_seek_keyframe	one thread per smk
+	smk_push_*	one thread per decoder; its callback runs inside smk_push_feed
+	smk_set_pipeline	one thread per smk; while the pipeline runs, only
+		smk_pipeline_acquire/release (from one thread), smk_set_pipeline and
+		smk_close may be called on that smk
+	smk_decode_range	one thread per smk; callback runs on the calling thread
+
+	Threads started by the library (smk_set_threads, smk_set_readahead,
+	smk_set_pipeline, smk_decode_range) only touch their own smk. I/O callbacks
+	of a disk-mode smk are never called concurrently, but may be called on the
+	read-ahead thread.
+
+	Messages go to the log callback on the thread that hit the problem: the
+	caller's, or a library thread (pipeline, read-ahead, records decoded side by
+	side, smk_decode_range workers), possibly several at once, so the callback
+	must be reentrant. The codes those threads raise set their own
+	smk_last_error(), which the caller never sees: go by return values instead.
+	smk_first(), smk_next() and smk_seek_keyframe() raise their workers' and
+	read-ahead errors again on the caller; smk_pipeline_acquire() and
+	smk_decode_range() return -1. */
+
 /* PUBLIC FUNCTIONS */
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* DIAGNOSTICS */
+/** send log messages to callback instead of stderr (NULL: discard them).
+	Not thread-safe: set it up before decoding. The callback must be reentrant
+	(see THREAD SAFETY). */
+void smk_set_log_callback(smk_log_callback callback, void * userdata);
+/** code of the last error raised on the calling thread (like errno: not reset on success).
+	Per thread when built with MSVC, GCC-compatible compilers or C11; with other
+	compilers it is one code for the whole process, and errors raised on library
+	threads overwrite it. */
+int smk_last_error(void);
+
 /* OPEN OPERATIONS */
 /** open an smk (from a file) */
 smk smk_open_file(const char * filename, unsigned char mode);
 /** open an smk (from a file pointer) */
 smk smk_open_filepointer(FILE * file, unsigned char mode);
+/** open an smk (from a file descriptor, read from its start with pread).
+	The descriptor is never moved or closed, so any number of smk (on any threads)
+	may share it; it must stay open until they are closed. Needs a build with pread. */
+smk smk_open_fd(int fd, unsigned char mode);
 /** read an smk (from a memory buffer) */
 smk smk_open_memory(const unsigned char * buffer, unsigned long size);
+/** read an smk (from a memory buffer) without copying the buffer:
+	it must stay valid and unchanged until smk_close() */
+smk smk_open_memory_borrow(const unsigned char * buffer, unsigned long size);
+/** open an smk (through I/O callbacks, from the stream's current position).
+	SMK_MODE_DISK reads chunks on demand: handle and callbacks must stay valid until smk_close(),
+	and are called from the read-ahead thread if smk_set_readahead() is used.
+	Other modes read everything now, and need only the read callback.
+	The handle is never closed by libsmacker. */
+smk smk_open_callbacks(smk_read_callback read, smk_seek_callback seek, smk_tell_callback tell, void * handle, unsigned char mode);
+/** open another handle on an open smk: it shares the header, trees, index and chunks
+	(never changed after opening), and has its own frame, palette, switches (copied)
+	and position (frame 0), so handles can decode on different threads. Threads,
+	read-ahead and pipelines are not copied. Works in memory, mmap and borrow modes, and in
+	disk mode for smk from smk_open_fd(). Each handle is closed with smk_close(),
+	in any order: the shared parts go with the last one. */
+smk smk_clone(const smk object);
+
+/* PUSH OPERATIONS */
+/** start an incremental decoder, for input that can't seek (pipes, sockets, downloads).
+	Holds the header and one buffer the size of the largest chunk.
+	smk_first(), smk_next() and smk_seek_keyframe() are not available on its smk. */
+smk_push smk_push_create(smk_event_callback callback, void * userdata);
+/** feed the next bytes of the file: events fire from inside this call as each part completes.
+	-1 on a bad header (fatal) or a frame that failed to decode (the next frames still play) */
+char smk_push_feed(smk_push push, const unsigned char * data, unsigned long size);
+/** close the decoder and its smk */
+void smk_push_close(smk_push push);
 
 /* CLOSE OPERATIONS */
 /** close out an smk file and clean up memory */
@@ -80,10 +217,53 @@ char smk_enable_all(smk object, unsigned char mask);
 char smk_enable_video(smk object, unsigned char enable);
 char smk_enable_audio(smk object, unsigned char track, unsigned char enable);
 
+/* THREADING */
+/** decode frames on this many threads (counting the caller); 0 or 1 decodes on the caller only.
+	Needs a build with pthreads. */
+char smk_set_threads(smk object, unsigned int threads);
+/** with threads, decode each frame's audio tracks and video at the same time, one per thread,
+	instead of the audio first and then the video split across threads. Pays off when
+	there is a lot of audio (several 16-bit tracks). Off by default. */
+char smk_set_concurrent(smk object, unsigned char enable);
+/** in disk mode, read up to this many chunks ahead on a background thread; 0 reads on demand.
+	Holds chunks + 1 buffers the size of the largest chunk. Ignored in other modes.
+	Needs a build with pthreads. */
+char smk_set_readahead(smk object, unsigned int chunks);
+
+/* PIPELINE */
+/** decode on a background thread, from the first frame on, into a ring of this many slots; 0 stops
+	(leaving the smk at the last frame decoded). While it runs, smk_first(), smk_next(),
+	smk_seek_keyframe() and the other setters are refused, and enable switches and
+	smk_get_* must not be used. Needs a build with pthreads. */
+char smk_set_pipeline(smk object, unsigned int slots);
+/** take the next decoded frame, waiting for it if need be: SMK_MORE or SMK_LAST as smk_next()
+	would return, -1 if it decoded with errors (the slot is still taken), SMK_DONE at the end.
+	Any number of slots may be held at once; they are released in the order taken. */
+char smk_pipeline_acquire(smk object, struct smk_frame_t * frame);
+/** give back the oldest slot taken */
+char smk_pipeline_release(smk object);
+
+/* BATCH DECODING */
+/** decode frames first to last (inclusive; clipped to the file) and pass each to callback,
+	in order, on the calling thread. The range is split at keyframes, and the segments
+	decoded side by side on up to this many threads, each holding up to slots frames
+	ready. Every segment starts from a blank frame and palette (as a newly opened smk),
+	so results don't depend on the thread count. The smk itself is left untouched.
+	Needs an smk that smk_clone() accepts. -1 on error, or if any frame had errors. */
+char smk_decode_range(smk object, unsigned long first, unsigned long last, unsigned int threads, unsigned int slots, smk_frame_callback callback, void * userdata);
+
 /** Retrieve palette */
 const unsigned char * smk_get_palette(const smk object);
 /** Retrieve video frame, as a buffer of size w*h */
 const unsigned char * smk_get_video(const smk object);
+/** Tell whether the last frame changed any pixels, or the palette */
+char smk_info_changes(const smk object, unsigned char * frame_changed, unsigned char * palette_changed);
+/** Retrieve blocks changed by the last frame: one bit per 4x4 block, LSB first,
+	(w + 3) / 4 blocks per row, (h + 3) / 4 rows */
+const unsigned char * smk_get_dirty_blocks(const smk object);
+/** Retrieve pixel rectangles {x, y, w, h} covering the changed blocks; returns the count.
+	If more than max are needed, the last one grows to cover the rest. */
+unsigned long smk_get_dirty_rects(const smk object, unsigned long rect[][4], unsigned long max);
 /** Retrieve decoded audio chunk, track N */
 const unsigned char * smk_get_audio(const smk object, unsigned char track);
 /** Get size of currently pointed decoded audio chunk, track N */
@@ -23,6 +23,18 @@
 #include <errno.h>
 #include <string.h>
 
+/**
+	Test hook: with SMK_TEST_ALLOC defined, every malloc() and calloc()
+		made by the library goes through functions the test supplies,
+		so a check can count them (see test_alloc.c).
+*/
+#ifdef SMK_TEST_ALLOC
+void * smk_test_malloc(size_t size);
+void * smk_test_calloc(size_t count, size_t size);
+#define malloc(x) smk_test_malloc(x)
+#define calloc(n, x) smk_test_calloc(n, x)
+#endif
+
 /**
 	Safe free: attempts to prevent double-free by setting pointer to NULL.
 		Optionally warns on attempts to free a NULL pointer.
@@ -53,4 +65,20 @@
 	} \
 }
 
+/**
+	Safe malloc, without the zero-fill: for blocks that are
+		overwritten right away.  Otherwise as smk_malloc.
+*/
+#define smk_malloc_nozero(p, x) \
+{ \
+	assert (p == NULL); \
+	p = malloc(x); \
+	if (!p) \
+	{ \
+		fprintf(stderr, "libsmacker::smk_malloc_nozero(" #p ", %lu) - ERROR: malloc() returned NULL (file: %s, line: %lu)\n\tReason: [%d] %s\n", \
+			(unsigned long) (x), __FILE__, (unsigned long)__LINE__, errno, strerror(errno)); \
+		exit(EXIT_FAILURE); \
+	} \
+}
+
 #endif
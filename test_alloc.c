@@ -0,0 +1,171 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_alloc.c
+		Checks that decoding allocates nothing once a file is open:
+		every sample is played through twice (ring wrap included),
+		with dirty rectangles, a rewind and a keyframe seek, in memory,
+		disk (stdio, descriptor, callbacks) and threaded set-ups, while
+		the library's malloc() and calloc() are counted.
+		Built against smacker.c itself, with the SMK_TEST_ALLOC hook.
+*/
+
+#define SMK_TEST_ALLOC
+#include "smacker.c"
+#include "test_sample.h"
+
+/* blocks the library asked for while counting */
+static volatile unsigned long test_allocs = 0;
+static volatile char test_counting = 0;
+
+void * smk_test_malloc(size_t size)
+{
+	if (test_counting)
+		test_allocs ++;
+
+	return (malloc)(size);
+}
+
+void * smk_test_calloc(size_t count, size_t size)
+{
+	if (test_counting)
+		test_allocs ++;
+
+	return (calloc)(count, size);
+}
+
+/* Ways of opening a sample */
+enum { TEST_MEMORY, TEST_BORROW, TEST_FILE, TEST_FD, TEST_CALLBACKS };
+
+static const struct {
+	const char * name;
+	int source;
+	unsigned int threads, readahead;
+} test_setup[] = {
+	{"memory", TEST_MEMORY, 1, 0},
+	{"borrow", TEST_BORROW, 1, 0},
+	{"disk", TEST_FILE, 1, 0},
+	{"disk fd", TEST_FD, 1, 0},
+	{"disk callbacks", TEST_CALLBACKS, 1, 0},
+#ifdef HAVE_PTHREAD_H
+	{"memory, 3 threads", TEST_MEMORY, 3, 0},
+	{"disk, 3 threads, read-ahead", TEST_FILE, 3, 2},
+	{"disk callbacks, read-ahead", TEST_CALLBACKS, 1, 3},
+#endif
+	{NULL, 0, 0, 0}
+};
+
+/* Plays s twice through, counting allocations; returns the count */
+static unsigned long test_play(smk s, unsigned int threads, unsigned int readahead)
+{
+	unsigned long rect[16][4];
+	unsigned long i, f = 0;
+
+	smk_enable_all(s, 0xFF);
+	smk_info_all(s, NULL, &f, NULL);
+
+	if (threads > 1)
+		smk_set_threads(s, threads);
+
+	if (readahead)
+		smk_set_readahead(s, readahead);
+
+	smk_first(s);
+	test_allocs = 0;
+	test_counting = 1;
+
+	for (i = 0; i < 2 * f + 2; i ++) {
+		smk_get_dirty_rects(s, rect, 16);
+		smk_next(s);
+	}
+
+	smk_first(s);
+	smk_get_dirty_rects(s, rect, 1);
+	smk_seek_keyframe(s, f / 2);
+	smk_next(s);
+	smk_seek_keyframe(s, 0);
+	smk_next(s);
+
+	test_counting = 0;
+	return test_allocs;
+}
+
+int main(void)
+{
+	struct test_stream_t stream;
+	unsigned char * data;
+	unsigned long size, allocs;
+	unsigned int n, i, fail = 0;
+	FILE * file, * shared;
+	smk s;
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		data = test_sample(n, &size);
+
+		for (i = 0; test_setup[i].name; i ++) {
+			s = NULL;
+			shared = NULL;
+
+			switch (test_setup[i].source) {
+			case TEST_MEMORY:
+				s = smk_open_memory(data, size);
+				break;
+
+			case TEST_BORROW:
+				s = smk_open_memory_borrow(data, size);
+				break;
+
+			case TEST_FILE:
+			case TEST_FD:
+				if ((file = tmpfile()) == NULL || fwrite(data, 1, size, file) != size || fflush(file)) {
+					printf("FAIL: can't write a temporary file\n");
+					return 1;
+				}
+
+				rewind(file);
+
+				if (test_setup[i].source == TEST_FILE)
+					s = smk_open_filepointer(file, SMK_MODE_DISK);
+				else {
+					/* the descriptor stays ours, to close after the smk */
+					shared = file;
+#ifdef HAVE_PREAD
+					s = smk_open_fd(fileno(file), SMK_MODE_DISK);
+#else
+					printf("SKIP: %s, %s: no pread\n", test_sample_name(n), test_setup[i].name);
+					fclose(shared);
+					shared = NULL;
+					continue;
+#endif
+				}
+
+				break;
+
+			case TEST_CALLBACKS:
+				test_stream_init(&stream, data, size);
+				s = smk_open_callbacks(test_stream_read, test_stream_seek, test_stream_tell, &stream, SMK_MODE_DISK);
+				break;
+			}
+
+			if (s == NULL) {
+				printf("FAIL: %s, %s: can't open\n", test_sample_name(n), test_setup[i].name);
+				fail = 1;
+			} else {
+				allocs = test_play(s, test_setup[i].threads, test_setup[i].readahead);
+				printf("%s, %s: %lu allocation(s)\n", test_sample_name(n), test_setup[i].name, allocs);
+				fail |= (allocs != 0);
+				smk_close(s);
+			}
+
+			if (shared)
+				fclose(shared);
+		}
+
+		free(data);
+	}
+
+	return fail;
+}
@@ -0,0 +1,176 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_clone.c
+		Checks smk_clone(): two clones of one smk, played in turns and
+		from different positions (one starts halfway through the
+		other's play), give the frames a single smk does, frame by
+		frame.  The original is closed before its clones, which must
+		play on unharmed; a clone of a clone too.  Opened from memory,
+		and from a descriptor in disk and mmap modes.  Configure with
+		CFLAGS="-g -fsanitize=address" to catch shared parts freed
+		while a clone still uses them, or never freed.
+*/
+
+#include "smacker.h"
+#include "test_sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* enough for every sample, ring frame included */
+#define TEST_FRAMES	64
+
+/* Ways to open a sample */
+enum { TEST_MEMORY, TEST_FD_DISK, TEST_FD_MMAP };
+
+/* Opens data as how; file (if set) is for the caller to close once
+	every handle on it is */
+static smk test_open(const unsigned char * data, unsigned long size, int how, FILE ** file)
+{
+	*file = NULL;
+
+	if (how == TEST_MEMORY)
+		return smk_open_memory(data, size);
+
+#ifdef HAVE_PREAD
+
+	if ((*file = tmpfile()) == NULL || fwrite(data, 1, size, *file) != size || fflush(*file)) {
+		printf("FAIL: can't write a temporary file\n");
+		exit(1);
+	}
+
+	return smk_open_fd(fileno(*file), how == TEST_FD_DISK ? SMK_MODE_DISK : SMK_MODE_MMAP);
+#else
+	return NULL;
+#endif
+}
+
+/* Plays two clones of s in turns, b starting when a is halfway, after
+	closing s; then a clone of a from the top.  Each must give want
+	(steps results and frames, from smk_first on).  Closes everything. */
+static unsigned int test_play(smk s, const char * name, const unsigned long * want, unsigned long steps)
+{
+	unsigned long step, pos_a = 0, pos_b = 0;
+	unsigned int fail = 0;
+	smk a, b, c;
+
+	a = smk_clone(s);
+	b = smk_clone(s);
+	smk_close(s);
+
+	if (a == NULL || b == NULL) {
+		printf("FAIL: %s: can't clone\n", name);
+
+		if (a)
+			smk_close(a);
+
+		if (b)
+			smk_close(b);
+
+		return 1;
+	}
+
+	for (step = 0; pos_b < steps; step ++) {
+		if (pos_a < steps) {
+			if (test_hash(a, TEST_HASH_INIT ^ (unsigned char)(pos_a ? smk_next(a) : smk_first(a))) != want[pos_a]) {
+				printf("FAIL: %s: first clone, step %lu, differs from one smk\n", name, pos_a);
+				fail = 1;
+				break;
+			}
+
+			pos_a ++;
+		}
+
+		if (step >= steps / 2) {
+			if (test_hash(b, TEST_HASH_INIT ^ (unsigned char)(pos_b ? smk_next(b) : smk_first(b))) != want[pos_b]) {
+				printf("FAIL: %s: second clone, step %lu, differs from one smk\n", name, pos_b);
+				fail = 1;
+				break;
+			}
+
+			pos_b ++;
+		}
+	}
+
+	/* the clone's own state is fresh: a clone of a clone plays from the top */
+	c = smk_clone(a);
+	smk_close(a);
+	smk_close(b);
+
+	for (step = 0; c && step < steps; step ++) {
+		if (test_hash(c, TEST_HASH_INIT ^ (unsigned char)(step ? smk_next(c) : smk_first(c))) != want[step]) {
+			printf("FAIL: %s: clone of a clone, step %lu, differs from one smk\n", name, step);
+			fail = 1;
+			break;
+		}
+	}
+
+	if (c == NULL) {
+		printf("FAIL: %s: can't clone a clone\n", name);
+		fail = 1;
+	} else
+		smk_close(c);
+
+	return fail;
+}
+
+int main(void)
+{
+	static const char * const how_name[] = {"memory", "descriptor, disk mode", "descriptor, mmap mode"};
+	unsigned long want[TEST_FRAMES];
+	unsigned char * data;
+	unsigned long size, f, steps, step;
+	unsigned int n, fail = 0;
+	int how;
+	char name[64];
+	FILE * file;
+	smk s;
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		data = test_sample(n, &size);
+
+		/* one smk, played through and one past the end */
+		if ((s = smk_open_memory(data, size)) == NULL) {
+			printf("FAIL: %s: can't open\n", test_sample_name(n));
+			fail = 1;
+			free(data);
+			continue;
+		}
+
+		smk_enable_all(s, 0xFF);
+		smk_info_all(s, NULL, &f, NULL);
+		steps = (f + 2 < TEST_FRAMES ? f + 2 : TEST_FRAMES);
+
+		for (step = 0; step < steps; step ++)
+			want[step] = test_hash(s, TEST_HASH_INIT ^ (unsigned char)(step ? smk_next(s) : smk_first(s)));
+
+		smk_close(s);
+
+		for (how = TEST_MEMORY; how <= TEST_FD_MMAP; how ++) {
+			sprintf(name, "%s, %s", test_sample_name(n), how_name[how]);
+
+			if ((s = test_open(data, size, how, &file)) == NULL) {
+#ifdef HAVE_PREAD
+				printf("FAIL: %s: can't open\n", name);
+				fail = 1;
+#endif
+			} else {
+				/* clones take the switches as they are */
+				smk_enable_all(s, 0xFF);
+				fail |= test_play(s, name, want, steps);
+			}
+
+			if (file)
+				fclose(file);
+		}
+
+		free(data);
+	}
+
+	return fail;
+}
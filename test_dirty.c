@@ -0,0 +1,187 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_dirty.c
+		Checks the change tracking against a diff of the output: every
+		pixel that changed lies in a block marked dirty, the change flags
+		agree with the blocks and the palette, and the dirty rectangles
+		cover exactly the marked blocks (or at least them, when capped).
+		Plays every sample through, then rewinds and seeks.
+*/
+
+#include "smacker.h"
+#include "test_sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* What to do next: smk_first, smk_next, or seek to a keyframe */
+enum { TEST_FIRST, TEST_NEXT, TEST_SEEK_MIDDLE, TEST_SEEK_START };
+
+/* Checks the change tracking after one call; prev holds the frame and palette before it */
+static unsigned int test_check(smk s, const char * name, const char * what, const unsigned char * prev_video, const unsigned char * prev_palette, unsigned long (* rect)[4], unsigned char * cover)
+{
+	const unsigned char * video = smk_get_video(s), * palette = smk_get_palette(s), * dirty = smk_get_dirty_blocks(s);
+	unsigned long w, h, bw, bh, x, y, b, n, i, max;
+	unsigned char frame_changed, palette_changed, marked, any = 0;
+	unsigned int fail = 0;
+
+	smk_info_video(s, &w, &h, NULL);
+	smk_info_changes(s, &frame_changed, &palette_changed);
+	bw = (w + 3) / 4;
+	bh = (h + 3) / 4;
+
+	if (palette_changed != (memcmp(palette, prev_palette, 768) != 0)) {
+		printf("FAIL: %s, %s: palette_changed is %u, but the palette %s\n", name, what, palette_changed, palette_changed ? "is the same" : "changed");
+		fail = 1;
+	}
+
+	for (y = 0; y < h; y ++) {
+		for (x = 0; x < w; x ++) {
+			b = (y / 4) * bw + x / 4;
+			marked = (dirty[b >> 3] >> (b & 7)) & 1;
+			any |= marked;
+
+			if (!marked && video[y * w + x] != prev_video[y * w + x]) {
+				printf("FAIL: %s, %s: pixel %lu,%lu changed outside the dirty blocks\n", name, what, x, y);
+				return 1;
+			}
+		}
+	}
+
+	if (frame_changed != any) {
+		printf("FAIL: %s, %s: frame_changed is %u, dirty blocks say %u\n", name, what, frame_changed, any);
+		fail = 1;
+	}
+
+	/* uncapped: exactly the marked blocks, each pixel once; capped: at least them */
+	for (max = bw * bh; max; max = (max > 3 ? 3 : max - 1)) {
+		n = smk_get_dirty_rects(s, rect, max);
+		memset(cover, 0, w * h);
+
+		if (n > max || (!frame_changed && n)) {
+			printf("FAIL: %s, %s: %lu rectangles for at most %lu\n", name, what, n, max);
+			return 1;
+		}
+
+		for (i = 0; i < n; i ++) {
+			if (!rect[i][2] || !rect[i][3] || rect[i][0] + rect[i][2] > w || rect[i][1] + rect[i][3] > h) {
+				printf("FAIL: %s, %s: rectangle %lu is empty or outside the frame\n", name, what, i);
+				return 1;
+			}
+
+			for (y = rect[i][1]; y < rect[i][1] + rect[i][3]; y ++) {
+				for (x = rect[i][0]; x < rect[i][0] + rect[i][2]; x ++)
+					cover[y * w + x] ++;
+			}
+		}
+
+		for (y = 0; y < h; y ++) {
+			for (x = 0; x < w; x ++) {
+				b = (y / 4) * bw + x / 4;
+				marked = (dirty[b >> 3] >> (b & 7)) & 1;
+
+				if ((marked && !cover[y * w + x]) || (max == bw * bh && cover[y * w + x] != marked)) {
+					printf("FAIL: %s, %s: %lu rectangles (at most %lu) cover pixel %lu,%lu %u times, block %s\n", name, what, n, max, x, y, cover[y * w + x], marked ? "dirty" : "clean");
+					return 1;
+				}
+			}
+		}
+
+		if (max == 1)
+			break;
+	}
+
+	return fail;
+}
+
+int main(void)
+{
+	static const char * const op_name[] = {"smk_first", "smk_next", "seek to the middle", "seek to the start"};
+	unsigned char * data, * prev_video, * cover;
+	unsigned char prev_palette[768];
+	unsigned long (* rect)[4];
+	unsigned long size, w, h, f, step, steps;
+	unsigned int n, fail = 0;
+	int op;
+	char what[64];
+	smk s;
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		data = test_sample(n, &size);
+
+		if ((s = smk_open_memory(data, size)) == NULL) {
+			printf("FAIL: %s: can't open\n", test_sample_name(n));
+			fail = 1;
+			free(data);
+			continue;
+		}
+
+		smk_enable_all(s, 0xFF);
+		smk_info_all(s, NULL, &f, NULL);
+		smk_info_video(s, &w, &h, NULL);
+		prev_video = malloc(w * h);
+		cover = malloc(w * h);
+		rect = malloc(((w + 3) / 4) * ((h + 3) / 4) * sizeof(*rect));
+		/* a blank frame and palette, as after opening */
+		memset(prev_video, 0, w * h);
+		memset(prev_palette, 0, 768);
+
+		/* play through (and past the end), rewind, play a little, seek around */
+		steps = f + 9;
+
+		for (step = 0; step < steps; step ++) {
+			if (step == 0 || step == f + 2)
+				op = TEST_FIRST;
+			else if (step == f + 5)
+				op = TEST_SEEK_MIDDLE;
+			else if (step == f + 7)
+				op = TEST_SEEK_START;
+			else
+				op = TEST_NEXT;
+
+			switch (op) {
+			case TEST_FIRST:
+				smk_first(s);
+				break;
+
+			case TEST_NEXT:
+				/* nothing decoded past the end: the flags still describe the last frame */
+				if (smk_next(s) == SMK_DONE)
+					continue;
+
+				break;
+
+			case TEST_SEEK_MIDDLE:
+				smk_seek_keyframe(s, f / 2);
+				break;
+
+			default:
+				smk_seek_keyframe(s, 0);
+				break;
+			}
+
+			sprintf(what, "step %lu (%s)", step, op_name[op]);
+
+			if (test_check(s, test_sample_name(n), what, prev_video, prev_palette, rect, cover)) {
+				fail = 1;
+				break;
+			}
+
+			memcpy(prev_video, smk_get_video(s), w * h);
+			memcpy(prev_palette, smk_get_palette(s), 768);
+		}
+
+		free(rect);
+		free(cover);
+		free(prev_video);
+		smk_close(s);
+		free(data);
+	}
+
+	return fail;
+}
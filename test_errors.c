@@ -0,0 +1,148 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_errors.c
+		Checks that a frame with a broken audio record (a bad start
+		bit, or more unpacked bytes than the track's buffer holds)
+		fails the same way however it is decoded: smk_next() returns
+		-1 and smk_last_error() reports the data error on the calling
+		thread, on one thread, on worker threads, and with records
+		decoded side by side (where the audio fails on a worker).
+		A later frame that decodes leaves the error code as it was.
+*/
+
+#include "smacker.h"
+#include "test_sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long test_ul(const unsigned char * p)
+{
+	return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* Ways to break an audio record */
+enum { TEST_START_BIT, TEST_UNPACKED_SIZE };
+
+/* Breaks the first compressed audio record of frame 1: its bitstream
+	must start with a set bit, and its unpacked size must fit the
+	track's buffer.  Returns 0 if the sample has none. */
+static int test_break_audio(unsigned char * data, int how)
+{
+	const unsigned long frames = test_ul(data + 12) + (data[20] & 0x01);
+	unsigned char * chunk = data + 104 + 5 * frames + test_ul(data + 52);
+	const unsigned char type = data[104 + 4 * frames + 1];
+	unsigned int track;
+
+	if (frames < 2)
+		return 0;
+
+	chunk += test_ul(data + 104) & ~3UL;
+
+	if (type & 0x01)
+		chunk += 4 * chunk[0];
+
+	for (track = 0; track < 7; track ++) {
+		if (!(type & (0x02 << track)))
+			continue;
+
+		if (data[75 + 4 * track] & 0x80) {
+			if (how == TEST_START_BIT)
+				/* after the record size and the unpacked size */
+				chunk[8] = 0;
+			else
+				chunk[4] = chunk[5] = chunk[6] = chunk[7] = 0x7F;
+
+			return 1;
+		}
+
+		chunk += test_ul(chunk);
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	static const struct {
+		const char * name;
+		unsigned int threads;
+		unsigned char concurrent;
+	} setup[] = {
+		{"one thread", 1, 0},
+		{"3 threads", 3, 0},
+		{"3 threads, records side by side", 3, 1}
+	};
+	static const char * const what[] = {"bad start bit", "unpacked size past the buffer"};
+	unsigned char * data;
+	unsigned long size;
+	unsigned int n, i, tested = 0, fail = 0;
+	int how;
+	char r;
+	smk s;
+
+	smk_set_log_callback(NULL, NULL);
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		for (how = TEST_START_BIT; how <= TEST_UNPACKED_SIZE; how ++) {
+			data = test_sample(n, &size);
+
+			if (!test_break_audio(data, how)) {
+				free(data);
+				continue;
+			}
+
+			tested ++;
+
+			for (i = 0; i < sizeof(setup) / sizeof(setup[0]); i ++) {
+				if ((s = smk_open_memory(data, size)) == NULL) {
+					printf("FAIL: %s: can't open\n", test_sample_name(n));
+					fail = 1;
+					break;
+				}
+
+				smk_enable_all(s, 0xFF);
+
+				if (setup[i].threads > 1 && smk_set_threads(s, setup[i].threads) < 0) {
+					printf("SKIP: %s: %s: no threads in this build\n", test_sample_name(n), setup[i].name);
+					smk_close(s);
+					continue;
+				}
+
+				smk_set_concurrent(s, setup[i].concurrent);
+
+				if (smk_first(s) < 0) {
+					printf("FAIL: %s, %s, %s: frame 0 fails\n", test_sample_name(n), what[how], setup[i].name);
+					fail = 1;
+				}
+
+				if ((r = smk_next(s)) != -1 || smk_last_error() != SMK_ERR_DATA) {
+					printf("FAIL: %s, %s, %s: broken audio in frame 1 gives %d, error %d\n", test_sample_name(n), what[how], setup[i].name, r, smk_last_error());
+					fail = 1;
+				}
+
+				/* like errno: a success doesn't clear it */
+				if (smk_first(s) < 0 || smk_last_error() != SMK_ERR_DATA) {
+					printf("FAIL: %s, %s, %s: frame 0 after the broken one leaves error %d\n", test_sample_name(n), what[how], setup[i].name, smk_last_error());
+					fail = 1;
+				}
+
+				smk_close(s);
+			}
+
+			free(data);
+		}
+	}
+
+	if (!tested) {
+		printf("FAIL: no sample has compressed audio in frame 1\n");
+		fail = 1;
+	}
+
+	return fail;
+}
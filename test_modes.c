@@ -0,0 +1,354 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_modes.c
+		Checks that every way of opening a file decodes the same: each
+		sample is played from smk_open_memory() for reference, then
+		again in disk mode (through a FILE *, a descriptor and
+		callbacks), mapped (SMK_MODE_MMAP, through a FILE * and a
+		descriptor) and borrowed from a buffer of exactly the file's
+		size.  Each play is repeated with video and audio tracks turned
+		off and on, switching halfway, so disk mode reads only parts of
+		chunks, and different parts from one frame to the next.
+		Every sample is also opened with its last chunk cut down to the
+		bytes the decoder reads and the file padded to whole pages, so
+		the bitstream reads on into the padding page; an inaccessible
+		page is kept where a mapping of just the file would end (and
+		the borrowed buffer ends where a heap checker sees it: configure
+		with CFLAGS="-g -fsanitize=address" to catch reads past it).
+*/
+
+#include "smacker.h"
+#include "test_sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* a multiple of any page size in use */
+#define TEST_PAGE	65536UL
+
+static unsigned long test_ul(const unsigned char * p)
+{
+	return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static void test_put_ul(unsigned char * p, unsigned long v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+/* Grows a sample to a whole number of pages after cutting cut bytes
+	(a multiple of 4) off its last chunk: the trees take the padding (the
+	bytes past the last tree are never read), so the last chunk still
+	ends the file. */
+static unsigned char * test_pad(const unsigned char * data, unsigned long size, unsigned long cut, unsigned long * padded)
+{
+	const unsigned long frames = test_ul(data + 12) + (data[20] & 0x01);
+	const unsigned long trees = 104 + 5 * frames + test_ul(data + 52);
+	const unsigned long pad = (TEST_PAGE - (size - cut) % TEST_PAGE) % TEST_PAGE;
+	unsigned char * out;
+
+	if ((out = calloc(1, size - cut + pad)) == NULL)
+		return NULL;
+
+	/* header, index and trees; then the chunks after the padding */
+	memcpy(out, data, trees);
+	memcpy(out + trees + pad, data + trees, size - cut - trees);
+	test_put_ul(out + 52, test_ul(data + 52) + pad);
+	test_put_ul(out + 104 + 4 * (frames - 1), test_ul(data + 104 + 4 * (frames - 1)) - cut);
+	*padded = size - cut + pad;
+	return out;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+static unsigned char * test_guard = NULL;
+static size_t test_guard_size;
+
+/* Leaves a hole of size bytes (whole pages) right below an inaccessible
+	page: mappings are placed top down, so a mapping of exactly the file
+	lands in the hole and reading past it faults, while the padded
+	mapping the library should make does not fit. */
+static void test_guard_place(unsigned long size)
+{
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	unsigned char * map;
+
+	if (size % page)
+		return;
+
+	if ((map = mmap(NULL, size + page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return;
+
+	munmap(map, size);
+	test_guard = map + size;
+	test_guard_size = page;
+}
+
+static void test_guard_remove(void)
+{
+	if (test_guard) {
+		munmap(test_guard, test_guard_size);
+		test_guard = NULL;
+	}
+}
+#else
+static void test_guard_place(unsigned long size)
+{
+	(void)size;
+}
+
+static void test_guard_remove(void)
+{
+}
+#endif
+
+/* What to decode, as SMK_VIDEO_TRACK and SMK_AUDIO_TRACK_n bits:
+	before the middle frame, then from it on */
+static const unsigned char test_mask[][2] = {
+	{0xFF, 0xFF},
+	{SMK_VIDEO_TRACK, 0x7F},
+	{SMK_AUDIO_TRACK_0 | SMK_AUDIO_TRACK_2, SMK_VIDEO_TRACK | SMK_AUDIO_TRACK_1},
+	{0x00, 0xFF},
+	{0x7F, SMK_VIDEO_TRACK}
+};
+
+#define TEST_MASKS	(sizeof(test_mask) / sizeof(test_mask[0]))
+
+static void test_enable(smk s, unsigned char mask)
+{
+	unsigned char track;
+
+	smk_enable_video(s, (mask & SMK_VIDEO_TRACK) != 0);
+
+	for (track = 0; track < 7; track ++)
+		smk_enable_audio(s, track, (mask >> track) & 1);
+}
+
+/* Plays s through and past the end with mask m, rewinds and seeks,
+	folding every result and frame into one hash; closes s */
+static unsigned long test_play(smk s, unsigned int m)
+{
+	unsigned long h = TEST_HASH_INIT, f = 0, i;
+
+	test_enable(s, test_mask[m][0]);
+	smk_info_all(s, NULL, &f, NULL);
+	h = test_hash(s, h ^ (unsigned char)smk_first(s));
+
+	for (i = 0; i <= f; i ++) {
+		if (i == f / 2)
+			test_enable(s, test_mask[m][1]);
+
+		h = test_hash(s, h ^ (unsigned char)smk_next(s));
+	}
+
+	h = test_hash(s, h ^ (unsigned char)smk_seek_keyframe(s, f / 2));
+	h = test_hash(s, h ^ (unsigned char)smk_next(s));
+	h = test_hash(s, h ^ (unsigned char)smk_first(s));
+	smk_close(s);
+	return h;
+}
+
+/* Whether data, cut and padded, decodes from memory to want (all enabled) */
+static int test_same(const unsigned char * data, unsigned long size, unsigned long cut, unsigned long want)
+{
+	unsigned char * padded;
+	unsigned long padded_size;
+	int same = 0;
+	smk s;
+
+	if ((padded = test_pad(data, size, cut, &padded_size)) == NULL) {
+		printf("FAIL: out of memory\n");
+		exit(1);
+	}
+
+	if ((s = smk_open_memory(padded, padded_size)) != NULL)
+		same = (test_play(s, 0) == want);
+
+	free(padded);
+	return same;
+}
+
+/* Ways to reach a temporary file */
+enum { TEST_FILE, TEST_FD, TEST_CALLBACKS };
+
+/* Opens a copy of data in mode, written to a temporary file read through
+	a FILE * or its descriptor, or read through callbacks; file (if set)
+	is for the caller to close once s is */
+static smk test_open(const unsigned char * data, unsigned long size, unsigned char mode, int via, FILE ** file, struct test_stream_t * stream)
+{
+	smk s;
+
+	*file = NULL;
+
+	if (via == TEST_CALLBACKS) {
+		test_stream_init(stream, data, size);
+		return smk_open_callbacks(test_stream_read, test_stream_seek, test_stream_tell, stream, mode);
+	}
+
+	if ((*file = tmpfile()) == NULL || fwrite(data, 1, size, *file) != size || fflush(*file)) {
+		printf("FAIL: can't write a temporary file\n");
+		exit(1);
+	}
+
+	rewind(*file);
+
+	if (mode == SMK_MODE_MMAP)
+		test_guard_place(size);
+
+	if (via == TEST_FD) {
+#ifdef HAVE_PREAD
+		s = smk_open_fd(fileno(*file), mode);
+#else
+		s = NULL;
+#endif
+		return s;
+	}
+
+	/* closed by smk_open_filepointer, or by smk_close */
+	s = smk_open_filepointer(*file, mode);
+	*file = NULL;
+	return s;
+}
+
+/* Checks data against the reference in mode, with every mask, through
+	a FILE *, a descriptor and (in disk mode) callbacks */
+static unsigned int test_file(const unsigned char * data, unsigned long size, unsigned char mode, const char * name, const unsigned long * want)
+{
+	static const char * const via_name[] = {"a FILE *", "a descriptor", "callbacks"};
+	struct test_stream_t stream;
+	unsigned int m, via, fail = 0;
+	FILE * file;
+	smk s;
+
+	for (m = 0; m < TEST_MASKS; m ++) {
+		for (via = TEST_FILE; via <= TEST_CALLBACKS; via ++) {
+#ifndef HAVE_PREAD
+
+			if (via == TEST_FD)
+				continue;
+
+#endif
+
+			if (via == TEST_CALLBACKS && mode == SMK_MODE_MMAP)
+				continue;
+
+			s = test_open(data, size, mode, via, &file, &stream);
+
+			if (s == NULL) {
+				printf("FAIL: %s: can't open through %s in mode %u\n", name, via_name[via], mode);
+				fail = 1;
+			} else if (test_play(s, m) != want[m]) {
+				printf("FAIL: %s: decoding through %s in mode %u, mask %02X then %02X, differs from memory\n", name, via_name[via], mode, test_mask[m][0], test_mask[m][1]);
+				fail = 1;
+			}
+
+			test_guard_remove();
+
+			if (file)
+				fclose(file);
+		}
+	}
+
+	return fail;
+}
+
+/* Checks data against the reference with every mask, borrowed from a
+	copy with no room after it */
+static unsigned int test_borrow(const unsigned char * data, unsigned long size, const char * name, const unsigned long * want)
+{
+	unsigned char * copy;
+	unsigned int m, fail = 0;
+	smk s;
+
+	if ((copy = malloc(size)) == NULL) {
+		printf("FAIL: out of memory\n");
+		exit(1);
+	}
+
+	memcpy(copy, data, size);
+
+	for (m = 0; m < TEST_MASKS; m ++) {
+		if ((s = smk_open_memory_borrow(copy, size)) == NULL) {
+			printf("FAIL: %s: can't open borrowed\n", name);
+			fail = 1;
+		} else if (test_play(s, m) != want[m]) {
+			printf("FAIL: %s: decoding borrowed, mask %02X then %02X, differs from memory\n", name, test_mask[m][0], test_mask[m][1]);
+			fail = 1;
+		}
+	}
+
+	free(copy);
+	return fail;
+}
+
+int main(void)
+{
+	unsigned char * data, * padded;
+	unsigned long size, padded_size, want[TEST_MASKS], cut, last;
+	unsigned int n, m, fail = 0;
+	char name[64];
+	smk s;
+
+	/* the cuts that go too far fail */
+	smk_set_log_callback(NULL, NULL);
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		data = test_sample(n, &size);
+
+		for (m = 0; m < TEST_MASKS; m ++) {
+			if ((s = smk_open_memory(data, size)) == NULL)
+				break;
+
+			want[m] = test_play(s, m);
+		}
+
+		if (m < TEST_MASKS) {
+			printf("FAIL: %s: can't open\n", test_sample_name(n));
+			fail = 1;
+			free(data);
+			continue;
+		}
+
+		fail |= test_file(data, size, SMK_MODE_DISK, test_sample_name(n), want);
+		fail |= test_file(data, size, SMK_MODE_MMAP, test_sample_name(n), want);
+		fail |= test_borrow(data, size, test_sample_name(n), want);
+
+		/* cut the last chunk down to the bytes the decoder reads, so
+			reads run up to the end of the file */
+		last = test_ul(data + 104 + 4 * (test_ul(data + 12) + (data[20] & 0x01) - 1)) / 4;
+		cut = 0;
+
+		while (last - cut > 1) {
+			if (test_same(data, size, (cut + last) / 2 * 4, want[0]))
+				cut = (cut + last) / 2;
+			else
+				last = (cut + last) / 2;
+		}
+
+		if ((padded = test_pad(data, size, cut * 4, &padded_size)) == NULL) {
+			printf("FAIL: out of memory\n");
+			return 1;
+		}
+
+		sprintf(name, "%s, cut and padded to %lu bytes", test_sample_name(n), padded_size);
+		fail |= test_file(padded, padded_size, SMK_MODE_DISK, name, want);
+		fail |= test_file(padded, padded_size, SMK_MODE_MMAP, name, want);
+		fail |= test_borrow(padded, padded_size, name, want);
+		free(padded);
+		free(data);
+	}
+
+	return fail;
+}
@@ -0,0 +1,102 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_open.c
+		Checks that files claiming more chunk data than they hold (a
+		corrupt frame size, or a cut-off file) fail to open with
+		SMK_ERR_DATA in every mode and from every source, instead of
+		allocating what the header asks for; intact files still open.
+*/
+
+#include "smacker.h"
+#include "test_sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Opens a file image from a temporary file, callbacks or memory */
+enum { TEST_FILE, TEST_CALLBACKS, TEST_BUFFER };
+
+static const char * const test_source[] = {"file", "callbacks", "memory buffer"};
+
+static smk test_open(const unsigned char * data, unsigned long size, int source, unsigned char mode)
+{
+	static struct test_stream_t stream;
+	FILE * file;
+
+	switch (source) {
+	case TEST_FILE:
+		if ((file = tmpfile()) == NULL || fwrite(data, 1, size, file) != size || fflush(file)) {
+			printf("FAIL: can't write a temporary file\n");
+			exit(1);
+		}
+
+		rewind(file);
+		return smk_open_filepointer(file, mode);
+
+	case TEST_CALLBACKS:
+		test_stream_init(&stream, data, size);
+		return smk_open_callbacks(test_stream_read, test_stream_seek, test_stream_tell, &stream, mode);
+
+	default:
+		return smk_open_memory(data, size);
+	}
+}
+
+int main(void)
+{
+	const unsigned char mode[] = {SMK_MODE_MEMORY, SMK_MODE_DISK};
+	unsigned char * data, * bad;
+	unsigned long size, cut;
+	unsigned int n, i, source, fail = 0;
+	smk s;
+
+	/* the failures are expected: keep them out of the log */
+	smk_set_log_callback(NULL, NULL);
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		data = test_sample(n, &size);
+		bad = malloc(size);
+		memcpy(bad, data, size);
+		/* first frame size (after the 104-byte header): near 4 GB, keeping its flags */
+		bad[104] |= 0xF0;
+		bad[105] = bad[106] = bad[107] = 0xFF;
+		/* the file missing its last byte */
+		cut = size - 1;
+
+		for (source = TEST_FILE; source <= TEST_BUFFER; source ++) {
+			for (i = 0; i < (source == TEST_BUFFER ? 1 : 2); i ++) {
+				if ((s = test_open(data, size, source, mode[i])) == NULL) {
+					printf("FAIL: %s from %s, mode %u: intact file fails to open\n", test_sample_name(n), test_source[source], mode[i]);
+					fail = 1;
+				} else
+					smk_close(s);
+
+				if ((s = test_open(bad, size, source, mode[i])) != NULL || smk_last_error() != SMK_ERR_DATA) {
+					printf("FAIL: %s from %s, mode %u: huge frame size not refused as bad data\n", test_sample_name(n), test_source[source], mode[i]);
+					fail = 1;
+				}
+
+				if (s)
+					smk_close(s);
+
+				if ((s = test_open(data, cut, source, mode[i])) != NULL || smk_last_error() != SMK_ERR_DATA) {
+					printf("FAIL: %s from %s, mode %u: cut-off file not refused as bad data\n", test_sample_name(n), test_source[source], mode[i]);
+					fail = 1;
+				}
+
+				if (s)
+					smk_close(s);
+			}
+		}
+
+		free(bad);
+		free(data);
+	}
+
+	return fail;
+}
@@ -0,0 +1,273 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_pipeline.c
+		Checks the background decoder against smk_first() / smk_next()
+		on a second smk, frame by frame and status by status, for a few
+		ring sizes and decoding threads: taking one slot at a time, and
+		holding every slot (held frames must not change while later ones
+		are decoded, and no more can be taken).  Also stops a pipeline
+		early and starts it again, and closes an smk while its worker
+		waits on a full ring.  The ring frame is numbered 0, as
+		smk_info_all() numbers it.
+*/
+
+#include "smacker.h"
+#include "test_sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <time.h>
+
+/* ring sizes to try */
+static const unsigned int test_slots[] = {1, 2, 5};
+
+/* Lets the worker run on until it waits */
+static void test_pause(void)
+{
+	struct timespec delay;
+
+	delay.tv_sec = 0;
+	delay.tv_nsec = 20000000;
+	nanosleep(&delay, NULL);
+}
+
+/* Whether a frame from the pipeline matches the frame ref is at */
+static int test_same(const struct smk_frame_t * frame, smk ref)
+{
+	unsigned long cur, w, h;
+	unsigned char frame_changed, palette_changed, track;
+
+	smk_info_all(ref, &cur, NULL, NULL);
+	smk_info_video(ref, &w, &h, NULL);
+	smk_info_changes(ref, &frame_changed, &palette_changed);
+
+	if (frame->frame != cur || frame->frame_changed != frame_changed || frame->palette_changed != palette_changed ||
+		memcmp(frame->video, smk_get_video(ref), w * h) || memcmp(frame->palette, smk_get_palette(ref), 768))
+		return 0;
+
+	for (track = 0; track < 7; track ++) {
+		if (frame->audio_size[track] != smk_get_audio_size(ref, track) ||
+			(frame->audio_size[track] && memcmp(frame->audio[track], smk_get_audio(ref, track), frame->audio_size[track])))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Plays a sample through a pipeline of slots (decoding on threads),
+	holding up to hold frames, against smk_next() on a second smk.
+	Rings are followed twice round, then the pipeline is stopped. */
+static unsigned int test_play(const unsigned char * data, unsigned long size, const char * name, unsigned int slots, unsigned int threads, unsigned int hold)
+{
+	struct smk_frame_t * held;
+	unsigned char ** copy;
+	unsigned long f, w, h, step, steps, taken = 0, given = 0;
+	unsigned int i, fail = 0;
+	char want, got;
+	smk s, ref;
+
+	if ((s = smk_open_memory(data, size)) == NULL || (ref = smk_open_memory(data, size)) == NULL) {
+		printf("FAIL: %s: can't open\n", name);
+		exit(1);
+	}
+
+	smk_enable_all(s, 0xFF);
+	smk_enable_all(ref, 0xFF);
+	smk_info_all(s, NULL, &f, NULL);
+	smk_info_video(s, &w, &h, NULL);
+	steps = 2 * (f + 1) + 1;
+
+	if (threads > 1)
+		smk_set_threads(s, threads);
+
+	/* what each held slot held when taken */
+	held = malloc(hold * sizeof(*held));
+	copy = malloc(hold * sizeof(*copy));
+
+	for (i = 0; i < hold; i ++)
+		copy[i] = malloc(w * h + 768);
+
+	if (smk_set_pipeline(s, slots) < 0) {
+		printf("FAIL: %s, %u slots: can't start the pipeline\n", name, slots);
+		exit(1);
+	}
+
+	want = smk_first(ref);
+
+	for (step = 0; step < steps; step ++) {
+		/* every slot held: nothing more until one is given back */
+		if (taken - given == slots && (smk_pipeline_acquire(s, &held[0]) != -1 || smk_last_error() != SMK_ERR_ARGUMENT)) {
+			printf("FAIL: %s, %u slots: acquire with every slot held not refused\n", name, slots);
+			fail = 1;
+			break;
+		}
+
+		/* make room: the oldest held frame must be as it was taken */
+		if (taken - given == hold) {
+			i = given % hold;
+
+			if (memcmp(held[i].video, copy[i], w * h) || memcmp(held[i].palette, copy[i] + w * h, 768)) {
+				printf("FAIL: %s, %u slots, %u threads: held frame %lu changed\n", name, slots, threads, held[i].frame);
+				fail = 1;
+				break;
+			}
+
+			smk_pipeline_release(s);
+			given ++;
+		}
+
+		i = taken % hold;
+		got = smk_pipeline_acquire(s, &held[i]);
+
+		if (got != want) {
+			printf("FAIL: %s, %u slots, %u threads: step %lu gives %d, smk_next %d\n", name, slots, threads, step, got, want);
+			fail = 1;
+			break;
+		}
+
+		if (got == SMK_DONE)
+			break;
+
+		taken ++;
+
+		if (!test_same(&held[i], ref)) {
+			printf("FAIL: %s, %u slots, %u threads: step %lu (frame %lu) differs from smk_next\n", name, slots, threads, step, held[i].frame);
+			fail = 1;
+			break;
+		}
+
+		memcpy(copy[i], held[i].video, w * h);
+		memcpy(copy[i] + w * h, held[i].palette, 768);
+		want = smk_next(ref);
+	}
+
+	/* give back the rest; then there is nothing to give */
+	for (; given < taken; given ++)
+		smk_pipeline_release(s);
+
+	if (smk_pipeline_release(s) != -1 || smk_last_error() != SMK_ERR_ARGUMENT) {
+		printf("FAIL: %s, %u slots: release with nothing held not refused\n", name, slots);
+		fail = 1;
+	}
+
+	smk_set_pipeline(s, 0);
+
+	for (i = 0; i < hold; i ++)
+		free(copy[i]);
+
+	free(copy);
+	free(held);
+	smk_close(ref);
+	smk_close(s);
+	return fail;
+}
+
+/* Stops a pipeline with frames held, checks the smk plays on its own
+	again, then restarts it: from the top, in order.  (Not compared with
+	a second smk: frames are decoded over what the smk last held, which
+	depends on how far the worker got.) */
+static unsigned int test_stop(const unsigned char * data, unsigned long size, const char * name)
+{
+	struct smk_frame_t frame;
+	unsigned long f;
+	unsigned int fail = 0;
+	char first = SMK_MORE;
+	smk s;
+
+	s = smk_open_memory(data, size);
+	smk_enable_all(s, 0xFF);
+	smk_info_all(s, NULL, &f, NULL);
+
+	if (smk_set_pipeline(s, 3) < 0 || smk_pipeline_acquire(s, &frame) < 0 || smk_first(s) != -1) {
+		printf("FAIL: %s: pipeline doesn't start, or smk_first isn't refused while it runs\n", name);
+		fail = 1;
+	}
+
+	smk_pipeline_acquire(s, &frame);
+
+	if (smk_set_pipeline(s, 0) < 0 || smk_pipeline_acquire(s, &frame) != -1 || (first = smk_first(s)) < 0) {
+		printf("FAIL: %s: stopped pipeline still runs\n", name);
+		fail = 1;
+	}
+
+	if (smk_set_pipeline(s, 2) < 0 || smk_pipeline_acquire(s, &frame) != first || frame.frame != 0 ||
+		(f > 1 && (smk_pipeline_acquire(s, &frame) < 0 || frame.frame != 1))) {
+		printf("FAIL: %s: restarted pipeline doesn't start from the top\n", name);
+		fail = 1;
+	}
+
+	smk_close(s);
+	return fail;
+}
+
+/* Closes an smk while its worker waits for a slot (nothing taken, or
+	everything held) */
+static void test_close(const unsigned char * data, unsigned long size, unsigned int slots, int take)
+{
+	struct smk_frame_t frame;
+	unsigned int i;
+	smk s;
+
+	s = smk_open_memory(data, size);
+	smk_enable_all(s, 0xFF);
+	smk_set_pipeline(s, slots);
+
+	for (i = 0; take && i < slots; i ++)
+		smk_pipeline_acquire(s, &frame);
+
+	test_pause();
+	smk_close(s);
+}
+
+int main(void)
+{
+	unsigned char * data;
+	unsigned long size;
+	unsigned int n, i, threads, fail = 0;
+	smk s;
+
+	/* the refusals are expected: keep them out of the log */
+	smk_set_log_callback(NULL, NULL);
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		data = test_sample(n, &size);
+
+		if ((s = smk_open_memory(data, size)) == NULL) {
+			printf("FAIL: %s: can't open\n", test_sample_name(n));
+			fail = 1;
+			free(data);
+			continue;
+		}
+
+		smk_close(s);
+
+		for (i = 0; i < sizeof(test_slots) / sizeof(test_slots[0]); i ++) {
+			for (threads = 1; threads <= 3; threads += 2) {
+				fail |= test_play(data, size, test_sample_name(n), test_slots[i], threads, 1);
+				fail |= test_play(data, size, test_sample_name(n), test_slots[i], threads, test_slots[i]);
+			}
+
+			test_close(data, size, test_slots[i], 0);
+			test_close(data, size, test_slots[i], 1);
+		}
+
+		fail |= test_stop(data, size, test_sample_name(n));
+		free(data);
+	}
+
+	return fail;
+}
+#else
+int main(void)
+{
+	printf("SKIP: needs pthreads\n");
+	return TEST_SKIP;
+}
+#endif
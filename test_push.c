@@ -0,0 +1,205 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_push.c
+		Checks smk_push_feed(): every sample fed whole, one byte at a
+		time and in random pieces (empty feeds among them) gives the
+		frames smk_next() does.  A file cut short gives the frames that
+		are complete; a header cut short gives nothing; a bad signature
+		or tree size fails the feed and every one after it; a huge chunk
+		size fails it as out of memory, if at all, never the program.
+*/
+
+#include "smacker.h"
+#include "test_sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* enough for every sample, ring frame included */
+#define TEST_FRAMES	64
+
+static unsigned long test_ul(const unsigned char * p)
+{
+	return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* What the event callback saw */
+struct test_seen_t {
+	unsigned int headers;
+	unsigned long frames;
+	unsigned long hash[TEST_FRAMES];
+	int bad;
+};
+
+static void test_event(void * userdata, smk s, int event)
+{
+	struct test_seen_t * seen = (struct test_seen_t *)userdata;
+
+	if (event == SMK_EVENT_HEADER) {
+		/* once, before any frame */
+		if (seen->headers ++ || seen->frames)
+			seen->bad = 1;
+
+		smk_enable_all(s, 0xFF);
+	} else if (event == SMK_EVENT_FRAME) {
+		if (!seen->headers || seen->frames >= TEST_FRAMES)
+			seen->bad = 1;
+		else
+			seen->hash[seen->frames ++] = test_hash(s, TEST_HASH_INIT);
+	} else
+		seen->bad = 1;
+}
+
+/* Feeds size bytes of data in pieces: whole (step 0), step bytes at a
+	time, or random pieces from seed (step 1 with seed nonzero), with an
+	empty feed now and then, and one before and after.  Returns the
+	number of feeds that failed. */
+static unsigned long test_feed(const unsigned char * data, unsigned long size, unsigned long step, unsigned long seed, struct test_seen_t * seen)
+{
+	unsigned long pos = 0, n, failed = 0;
+	smk_push push;
+
+	memset(seen, 0, sizeof(*seen));
+
+	if ((push = smk_push_create(test_event, seen)) == NULL) {
+		printf("FAIL: can't create a push decoder\n");
+		exit(1);
+	}
+
+	if (smk_push_feed(push, NULL, 0) < 0)
+		failed ++;
+
+	while (pos < size) {
+		n = step ? step : size;
+
+		if (seed) {
+			seed = (seed * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+			n = (seed >> 16) % 8 ? 1 + (seed >> 8) % 600 : 0;
+		}
+
+		if (n > size - pos)
+			n = size - pos;
+
+		if (smk_push_feed(push, data + pos, n) < 0)
+			failed ++;
+
+		pos += n;
+	}
+
+	if (smk_push_feed(push, data, 0) < 0)
+		failed ++;
+
+	smk_push_close(push);
+	return failed;
+}
+
+int main(void)
+{
+	struct test_seen_t want, got;
+	unsigned char * data, * bad;
+	unsigned long size, f, i, seed;
+	unsigned int n, fail = 0;
+	smk s;
+
+	/* the failures are expected: keep them out of the log */
+	smk_set_log_callback(NULL, NULL);
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		data = test_sample(n, &size);
+
+		if ((s = smk_open_memory(data, size)) == NULL) {
+			printf("FAIL: %s: can't open\n", test_sample_name(n));
+			fail = 1;
+			free(data);
+			continue;
+		}
+
+		/* every chunk once, the ring frame too */
+		memset(&want, 0, sizeof(want));
+		smk_enable_all(s, 0xFF);
+		smk_info_all(s, NULL, &f, NULL);
+		f += (data[20] & 0x01);
+		smk_first(s);
+
+		for (i = 0; i < f && i < TEST_FRAMES; i ++) {
+			want.hash[want.frames ++] = test_hash(s, TEST_HASH_INIT);
+			smk_next(s);
+		}
+
+		smk_close(s);
+
+		if (test_feed(data, size, 0, 0, &got) || got.bad || got.headers != 1 || got.frames != f ||
+			memcmp(want.hash, got.hash, sizeof(want.hash))) {
+			printf("FAIL: %s: fed whole, %lu of %lu frames, differs from smk_next\n", test_sample_name(n), got.frames, f);
+			fail = 1;
+		}
+
+		if (test_feed(data, size, 1, 0, &got) || got.bad || got.headers != 1 || got.frames != f ||
+			memcmp(want.hash, got.hash, sizeof(want.hash))) {
+			printf("FAIL: %s: fed a byte at a time, %lu of %lu frames, differs from smk_next\n", test_sample_name(n), got.frames, f);
+			fail = 1;
+		}
+
+		for (seed = 1; seed <= 3; seed ++) {
+			if (test_feed(data, size, 1, seed * 7919 + n, &got) || got.bad || got.headers != 1 || got.frames != f ||
+				memcmp(want.hash, got.hash, sizeof(want.hash))) {
+				printf("FAIL: %s: fed in random pieces (seed %lu), %lu of %lu frames, differs from smk_next\n", test_sample_name(n), seed, got.frames, f);
+				fail = 1;
+			}
+		}
+
+		/* cut short: the frames before the last */
+		if (test_feed(data, size - 1, 0, 0, &got) || got.bad || got.headers != 1 || got.frames != f - 1 ||
+			memcmp(want.hash, got.hash, (f - 1) * sizeof(unsigned long))) {
+			printf("FAIL: %s: cut short, %lu of %lu frames, differs from smk_next\n", test_sample_name(n), got.frames, f - 1);
+			fail = 1;
+		}
+
+		/* header cut short: nothing, and no error */
+		if (test_feed(data, 104 + 5 * f + test_ul(data + 52) - 1, 1, 0, &got) || got.bad || got.headers || got.frames) {
+			printf("FAIL: %s: header cut short gives %u headers, %lu frames\n", test_sample_name(n), got.headers, got.frames);
+			fail = 1;
+		}
+
+		bad = malloc(size);
+
+		/* bad signature: that feed fails, and the empty one after it */
+		memcpy(bad, data, size);
+		bad[0] = 'X';
+
+		if (test_feed(bad, size, 0, 0, &got) != 2 || smk_last_error() != SMK_ERR_FORMAT || got.bad || got.headers || got.frames) {
+			printf("FAIL: %s: bad signature not refused\n", test_sample_name(n));
+			fail = 1;
+		}
+
+		/* tree size past any file: refused once the fixed part is in
+			(the second piece), and so is every piece after it */
+		memcpy(bad, data, size);
+		bad[52] = bad[53] = bad[54] = bad[55] = 0xFF;
+
+		if (test_feed(bad, size, 52, 0, &got) != (size + 51) / 52 || smk_last_error() != SMK_ERR_FORMAT || got.bad || got.headers || got.frames) {
+			printf("FAIL: %s: huge tree size not refused\n", test_sample_name(n));
+			fail = 1;
+		}
+
+		/* first chunk near 4 GB, keeping its flags: no frames, and at worst out of memory */
+		memcpy(bad, data, size);
+		bad[104] |= 0xF0;
+		bad[105] = bad[106] = bad[107] = 0xFF;
+
+		if ((test_feed(bad, size, 0, 0, &got) && smk_last_error() != SMK_ERR_MEMORY) || got.bad || got.frames) {
+			printf("FAIL: %s: huge chunk size gives %lu frames, error %d\n", test_sample_name(n), got.frames, smk_last_error());
+			fail = 1;
+		}
+
+		free(bad);
+		free(data);
+	}
+
+	return fail;
+}
@@ -0,0 +1,160 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_range.c
+		Checks smk_decode_range(): empty and out-of-file ranges are
+		refused (a file with no frames included, which still reports
+		its frame and count), frames arrive once each and in order,
+		and a whole-file decode gives the same frames on one thread as
+		on several, as does a sub-range.
+*/
+
+#include "smacker.h"
+#include "test_sample.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* enough for every sample */
+#define TEST_FRAMES	64
+
+struct test_run_t {
+	unsigned long size;
+	unsigned long first, next;
+	unsigned long hash[TEST_FRAMES];
+	int bad;
+};
+
+static int test_frame(void * userdata, const struct smk_frame_t * frame)
+{
+	struct test_run_t * run = (struct test_run_t *)userdata;
+	unsigned long h;
+	unsigned int t;
+
+	/* once each, in order */
+	if (frame->frame != run->next || frame->frame >= TEST_FRAMES) {
+		run->bad = 1;
+		return 1;
+	}
+
+	h = test_fnv(frame->palette, 768, TEST_HASH_INIT);
+	h = test_fnv(frame->video, run->size, h);
+
+	for (t = 0; t < 7; t ++)
+		h = test_fnv(frame->audio[t], frame->audio_size[t], h);
+
+	run->hash[run->next ++] = h;
+	return 0;
+}
+
+/* Decodes first .. last of a sample; returns smk_decode_range's result */
+static char test_range(smk s, unsigned long first, unsigned long last, unsigned int threads, unsigned int slots, struct test_run_t * run)
+{
+	unsigned long w, h;
+
+	smk_info_video(s, &w, &h, NULL);
+	memset(run, 0, sizeof(*run));
+	run->size = w * h;
+	run->first = run->next = first;
+	return smk_decode_range(s, first, last, threads, slots, test_frame, run);
+}
+
+int main(void)
+{
+	struct test_run_t want, got;
+	unsigned char * data;
+	unsigned long size, f, first, frame;
+	unsigned int n, threads, fail = 0;
+	smk s;
+
+	smk_set_log_callback(NULL, NULL);
+
+	/* no frames: nothing to decode, and nothing read past the index */
+	data = test_sample_empty(&size);
+
+	if ((s = smk_open_memory(data, size)) == NULL) {
+		printf("FAIL: empty: can't open\n");
+		fail = 1;
+	} else {
+		smk_enable_all(s, 0xFF);
+
+		if (test_range(s, 0, ULONG_MAX, 1, 2, &got) != -1 || smk_last_error() != SMK_ERR_ARGUMENT || got.next) {
+			printf("FAIL: empty: whole-file range not refused\n");
+			fail = 1;
+		}
+
+		if (test_range(s, 0, 0, 3, 2, &got) != -1 || smk_last_error() != SMK_ERR_ARGUMENT || got.next) {
+			printf("FAIL: empty: range 0-0 not refused\n");
+			fail = 1;
+		}
+
+		if (smk_first(s) != -1 || smk_seek_keyframe(s, 0) != -1 || smk_next(s) == -1) {
+			printf("FAIL: empty: smk_first, smk_seek_keyframe or smk_next misbehaves\n");
+			fail = 1;
+		}
+
+		/* no frame to be at, but not a division by zero either */
+		if (smk_info_all(s, &frame, &f, NULL) < 0 || frame || f) {
+			printf("FAIL: empty: smk_info_all gives frame %lu of %lu\n", frame, f);
+			fail = 1;
+		}
+
+		smk_close(s);
+	}
+
+	free(data);
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		data = test_sample(n, &size);
+
+		if ((s = smk_open_memory(data, size)) == NULL) {
+			printf("FAIL: %s: can't open\n", test_sample_name(n));
+			fail = 1;
+			free(data);
+			continue;
+		}
+
+		smk_enable_all(s, 0xFF);
+		smk_info_all(s, NULL, &f, NULL);
+
+		/* bad ranges */
+		if (test_range(s, f, f + 5, 1, 2, &got) != -1 || smk_last_error() != SMK_ERR_ARGUMENT ||
+			test_range(s, f / 2 + 1, f / 2, 1, 2, &got) != -1 || smk_last_error() != SMK_ERR_ARGUMENT) {
+			printf("FAIL: %s: range past the end, or backwards, not refused\n", test_sample_name(n));
+			fail = 1;
+		}
+
+		/* the whole file, clipped */
+		if (test_range(s, 0, ULONG_MAX, 1, 1, &want) < 0 || want.bad || want.next != f) {
+			printf("FAIL: %s: whole file on one thread gives %lu of %lu frames\n", test_sample_name(n), want.next, f);
+			fail = 1;
+		}
+
+		for (threads = 2; threads <= 4; threads ++) {
+			if (test_range(s, 0, f - 1, threads, threads, &got) < 0 || got.bad || got.next != f ||
+				memcmp(want.hash, got.hash, sizeof(want.hash))) {
+				printf("FAIL: %s: whole file on %u threads differs from one thread\n", test_sample_name(n), threads);
+				fail = 1;
+			}
+		}
+
+		/* a few frames from the middle: decoded from the keyframe before them */
+		first = f / 2;
+
+		if (test_range(s, first, first + 2, 3, 2, &got) < 0 || got.bad || got.next != (first + 3 < f ? first + 3 : f) ||
+			memcmp(want.hash + first, got.hash + first, (got.next - first) * sizeof(unsigned long))) {
+			printf("FAIL: %s: frames %lu-%lu differ from the whole-file decode\n", test_sample_name(n), first, first + 2);
+			fail = 1;
+		}
+
+		smk_close(s);
+		free(data);
+	}
+
+	return fail;
+}
@@ -0,0 +1,155 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_readahead.c
+		Checks that read-ahead changes nothing but timing: every sample
+		is opened in disk mode through callbacks that stall on each
+		read, and put through the same plays, rewinds, backward seeks
+		and runs past the end (wrapping rings) with read-ahead off,
+		then on with a few ring sizes; results must match.
+*/
+
+#include "smacker.h"
+#include "test_sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <time.h>
+
+/* Stalls the reader a varying while on each read */
+static void test_stall(struct test_stream_t * t)
+{
+	struct timespec delay;
+
+	t->seed = t->seed * 1103515245UL + 12345UL;
+	delay.tv_sec = 0;
+	delay.tv_nsec = (long)((t->seed >> 16) % 400) * 1000;
+	nanosleep(&delay, NULL);
+}
+
+/* What to do next: play n frames, rewind, or seek to a keyframe (at or before n) */
+enum { TEST_NEXT, TEST_FIRST, TEST_SEEK };
+
+static const struct {
+	int op;
+	/* frame count, or seek target; when negative, frames past the end
+		of the file, or back from its end */
+	long n;
+} test_script[] = {
+	{TEST_FIRST, 0},
+	/* to the end and past it: rings wrap, others stay on SMK_DONE */
+	{TEST_NEXT, -3},
+	{TEST_FIRST, 0},
+	{TEST_NEXT, 3},
+	/* backward seeks, from the end and from the middle */
+	{TEST_SEEK, -1},
+	{TEST_NEXT, 2},
+	{TEST_SEEK, 0},
+	{TEST_NEXT, 4},
+	{TEST_SEEK, -2},
+	{TEST_NEXT, 1},
+	{TEST_SEEK, 1},
+	{TEST_NEXT, -2},
+	{TEST_FIRST, 0},
+	{TEST_NEXT, 1}
+};
+
+#define TEST_STEPS	(sizeof(test_script) / sizeof(test_script[0]))
+/* results kept per run */
+#define TEST_RESULTS	512
+
+/* Runs the script on a sample, noting each call's result and the frame after it */
+static unsigned long test_run(const unsigned char * data, unsigned long size, unsigned int readahead, unsigned long * result)
+{
+	struct test_stream_t stream;
+	unsigned long f = 0, i, count = 0, n;
+	long r;
+	unsigned int step;
+	smk s;
+
+	test_stream_init(&stream, data, size);
+	stream.stall = test_stall;
+	stream.seed = readahead;
+
+	if ((s = smk_open_callbacks(test_stream_read, test_stream_seek, test_stream_tell, &stream, SMK_MODE_DISK)) == NULL)
+		return 0;
+
+	smk_enable_all(s, 0xFF);
+	smk_info_all(s, NULL, &f, NULL);
+
+	if (readahead)
+		smk_set_readahead(s, readahead);
+
+	for (step = 0; step < TEST_STEPS; step ++) {
+		if (test_script[step].n >= 0)
+			n = (unsigned long)test_script[step].n;
+		else if (test_script[step].op == TEST_NEXT)
+			n = f - test_script[step].n;
+		else
+			n = ((unsigned long)-test_script[step].n > f ? 0 : f + test_script[step].n);
+
+		for (i = 0; i < (test_script[step].op == TEST_NEXT ? n : 1) && count + 2 <= TEST_RESULTS; i ++) {
+			switch (test_script[step].op) {
+			case TEST_NEXT:
+				r = smk_next(s);
+				break;
+
+			case TEST_FIRST:
+				r = smk_first(s);
+				break;
+
+			default:
+				r = smk_seek_keyframe(s, n);
+				break;
+			}
+
+			result[count ++] = (unsigned long)r;
+			result[count ++] = test_hash(s, TEST_HASH_INIT);
+		}
+	}
+
+	smk_close(s);
+	return count;
+}
+
+int main(void)
+{
+	const unsigned int readahead[] = {1, 3, 16};
+	unsigned long want[TEST_RESULTS], got[TEST_RESULTS];
+	unsigned long size, count;
+	unsigned char * data;
+	unsigned int n, i, fail = 0;
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		data = test_sample(n, &size);
+
+		if ((count = test_run(data, size, 0, want)) == 0) {
+			printf("FAIL: %s: can't open\n", test_sample_name(n));
+			fail = 1;
+		}
+
+		for (i = 0; count && i < sizeof(readahead) / sizeof(readahead[0]); i ++) {
+			if (test_run(data, size, readahead[i], got) != count || memcmp(want, got, count * sizeof(unsigned long))) {
+				printf("FAIL: %s: read-ahead of %u gives different frames\n", test_sample_name(n), readahead[i]);
+				fail = 1;
+			}
+		}
+
+		free(data);
+	}
+
+	return fail;
+}
+#else
+int main(void)
+{
+	printf("SKIP: read-ahead needs pthreads\n");
+	return TEST_SKIP;
+}
+#endif
@@ -0,0 +1,561 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_sample.c
+		Builds synthetic (but valid) .smk files for the checks:
+		random tree shapes (balanced and deep), v2 and v4 video, palette
+		records with copy and skip runs, and raw or compressed audio in
+		every bit depth and channel layout.  Video data is random bits,
+		so every block type and run length turns up.  Also a memory
+		stream for the checks that open through callbacks.
+*/
+
+#include "test_sample.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* ************************************************************************* */
+/* Output */
+/* ************************************************************************* */
+/* Growing byte buffer, written bytewise or bitwise (LSB first, as the decoder reads) */
+struct test_buf_t {
+	unsigned char * data;
+	unsigned long size, cap;
+	unsigned long bits;
+};
+
+/* Deterministic random numbers, so every run builds the same files */
+static unsigned long test_seed;
+
+static unsigned long test_rand(const unsigned long n)
+{
+	test_seed = (test_seed * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+	return (test_seed >> 8) % n;
+}
+
+static void test_put(struct test_buf_t * const b, const unsigned char c)
+{
+	if (b->size == b->cap) {
+		b->cap = b->cap ? 2 * b->cap : 4096;
+
+		if ((b->data = realloc(b->data, b->cap)) == NULL)
+			abort();
+	}
+
+	b->data[b->size ++] = c;
+}
+
+static void test_put_u32(struct test_buf_t * const b, const unsigned long v)
+{
+	test_put(b, (unsigned char)(v));
+	test_put(b, (unsigned char)(v >> 8));
+	test_put(b, (unsigned char)(v >> 16));
+	test_put(b, (unsigned char)(v >> 24));
+}
+
+static void test_put_random(struct test_buf_t * const b, const unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i ++)
+		test_put(b, (unsigned char)test_rand(256));
+}
+
+static void test_bit(struct test_buf_t * const b, const unsigned int bit)
+{
+	if ((b->bits & 7) == 0)
+		test_put(b, 0);
+
+	if (bit & 1)
+		b->data[b->size - 1] |= 1 << (b->bits & 7);
+
+	b->bits ++;
+}
+
+static void test_bits(struct test_buf_t * const b, const unsigned long v, const unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i ++)
+		test_bit(b, (unsigned int)(v >> i));
+}
+
+/* ************************************************************************* */
+/* Trees */
+/* ************************************************************************* */
+/* An 8-bit tree: its leaf values in order, and the first code found for each value
+	(a skewed tree of 256 leaves has codes up to 255 bits long) */
+struct test_huff8_t {
+	unsigned int leaves;
+	unsigned char value[256];
+	unsigned char skew, absent;
+
+	unsigned char has[256];
+	unsigned char code[256][256];
+	unsigned int len[256];
+};
+
+/* Split of n leaves into left and right subtrees */
+static unsigned int test_split(const unsigned int n, const unsigned char skew)
+{
+	if (skew)
+		return test_rand(2) ? 1 : n - 1;
+
+	return 1 + (unsigned int)test_rand(n - 1);
+}
+
+/* Writes a random subtree of n leaves, noting the path to each value */
+static void test_huff8_node(struct test_buf_t * const b, struct test_huff8_t * const t, const unsigned int n, unsigned int * const next, unsigned char * const path, const unsigned int depth)
+{
+	unsigned int left;
+	unsigned char v;
+
+	if (n == 1) {
+		v = t->value[(*next) ++];
+		test_bit(b, 0);
+		test_bits(b, v, 8);
+
+		if (!t->has[v]) {
+			t->has[v] = 1;
+			memcpy(t->code[v], path, depth);
+			t->len[v] = depth;
+		}
+
+		return;
+	}
+
+	left = test_split(n, t->skew);
+	test_bit(b, 1);
+	path[depth] = 0;
+	test_huff8_node(b, t, left, next, path, depth + 1);
+	path[depth] = 1;
+	test_huff8_node(b, t, n - left, next, path, depth + 1);
+}
+
+/* Writes an 8-bit tree (or an absent one) */
+static void test_huff8_write(struct test_buf_t * const b, struct test_huff8_t * const t)
+{
+	unsigned char path[256];
+	unsigned int next = 0;
+
+	if (t->absent) {
+		test_bit(b, 0);
+		test_bit(b, 0);
+		return;
+	}
+
+	memset(t->has, 0, sizeof(t->has));
+	test_bit(b, 1);
+	test_huff8_node(b, t, t->leaves, &next, path, 0);
+	test_bit(b, 0);
+}
+
+/* Writes a code found by test_huff8_write */
+static void test_huff8_code(struct test_buf_t * const b, const struct test_huff8_t * const t, const unsigned char v)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->len[v]; i ++)
+		test_bit(b, t->code[v][i]);
+}
+
+/* A random value for the TYPE tree: mostly common run lengths */
+static unsigned long test_type_value(void)
+{
+	static const unsigned char len[13] = {0, 0, 1, 2, 3, 7, 15, 30, 59, 60, 61, 62, 63};
+	const unsigned long type = test_rand(4);
+	const unsigned long run = (test_rand(10) < 7) ? len[test_rand(13)] : test_rand(64);
+	return type | (run << 2) | (test_rand(256) << 8);
+}
+
+/* Subtree of n leaves of a 16-bit tree, taking leaf values in order */
+static void test_huff16_node(struct test_buf_t * const b, const struct test_huff8_t * const lo, const struct test_huff8_t * const hi, const unsigned long * const value, const unsigned int n, unsigned int * const next, const unsigned char skew)
+{
+	unsigned int left;
+	unsigned long v;
+
+	if (n == 1) {
+		v = value[(*next) ++];
+		test_bit(b, 0);
+		test_huff8_code(b, lo, (unsigned char)(v & 0xFF));
+		test_huff8_code(b, hi, (unsigned char)(v >> 8));
+		return;
+	}
+
+	left = test_split(n, skew);
+	test_bit(b, 1);
+	test_huff16_node(b, lo, hi, value, left, next, skew);
+	test_huff16_node(b, lo, hi, value, n - left, next, skew);
+}
+
+/* Writes a 16-bit tree of n leaves (0: absent), returning its size field */
+static unsigned long test_huff16_write(struct test_buf_t * const b, const unsigned int n, const unsigned char skew, const int type)
+{
+	static const unsigned long absent[3] = {0, 12, 16};
+	struct test_huff8_t * lo, * hi;
+	unsigned long * value, v;
+	unsigned char used[2][256];
+	unsigned int i, next = 0;
+
+	if (n == 0) {
+		test_bit(b, 0);
+		test_bit(b, 0);
+		return absent[test_rand(3)];
+	}
+
+	if ((lo = calloc(2, sizeof(struct test_huff8_t))) == NULL || (value = malloc(n * sizeof(unsigned long))) == NULL)
+		abort();
+
+	hi = lo + 1;
+	memset(used, 0, sizeof(used));
+
+	/* leaf values first: the low and high trees hold the bytes they use */
+	for (i = 0; i < n; i ++) {
+		value[i] = type ? test_type_value() : test_rand(65536);
+		used[0][value[i] & 0xFF] = 1;
+		used[1][value[i] >> 8] = 1;
+	}
+
+	for (i = 0; i < 256; i ++) {
+		if (used[0][i])
+			lo->value[lo->leaves ++] = (unsigned char)i;
+
+		if (used[1][i])
+			hi->value[hi->leaves ++] = (unsigned char)i;
+	}
+
+	lo->skew = (test_rand(10) < 3);
+	hi->skew = (test_rand(10) < 3);
+	test_bit(b, 1);
+	test_huff8_write(b, lo);
+	test_huff8_write(b, hi);
+
+	/* the three cache values: usually leaf values */
+	for (i = 0; i < 3; i ++) {
+		v = (test_rand(10) < 8) ? value[test_rand(n)] : test_rand(65536);
+		test_bits(b, v & 0xFF, 8);
+		test_bits(b, v >> 8, 8);
+	}
+
+	test_huff16_node(b, lo, hi, value, n, &next, skew);
+	test_bit(b, 0);
+	free(value);
+	free(lo);
+	/* a full binary tree of n leaves has 2n - 1 nodes */
+	return 12 + 4 * (2 * (unsigned long)n - 1);
+}
+
+/* ************************************************************************* */
+/* Records */
+/* ************************************************************************* */
+/* Palette record: colours, copy runs and skips, covering all 256 entries */
+static void test_palette(struct test_buf_t * const b)
+{
+	struct test_buf_t rec = {NULL, 0, 0, 0};
+	unsigned int i = 0, count, src;
+	unsigned long r, n;
+
+	while (i < 256) {
+		r = test_rand(10);
+
+		if (r < 2 && i > 0) {
+			count = 1 + (unsigned int)test_rand(256 - i < 128 ? 256 - i : 128);
+			test_put(&rec, (unsigned char)(0x80 | (count - 1)));
+			i += count;
+		} else if (r < 4) {
+			count = 1 + (unsigned int)test_rand(256 - i < 64 ? 256 - i : 64);
+			src = (unsigned int)test_rand(256 - count + 1);
+
+			/* a copy may not overlap what it writes */
+			if (src < i && src + count > i)
+				continue;
+
+			test_put(&rec, (unsigned char)(0x40 | (count - 1)));
+			test_put(&rec, (unsigned char)src);
+			i += count;
+		} else {
+			test_put(&rec, (unsigned char)test_rand(64));
+			test_put(&rec, (unsigned char)test_rand(64));
+			test_put(&rec, (unsigned char)test_rand(64));
+			i ++;
+		}
+	}
+
+	/* length in 4-byte units, counting the length byte; sometimes padded */
+	n = (rec.size + 1 + 3) / 4;
+
+	if (test_rand(10) < 3)
+		n ++;
+
+	test_put(b, (unsigned char)n);
+
+	for (r = 0; r < 4 * n - 1; r ++)
+		test_put(b, (unsigned char)(r < rec.size ? rec.data[r] : 0));
+
+	free(rec.data);
+}
+
+/* Audio record of a track: raw, or compressed with random trees */
+static void test_audio(struct test_buf_t * const b, const unsigned char compress, const unsigned char bits16, const unsigned char stereo, const unsigned long max_buffer)
+{
+	static const unsigned int leaves[7] = {1, 2, 5, 17, 60, 200, 256};
+	struct test_buf_t rec = {NULL, 0, 0, 0};
+	struct test_huff8_t * t;
+	const unsigned long ss = (bits16 ? 2 : 1) * (stereo ? 2 : 1);
+	const unsigned long unpacked = (1 + test_rand(max_buffer / ss)) * ss;
+	unsigned int i, j;
+
+	if (!compress)
+		test_put_random(&rec, unpacked);
+	else {
+		if ((t = calloc(1, sizeof(struct test_huff8_t))) == NULL)
+			abort();
+
+		test_put_u32(&rec, unpacked);
+		test_bit(&rec, 1);
+		test_bit(&rec, stereo);
+		test_bit(&rec, bits16);
+
+		for (i = 0; i < ss; i ++) {
+			t->leaves = leaves[test_rand(7)];
+			t->skew = (test_rand(10) < 3);
+			t->absent = (test_rand(10) == 0);
+
+			for (j = 0; j < t->leaves; j ++)
+				t->value[j] = (unsigned char)test_rand(256);
+
+			test_huff8_write(&rec, t);
+		}
+
+		/* starting sample values, then random bits */
+		for (i = 0; i < ss; i ++)
+			test_bits(&rec, test_rand(256), 8);
+
+		test_put_random(&rec, unpacked * 2 + 16);
+		free(t);
+	}
+
+	test_put_u32(b, rec.size + 4);
+
+	for (i = 0; i < rec.size; i ++)
+		test_put(b, rec.data[i]);
+
+	free(rec.data);
+}
+
+/* ************************************************************************* */
+/* Files */
+/* ************************************************************************* */
+/* Audio track layouts: compressed, 16-bit, stereo */
+static const unsigned char test_track[7][3] = {
+	{1, 1, 1}, {1, 0, 0}, {0, 0, 1}, {1, 1, 0}, {1, 0, 1}, {0, 1, 1}, {1, 1, 1}
+};
+
+/* What goes in each sample */
+static const struct test_spec_t {
+	const char * name;
+	unsigned long w, h, frames;
+	unsigned char v, ring, tracks, deep, absent;
+} test_spec[TEST_SAMPLES] = {
+	{"v2", 64, 48, 12, '2', 0, 3, 0, 0},
+	{"v4_320_ring", 320, 32, 10, '4', 1, 5, 0, 0},
+	{"v4_640", 640, 16, 6, '4', 0, 1, 0, 0},
+	{"deep_trees", 100, 20, 8, '4', 0, 7, 1, 0},
+	{"absent_trees", 32, 32, 5, '2', 0, 0, 0, 0x03},
+	{"no_video", 16, 16, 5, '2', 0, 2, 0, 0x0F},
+	{"big_ring", 320, 200, 6, '4', 1, 2, 0, 0},
+	{"one_frame", 4, 4, 1, '2', 0, 1, 0, 0},
+	{"odd_width", 36, 40, 7, '4', 1, 4, 0, 0},
+	{"tiny_deep", 8, 8, 8, '2', 0, 6, 1, 0}
+};
+
+/* Builds a file from a spec */
+static unsigned char * test_build(const struct test_spec_t * const spec, const unsigned long seed, unsigned long * const size)
+{
+	static const unsigned int leaves[5] = {1, 3, 40, 300, 1200};
+	static const long fps[3] = {66, 100, -6667};
+	const unsigned long max_buffer = 4096;
+	const unsigned long chunks = spec->frames + spec->ring;
+	struct test_buf_t out = {NULL, 0, 0, 0}, trees = {NULL, 0, 0, 0}, chunk = {NULL, 0, 0, 0};
+	unsigned long tree_size[4], * chunk_size;
+	unsigned char * chunk_type;
+	unsigned long f, i, start;
+	unsigned int n;
+
+	test_seed = seed;
+
+	if ((chunk_size = malloc((chunks + 1) * sizeof(unsigned long))) == NULL || (chunk_type = malloc(chunks + 1)) == NULL)
+		abort();
+
+	/* MMAP, MCLR, FULL and TYPE trees */
+	for (i = 0; i < 4; i ++) {
+		n = spec->deep ? (test_rand(2) ? 200 : 600) : leaves[test_rand(5)];
+
+		if (spec->absent & (1 << i))
+			n = 0;
+
+		tree_size[i] = test_huff16_write(&trees, n, (unsigned char)(spec->deep && test_rand(2)), i == 3);
+	}
+
+	/* chunks: palette now and then, most audio records, and random video bits */
+	for (f = 0; f < chunks; f ++) {
+		start = chunk.size;
+		chunk_type[f] = 0;
+
+		if (f == 0 || test_rand(10) < 3) {
+			test_palette(&chunk);
+			chunk_type[f] |= 0x01;
+		}
+
+		for (i = 0; i < spec->tracks; i ++) {
+			if (test_rand(100) < 85) {
+				test_audio(&chunk, test_track[i][0], test_track[i][1], test_track[i][2], max_buffer);
+				chunk_type[f] |= 0x02 << i;
+			}
+		}
+
+		test_put_random(&chunk, (spec->w / 4) * (spec->h / 4) * 40 + 64);
+
+		while (chunk.size % 4)
+			test_put(&chunk, 0);
+
+		/* keyframe flag in the low bit */
+		chunk_size[f] = (chunk.size - start) | ((f == 0 || test_rand(10) < 2) ? 1 : 0);
+	}
+
+	/* header */
+	test_put(&out, 'S');
+	test_put(&out, 'M');
+	test_put(&out, 'K');
+	test_put(&out, spec->v);
+	test_put_u32(&out, spec->w);
+	test_put_u32(&out, spec->h);
+	test_put_u32(&out, spec->frames);
+	test_put_u32(&out, (unsigned long)fps[test_rand(3)]);
+	test_put_u32(&out, spec->ring);
+
+	for (i = 0; i < 7; i ++)
+		test_put_u32(&out, max_buffer);
+
+	test_put_u32(&out, trees.size);
+
+	for (i = 0; i < 4; i ++)
+		test_put_u32(&out, tree_size[i]);
+
+	for (i = 0; i < 7; i ++)
+		test_put_u32(&out, i < spec->tracks ? 0x40000000UL | ((unsigned long)test_track[i][0] << 31) | ((unsigned long)test_track[i][1] << 29) | ((unsigned long)test_track[i][2] << 28) | 22050 : 0);
+
+	test_put_u32(&out, 0);
+
+	for (f = 0; f < chunks; f ++)
+		test_put_u32(&out, chunk_size[f]);
+
+	for (f = 0; f < chunks; f ++)
+		test_put(&out, chunk_type[f]);
+
+	for (i = 0; i < trees.size; i ++)
+		test_put(&out, trees.data[i]);
+
+	for (i = 0; i < chunk.size; i ++)
+		test_put(&out, chunk.data[i]);
+
+	free(trees.data);
+	free(chunk.data);
+	free(chunk_size);
+	free(chunk_type);
+	*size = out.size;
+	return out.data;
+}
+
+unsigned char * test_sample(const unsigned int n, unsigned long * const size)
+{
+	return test_build(&test_spec[n], 1 + n, size);
+}
+
+unsigned char * test_sample_empty(unsigned long * const size)
+{
+	static const struct test_spec_t empty = {"empty", 16, 16, 0, '2', 0, 1, 0, 0};
+	return test_build(&empty, 100, size);
+}
+
+const char * test_sample_name(const unsigned int n)
+{
+	return test_spec[n].name;
+}
+
+/* ************************************************************************* */
+/* Output hashing */
+/* ************************************************************************* */
+unsigned long test_fnv(const unsigned char * const p, const unsigned long n, unsigned long h)
+{
+	unsigned long i;
+
+	if (p == NULL)
+		return h;
+
+	for (i = 0; i < n; i ++)
+		h = ((h ^ p[i]) * 16777619UL) & 0xFFFFFFFFUL;
+
+	return h;
+}
+
+unsigned long test_hash(const smk s, unsigned long h)
+{
+	unsigned long w, height;
+	unsigned char track;
+	smk_info_video(s, &w, &height, NULL);
+	h = test_fnv(smk_get_video(s), w * height, h);
+	h = test_fnv(smk_get_palette(s), 768, h);
+
+	for (track = 0; track < 7; track ++)
+		h = test_fnv(smk_get_audio(s, track), smk_get_audio_size(s, track), h);
+
+	return h;
+}
+
+/* ************************************************************************* */
+/* Memory streams */
+/* ************************************************************************* */
+void test_stream_init(struct test_stream_t * const stream, const unsigned char * const data, const unsigned long size)
+{
+	stream->data = data;
+	stream->size = size;
+	stream->pos = 0;
+	stream->stall = NULL;
+	stream->seed = 0;
+}
+
+long test_stream_read(void * const handle, void * const buf, unsigned long size)
+{
+	struct test_stream_t * const t = (struct test_stream_t *)handle;
+
+	if (t->stall)
+		t->stall(t);
+
+	if (size > t->size - t->pos)
+		size = t->size - t->pos;
+
+	memcpy(buf, t->data + t->pos, size);
+	t->pos += size;
+	return (long)size;
+}
+
+int test_stream_seek(void * const handle, const unsigned long offset)
+{
+	struct test_stream_t * const t = (struct test_stream_t *)handle;
+
+	if (offset > t->size)
+		return -1;
+
+	t->pos = offset;
+	return 0;
+}
+
+long test_stream_tell(void * const handle)
+{
+	return (long)((struct test_stream_t *)handle)->pos;
+}
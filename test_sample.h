@@ -0,0 +1,55 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_sample.h
+		Synthetic .smk files for the checks (make check), built in memory
+		so no sample files need to ship with the source.
+*/
+
+#ifndef TEST_SAMPLE_H
+#define TEST_SAMPLE_H
+
+#include "smacker.h"
+
+/* number of samples test_sample() can build */
+#define TEST_SAMPLES	10
+
+/* exit code telling the test driver a check was skipped */
+#define TEST_SKIP	77
+
+/** builds sample n (0 .. TEST_SAMPLES - 1) in a malloc'd buffer */
+unsigned char * test_sample(unsigned int n, unsigned long * size);
+/** builds a valid file with no frames at all */
+unsigned char * test_sample_empty(unsigned long * size);
+/** name of sample n, for messages */
+const char * test_sample_name(unsigned int n);
+
+/** folds n bytes at p into FNV-1 hash h (none if p is NULL) */
+unsigned long test_fnv(const unsigned char * p, unsigned long n, unsigned long h);
+/** folds the current frame, palette and enabled audio of s into hash h */
+unsigned long test_hash(const smk s, unsigned long h);
+/** starting value for test_hash */
+#define TEST_HASH_INIT	2166136261UL
+
+/** a seekable stream over a memory buffer, for smk_open_callbacks().
+	stall, if set, runs before every read (to hold the reader up);
+	seed is there for it to use. */
+struct test_stream_t {
+	const unsigned char * data;
+	unsigned long size, pos;
+	void (* stall)(struct test_stream_t * stream);
+	unsigned long seed;
+};
+
+/** points stream at the start of size bytes of data, with no stall */
+void test_stream_init(struct test_stream_t * stream, const unsigned char * data, unsigned long size);
+/** the callbacks, given a struct test_stream_t as their handle.
+	Reads stop at the end of the data; seeks past it fail. */
+long test_stream_read(void * handle, void * buf, unsigned long size);
+int test_stream_seek(void * handle, unsigned long offset);
+long test_stream_tell(void * handle);
+
+#endif
@@ -0,0 +1,92 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_simd.c
+		Checks that the SIMD block writers give byte-identical frames
+		to the portable ones: every sample is decoded with the C writers
+		forced in, then with each SIMD set the CPU supports, on one
+		thread and on worker threads.
+		Built against smacker.c itself, to reach the writer table.
+*/
+
+#include "smacker.c"
+#include "test_sample.h"
+
+/* Decodes every frame of a sample (past the ring frame), noting a hash per frame */
+static void test_decode(const unsigned char * const data, const unsigned long size, const unsigned int threads, unsigned long * const hash, const unsigned long count)
+{
+	unsigned long i;
+	smk s = smk_open_memory(data, size);
+
+	if (s == NULL) {
+		memset(hash, 0, count * sizeof(unsigned long));
+		return;
+	}
+
+	smk_enable_all(s, 0xFF);
+	smk_set_threads(s, threads);
+	smk_first(s);
+
+	for (i = 0; i < count; i ++) {
+		hash[i] = test_hash(s, TEST_HASH_INIT);
+		smk_next(s);
+	}
+
+	smk_close(s);
+}
+
+int main(void)
+{
+#ifdef SMK_BLOCK_X86
+	const struct smk_block_ops_t portable = {smk_block_mono_c, smk_block_full_c, smk_block_double_c, smk_block_half_c};
+	const struct smk_block_ops_t sse2 = {smk_block_mono_sse2, smk_block_full_sse2, smk_block_double_sse2, smk_block_half_sse2};
+	struct smk_block_ops_t ops[3];
+	const char * name[3] = {"sse2", "detected", NULL};
+	/* enough for every sample, twice through its ring */
+	unsigned long want[64], got[64];
+	unsigned long size;
+	unsigned char * data;
+	unsigned int n, i, threads, fail = 0;
+
+	smk_block_init();
+
+	if (!__builtin_cpu_supports("sse2")) {
+		printf("SKIP: no SSE2 on this CPU\n");
+		return TEST_SKIP;
+	}
+
+	/* SSE2 alone, and whatever smk_block_init() picked (SSSE3 mono blocks, if any) */
+	ops[0] = sse2;
+	ops[1] = smk_block;
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		data = test_sample(n, &size);
+
+		for (threads = 1; threads <= 3; threads += 2) {
+			smk_block = portable;
+			test_decode(data, size, threads, want, 64);
+
+			for (i = 0; name[i]; i ++) {
+				smk_block = ops[i];
+				test_decode(data, size, threads, got, 64);
+
+				if (memcmp(want, got, sizeof(want))) {
+					printf("FAIL: %s, %u thread(s): %s block writers differ from the portable ones\n", test_sample_name(n), threads, name[i]);
+					fail = 1;
+				}
+			}
+		}
+
+		free(data);
+	}
+
+	smk_block = ops[1];
+	return fail;
+#else
+	printf("SKIP: no SIMD block writers for this target\n");
+	return TEST_SKIP;
+#endif
+}
@@ -0,0 +1,209 @@
+/**
+	libsmacker - A C library for decoding .smk Smacker Video files
+	Copyright (C) 2012-2021 Greg Kennedy
+
+	See smacker.h for more information.
+
+	test_threads.c
+		Checks that smk on different threads don't disturb each other:
+		every sample is decoded on the main thread for reference, then
+		again on many threads at once - different files side by side
+		(each with its own palette), one file opened on every thread,
+		and clones of one smk made and played on every thread - some
+		with worker threads of their own - and two files read in disk
+		mode through descriptors, each shared by half the threads.
+		Results must match.
+*/
+
+#include "smacker.h"
+#include "test_sample.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+
+#define TEST_THREADS	8
+#define TEST_ROUNDS	3
+
+static unsigned char * test_data[TEST_SAMPLES];
+static unsigned long test_size[TEST_SAMPLES];
+
+/* One thread's work: a sample to open (from memory, or a shared descriptor),
+	or an smk to clone; and what it got */
+struct test_job_t {
+	pthread_t thread;
+	unsigned int sample;
+	int fd;
+	smk parent;
+	unsigned int threads;
+	unsigned long hash;
+};
+
+/* Plays s through, folding every frame into one hash */
+static unsigned long test_play(smk s)
+{
+	unsigned long h = TEST_HASH_INIT, f = 0, i;
+
+	smk_enable_all(s, 0xFF);
+	smk_info_all(s, NULL, &f, NULL);
+	smk_first(s);
+
+	for (i = 0; i < f; i ++) {
+		h = test_hash(s, h);
+		smk_next(s);
+	}
+
+	return h;
+}
+
+static void * test_main(void * arg)
+{
+	struct test_job_t * job = (struct test_job_t *)arg;
+	smk s;
+
+	job->hash = 0;
+
+	if (job->parent)
+		s = smk_clone(job->parent);
+#ifdef HAVE_PREAD
+	else if (job->fd >= 0)
+		s = smk_open_fd(job->fd, SMK_MODE_DISK);
+#endif
+	else
+		s = smk_open_memory(test_data[job->sample], test_size[job->sample]);
+
+	if (s == NULL)
+		return NULL;
+
+	if (job->threads > 1)
+		smk_set_threads(s, job->threads);
+
+	job->hash = test_play(s);
+	smk_close(s);
+	return NULL;
+}
+
+/* Runs the jobs side by side, checking each against the reference */
+static unsigned int test_jobs(struct test_job_t * job, const unsigned long * want, const char * what)
+{
+	unsigned int i, fail = 0;
+
+	for (i = 0; i < TEST_THREADS; i ++) {
+		if (pthread_create(&job[i].thread, NULL, test_main, &job[i])) {
+			printf("FAIL: can't start thread %u\n", i);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < TEST_THREADS; i ++) {
+		pthread_join(job[i].thread, NULL);
+
+		if (job[i].hash != want[job[i].sample]) {
+			printf("FAIL: %s: thread %u (%s, %u decoding threads) differs from the reference\n", what, i, test_sample_name(job[i].sample), job[i].threads);
+			fail = 1;
+		}
+	}
+
+	return fail;
+}
+
+int main(void)
+{
+	struct test_job_t job[TEST_THREADS];
+	unsigned long want[TEST_SAMPLES];
+	unsigned int n, i, round, fail = 0;
+	FILE * file[2];
+	smk s;
+
+	for (n = 0; n < TEST_SAMPLES; n ++) {
+		test_data[n] = test_sample(n, &test_size[n]);
+
+		if ((s = smk_open_memory(test_data[n], test_size[n])) == NULL) {
+			printf("FAIL: %s: can't open\n", test_sample_name(n));
+			return 1;
+		}
+
+		want[n] = test_play(s);
+		smk_close(s);
+	}
+
+	for (round = 0; round < TEST_ROUNDS; round ++) {
+		/* different files side by side */
+		for (i = 0; i < TEST_THREADS; i ++) {
+			job[i].sample = (i + round) % TEST_SAMPLES;
+			job[i].fd = -1;
+			job[i].parent = NULL;
+			job[i].threads = (i & 1) + 1;
+		}
+
+		fail |= test_jobs(job, want, "different files");
+
+		/* one file, opened on every thread */
+		for (i = 0; i < TEST_THREADS; i ++) {
+			job[i].sample = round % TEST_SAMPLES;
+			job[i].threads = (i & 2) ? 2 : 1;
+		}
+
+		fail |= test_jobs(job, want, "one file");
+
+		/* clones of one smk, all made at once */
+		n = (round * 3 + 1) % TEST_SAMPLES;
+		s = smk_open_memory(test_data[n], test_size[n]);
+
+		for (i = 0; i < TEST_THREADS; i ++) {
+			job[i].sample = n;
+			job[i].parent = s;
+			job[i].threads = (i % 3 == 2) ? 3 : 1;
+		}
+
+		fail |= test_jobs(job, want, "clones");
+		smk_close(s);
+
+		for (i = 0; i < TEST_THREADS; i ++)
+			job[i].parent = NULL;
+
+#ifdef HAVE_PREAD
+
+		/* two files, each descriptor shared by half the threads */
+		for (n = 0; n < 2; n ++) {
+			i = (round + 4 * n) % TEST_SAMPLES;
+
+			if ((file[n] = tmpfile()) == NULL || fwrite(test_data[i], 1, test_size[i], file[n]) != test_size[i] || fflush(file[n])) {
+				printf("FAIL: can't write a temporary file\n");
+				return 1;
+			}
+		}
+
+		for (i = 0; i < TEST_THREADS; i ++) {
+			job[i].sample = (round + 4 * (i & 1)) % TEST_SAMPLES;
+			job[i].fd = fileno(file[i & 1]);
+			job[i].threads = (i & 2) ? 2 : 1;
+		}
+
+		fail |= test_jobs(job, want, "shared descriptors");
+
+		for (i = 0; i < TEST_THREADS; i ++)
+			job[i].fd = -1;
+
+		fclose(file[0]);
+		fclose(file[1]);
+#else
+		(void)file;
+#endif
+	}
+
+	for (n = 0; n < TEST_SAMPLES; n ++)
+		free(test_data[n]);
+
+	return fail;
+}
+#else
+int main(void)
+{
+	printf("SKIP: needs pthreads\n");
+	return TEST_SKIP;
+}
+#endif